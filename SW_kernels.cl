@@ -1,5 +1,10 @@
+#ifndef GAP_START_PENALTY
 #define GAP_START_PENALTY -8
+#endif
+
+#ifndef GAP_EXTEND_PENALTY
 #define GAP_EXTEND_PENALTY -1
+#endif
 
 //kernel void calc_fmat_row(global long * f_mat_prev_row, global long * h_mat_prev_row, global long * f_mat_row) {
 //    const int id = get_global_id(0);
@@ -75,3 +80,245 @@ kernel void downsweep(global int * padded_row, const int depth) {
 	int right_elem = padded_row[z + pow2(depth + 1) - 1];
 	padded_row[z + pow2(depth + 1) - 1] = max(left_elem, right_elem) + (pow2(depth) * GAP_EXTEND_PENALTY);
 }
+
+// Segmented scan: many references packed into one row, each preceded by a boundary column
+// flagged in segment_flags (the score profile makes H zero there). tree_flags starts every row
+// as a copy of segment_flags and is combined in place by the upsweep. Node values are the best
+// h_hat decayed to the node's last column, counting only columns from the last flag on, so no
+// gap runs across a boundary. The exclusive result at a flagged column is SCAN_NEG_INF.
+#define SCAN_NEG_INF (-(1 << 29))
+
+int decay(int value, int distance) {
+    return max(value + distance * GAP_EXTEND_PENALTY, SCAN_NEG_INF);
+}
+
+// Equal A, C, G or T match, anything else (N included) is a mismatch, as in the score profiles
+int substitution_score(char a, char b, int match, int mismatch) {
+    return a == b && (a == 'A' || a == 'C' || a == 'G' || a == 'T') ? match : mismatch;
+}
+
+kernel void segmented_upsweep(global int * padded_row, global int * tree_flags, const int depth) {
+    const size_t z = get_global_id(0) * pow2(depth + 1);
+    const size_t left = z + pow2(depth) - 1;
+    const size_t right = z + pow2(depth + 1) - 1;
+
+    if (!tree_flags[right]) {
+        padded_row[right] = max(decay(padded_row[left], pow2(depth)), padded_row[right]);
+    }
+    tree_flags[right] = tree_flags[left] | tree_flags[right];
+}
+
+kernel void segmented_downsweep(global int * padded_row, global const int * segment_flags, global const int * tree_flags, const int depth) {
+    const size_t z = get_global_id(0) * pow2(depth + 1);
+    const size_t left = z + pow2(depth) - 1;
+    const size_t right = z + pow2(depth + 1) - 1;
+
+    const int left_total = padded_row[left];
+    const int prefix = padded_row[right];
+    padded_row[left] = prefix;
+
+    if (segment_flags[left + 1]) {
+        padded_row[right] = SCAN_NEG_INF;
+    } else if (tree_flags[left]) {
+        padded_row[right] = decay(left_total, 1);
+    } else {
+        padded_row[right] = max(decay(prefix, pow2(depth)), decay(left_total, 1));
+    }
+}
+
+// One work item per database sequence. A work group is one length-sorted batch of sequences
+// packed lane-interleaved (residue j of lane l at batch_offset + j * lanes + l), so neighbouring
+// work items read neighbouring bytes and run for roughly the same number of columns.
+// The H and E columns over the query live in h_col/e_col, interleaved the same way.
+kernel void database_search_kernel(global const char * query, const int query_length, global const char * packed_db, global const uint * batch_offsets, global const int * lengths, const uint first_batch, const uint num_sequences, const int match, const int mismatch, global int * h_col, global int * e_col, global int * scores) {
+    const size_t id = get_global_id(0);
+    const size_t stride = get_global_size(0);
+    const size_t lanes = get_local_size(0);
+
+    if (id >= num_sequences) {
+        return;
+    }
+
+    const size_t batch = first_batch + get_group_id(0);
+    global const char * seq = packed_db + batch_offsets[batch] + get_local_id(0);
+    const int length = lengths[batch * lanes + get_local_id(0)];
+
+    for (int i = 0; i < query_length; ++i) {
+        h_col[i * stride + id] = 0;
+        e_col[i * stride + id] = 0;
+    }
+
+    int best = 0;
+    for (int j = 0; j < length; ++j) {
+        const char c = seq[j * lanes];
+        int h_diag = 0;
+        int h_up = 0;
+        int f = 0;
+        for (int i = 0; i < query_length; ++i) {
+            const size_t idx = i * stride + id;
+            const int h_left = h_col[idx];
+            const int e = max(e_col[idx], h_left + GAP_START_PENALTY) + GAP_EXTEND_PENALTY;
+            f = max(f, h_up + GAP_START_PENALTY) + GAP_EXTEND_PENALTY;
+            const int h = max(max(h_diag + substitution_score(query[i], c, match, mismatch), max(e, f)), 0);
+            h_diag = h_left;
+            h_up = h;
+            h_col[idx] = h;
+            e_col[idx] = e;
+            best = max(best, h);
+        }
+    }
+
+    scores[id] = best;
+}
+
+kernel void column_max_kernel(global int * h_mat_row_buffer, global int * column_max_buffer) {
+    const size_t id = get_global_id(0);
+
+    column_max_buffer[id] = max(column_max_buffer[id], h_mat_row_buffer[id]);
+}
+
+// One work item per packed segment: the best column max between its boundary column and the
+// next one, earliest column on ties. segment_end is relative to the segment, one past the last
+// residue like reference_end.
+kernel void segment_max_kernel(global const int * column_max_buffer, global const uint * segment_offsets, const uint num_segments, global int * segment_max, global uint * segment_end) {
+    const size_t id = get_global_id(0);
+    if (id >= num_segments) {
+        return;
+    }
+
+    const uint begin = segment_offsets[id];
+    const uint end = segment_offsets[id + 1];
+    int best = 0;
+    uint best_end = 0;
+    for (uint c = begin + 1; c < end; ++c) {
+        if (column_max_buffer[c] > best) {
+            best = column_max_buffer[c];
+            best_end = c - begin;
+        }
+    }
+
+    segment_max[id] = best;
+    segment_end[id] = best_end;
+}
+
+// Reduces values[0, length) to one (max, index) pair per work group. Ties go to the lowest index.
+// The local size must be a power of 2.
+kernel void reduce_max_kernel(global int * values, const uint length, local int * local_max, local uint * local_index, global int * group_max, global uint * group_index) {
+    const size_t lid = get_local_id(0);
+
+    int best = 0;
+    uint best_index = 0;
+    for (size_t k = get_global_id(0); k < length; k += get_global_size(0)) {
+        if (values[k] > best) {
+            best = values[k];
+            best_index = k;
+        }
+    }
+
+    local_max[lid] = best;
+    local_index[lid] = best_index;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (size_t offset = get_local_size(0) / 2; offset > 0; offset /= 2) {
+        if (lid < offset) {
+            const int other = local_max[lid + offset];
+            const uint other_index = local_index[lid + offset];
+            if (other > local_max[lid] || (other == local_max[lid] && other_index < local_index[lid])) {
+                local_max[lid] = other;
+                local_index[lid] = other_index;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        group_max[get_group_id(0)] = local_max[0];
+        group_index[get_group_id(0)] = local_index[0];
+    }
+}
+
+// Blocked anti-diagonal wavefront, the alternative to the row scan for long queries. The matrix is
+// cut into tiles of get_local_size(0) query rows by tile_cols reference columns, and each launch
+// runs one anti-diagonal of tiles, one work group per tile, starting at first_tile_row.
+// Inside a tile work item r owns query row r and runs one column behind item r-1, which hands it
+// H and F through local memory (double buffered by step parity). Between tiles the borders go
+// through global memory: H/F of the last row per reference column, H/E of the last column per
+// query row, and per tile row the H corner the next tile to the right starts its diagonal from.
+// best_score/best_end keep the best cell per query row, earliest column on ties.
+kernel void wavefront_tile_kernel(global const char * query, const int query_length, global const char * reference, const int reference_length,
+                                  const int tile_cols, const int diagonal, const int first_tile_row, const int match, const int mismatch,
+                                  global int * border_h_row, global int * border_f_row, global int * border_h_col, global int * border_e_col,
+                                  global int * corner_h, global int * best_score, global int * best_end, local int * local_h, local int * local_f) {
+    const int tile_rows = get_local_size(0);
+    const int r = get_local_id(0);
+    const int tile_row = first_tile_row + get_group_id(0);
+    const int i0 = tile_row * tile_rows;
+    const int j0 = (diagonal - tile_row) * tile_cols;
+    const int rows = min(tile_rows, query_length - i0);
+    const int cols = min(tile_cols, reference_length - j0);
+    const int i = i0 + r;
+    const bool active = r < rows;
+
+    int h_left = 0;
+    int e = 0;
+    int h_diag = 0;
+    char q = 0;
+    int best = 0;
+    int best_j = 0;
+    if (active) {
+        h_left = border_h_col[i];
+        e = border_e_col[i];
+        h_diag = r == 0 ? corner_h[tile_row] : border_h_col[i - 1];
+        q = query[i];
+        best = best_score[i];
+        best_j = best_end[i];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+    for (int step = 0; step < rows + cols - 1; ++step) {
+        const int c = step - r;
+        if (active && c >= 0 && c < cols) {
+            const int j = j0 + c;
+            int h_up;
+            int f_up;
+            if (r == 0) {
+                h_up = border_h_row[j];
+                f_up = border_f_row[j];
+                if (c == cols - 1) {
+                    corner_h[tile_row] = h_up;
+                }
+            } else {
+                h_up = local_h[((step + 1) & 1) * tile_rows + r - 1];
+                f_up = local_f[((step + 1) & 1) * tile_rows + r - 1];
+            }
+
+            e = max(e, h_left + GAP_START_PENALTY) + GAP_EXTEND_PENALTY;
+            const int f = max(f_up, h_up + GAP_START_PENALTY) + GAP_EXTEND_PENALTY;
+            const int h = max(max(h_diag + substitution_score(q, reference[j], match, mismatch), max(e, f)), 0);
+            h_diag = h_up;
+            h_left = h;
+
+            local_h[(step & 1) * tile_rows + r] = h;
+            local_f[(step & 1) * tile_rows + r] = f;
+
+            if (h > best) {
+                best = h;
+                best_j = j + 1;
+            }
+            if (r == rows - 1) {
+                border_h_row[j] = h;
+                border_f_row[j] = f;
+            }
+            if (c == cols - 1) {
+                border_h_col[i] = h;
+                border_e_col[i] = e;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+    }
+
+    if (active) {
+        best_score[i] = best;
+        best_end[i] = best_j;
+    }
+}
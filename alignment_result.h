@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Best local alignment of one query against one reference.
+struct AlignmentResult {
+    int32_t score = 0;
+    size_t reference_end = 0; // one past the last reference residue of the alignment, 0 when score is 0
+};
@@ -0,0 +1,279 @@
+#include "checkpoint.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    const char kCheckpointMagic[8] = { 'S', 'W', 'C', 'K', 'P', 'T', '0', '1' };
+    const size_t kWriteBufferSize = 4 * 1024 * 1024;
+
+    template <class T>
+    void Append(std::vector<char> & buffer, const T & value) {
+        const char * bytes = reinterpret_cast<const char *>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    void AppendRow(std::vector<char> & buffer, const std::vector<int32_t> & row) {
+        Append(buffer, static_cast<uint64_t>(row.size()));
+        for (int32_t value : row) {
+            uint32_t zigzag = (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+            while (zigzag >= 0x80) {
+                buffer.push_back(static_cast<char>((zigzag & 0x7f) | 0x80));
+                zigzag >>= 7;
+            }
+            buffer.push_back(static_cast<char>(zigzag));
+        }
+    }
+
+    class CheckpointReader {
+    public:
+        explicit CheckpointReader(std::vector<char> data) : data_(std::move(data)), offset_(0) {}
+
+        template <class T>
+        T Read() {
+            T value;
+            Take(&value, sizeof(T));
+            return value;
+        }
+
+        void Take(void * out, size_t size) {
+            if (data_.size() - offset_ < size) {
+                throw std::runtime_error("Checkpoint is truncated");
+            }
+            std::memcpy(out, data_.data() + offset_, size);
+            offset_ += size;
+        }
+
+        std::vector<int32_t> ReadRow() {
+            const uint64_t size = Read<uint64_t>();
+            if (size > data_.size() - offset_) {
+                throw std::runtime_error("Checkpoint is truncated");
+            }
+
+            std::vector<int32_t> row(static_cast<size_t>(size));
+            for (auto & value : row) {
+                uint32_t zigzag = 0;
+                for (int shift = 0; ; shift += 7) {
+                    if (offset_ == data_.size() || shift > 28) {
+                        throw std::runtime_error("Checkpoint row is corrupt");
+                    }
+                    const uint8_t byte = static_cast<uint8_t>(data_[offset_++]);
+                    zigzag |= static_cast<uint32_t>(byte & 0x7f) << shift;
+                    if (!(byte & 0x80)) {
+                        break;
+                    }
+                }
+                value = static_cast<int32_t>(zigzag >> 1) ^ -static_cast<int32_t>(zigzag & 1);
+            }
+            return row;
+        }
+
+        bool AtEnd() { return offset_ == data_.size(); }
+
+    private:
+        std::vector<char> data_;
+        size_t offset_;
+    };
+
+    std::string GetDirectory(const std::string & path) {
+        const size_t slash = path.find_last_of('/');
+        if (slash == std::string::npos) {
+            return ".";
+        }
+        return slash == 0 ? "/" : path.substr(0, slash);
+    }
+
+    void WriteFileSynced(const std::string & path, const std::vector<char> & buffer) {
+        const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + path + ": " + std::strerror(errno));
+        }
+
+        const char * data = buffer.data();
+        size_t size = buffer.size();
+        while (size > 0) {
+            const ssize_t written = write(fd, data, size);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                const int error = errno;
+                close(fd);
+                throw std::runtime_error("Could not write " + path + ": " + std::strerror(error));
+            }
+            data += written;
+            size -= written;
+        }
+
+        if (fsync(fd) != 0) {
+            const int error = errno;
+            close(fd);
+            throw std::runtime_error("Could not sync " + path + ": " + std::strerror(error));
+        }
+        if (close(fd) != 0) {
+            throw std::runtime_error("Could not close " + path + ": " + std::strerror(errno));
+        }
+    }
+
+    void SyncDirectory(const std::string & directory) {
+        const int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open " + directory + ": " + std::strerror(errno));
+        }
+        const int result = fsync(fd);
+        const int error = errno;
+        close(fd);
+        if (result != 0) {
+            throw std::runtime_error("Could not sync " + directory + ": " + std::strerror(error));
+        }
+    }
+}
+
+void WriteCheckpoint(const std::string & path, const RowScanCheckpoint & checkpoint) {
+    std::vector<char> buffer(kCheckpointMagic, kCheckpointMagic + sizeof(kCheckpointMagic));
+    buffer.reserve(kWriteBufferSize);
+    Append(buffer, checkpoint.reference_hash);
+    Append(buffer, checkpoint.reference_length);
+    Append(buffer, checkpoint.query_hash);
+    Append(buffer, checkpoint.scoring.match);
+    Append(buffer, checkpoint.scoring.mismatch);
+    Append(buffer, checkpoint.scoring.gap_start_penalty);
+    Append(buffer, checkpoint.scoring.gap_extend_penalty);
+    Append(buffer, checkpoint.chunk_length);
+    Append(buffer, checkpoint.chunk_overlap);
+    Append(buffer, checkpoint.chunk);
+    Append(buffer, checkpoint.row);
+    Append(buffer, checkpoint.best.score);
+    Append(buffer, static_cast<uint64_t>(checkpoint.best.reference_end));
+    AppendRow(buffer, checkpoint.h_prev_row);
+    AppendRow(buffer, checkpoint.f_prev_row);
+    AppendRow(buffer, checkpoint.column_max);
+
+    // The data is on disk before the rename and the rename before we return, so a crash at any
+    // point leaves either the previous checkpoint or this one, never a torn file
+    const std::string temp_path = path + ".tmp";
+    WriteFileSynced(temp_path, buffer);
+
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Could not rename " + temp_path + " to " + path + ": " + std::strerror(errno));
+    }
+    SyncDirectory(GetDirectory(path));
+}
+
+bool ReadCheckpoint(const std::string & path, RowScanCheckpoint & checkpoint) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+
+    std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    CheckpointReader reader(std::move(data));
+
+    char magic[sizeof(kCheckpointMagic)];
+    reader.Take(magic, sizeof(magic));
+    if (std::memcmp(magic, kCheckpointMagic, sizeof(magic)) != 0) {
+        throw std::runtime_error(path + " is not a row scan checkpoint");
+    }
+
+    checkpoint.reference_hash = reader.Read<uint64_t>();
+    checkpoint.reference_length = reader.Read<uint64_t>();
+    checkpoint.query_hash = reader.Read<uint64_t>();
+    checkpoint.scoring.match = reader.Read<int32_t>();
+    checkpoint.scoring.mismatch = reader.Read<int32_t>();
+    checkpoint.scoring.gap_start_penalty = reader.Read<int32_t>();
+    checkpoint.scoring.gap_extend_penalty = reader.Read<int32_t>();
+    checkpoint.chunk_length = reader.Read<uint64_t>();
+    checkpoint.chunk_overlap = reader.Read<uint64_t>();
+    checkpoint.chunk = reader.Read<uint64_t>();
+    checkpoint.row = reader.Read<uint64_t>();
+    checkpoint.best.score = reader.Read<int32_t>();
+    checkpoint.best.reference_end = static_cast<size_t>(reader.Read<uint64_t>());
+    checkpoint.h_prev_row = reader.ReadRow();
+    checkpoint.f_prev_row = reader.ReadRow();
+    checkpoint.column_max = reader.ReadRow();
+    if (!reader.AtEnd()) {
+        throw std::runtime_error(path + " has trailing data");
+    }
+
+    return true;
+}
+
+CheckpointWriter::CheckpointWriter(const std::string & path)
+    : path_(path), busy_(false), stop_(false), num_written_(0) {
+    thread_ = std::thread([this]() { WriterLoop(); });
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+}
+
+bool CheckpointWriter::IsBusy() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return busy_;
+}
+
+size_t CheckpointWriter::GetNumWritten() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_written_;
+}
+
+void CheckpointWriter::Write(std::unique_ptr<RowScanCheckpoint> checkpoint, std::vector<cl_event> ready) {
+    {
+        // One at a time: wait out the previous checkpoint rather than drop this one
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return !busy_; });
+        pending_ = std::move(checkpoint);
+        pending_ready_ = std::move(ready);
+        busy_ = true;
+    }
+    cv_.notify_all();
+}
+
+void CheckpointWriter::WriterLoop() {
+    while (true) {
+        std::unique_ptr<RowScanCheckpoint> checkpoint;
+        std::vector<cl_event> ready;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return stop_ || pending_; });
+            if (!pending_) {
+                return;
+            }
+            checkpoint = std::move(pending_);
+            ready.swap(pending_ready_);
+        }
+
+        bool written = false;
+        try {
+            cl_int error = ready.empty() ? CL_SUCCESS : clWaitForEvents(static_cast<cl_uint>(ready.size()), ready.data());
+            for (cl_event event : ready) {
+                clReleaseEvent(event);
+            }
+            ready.clear();
+            CheckError(error);
+            WriteCheckpoint(path_, *checkpoint);
+            written = true;
+        } catch (const std::exception & e) {
+            std::cerr << "Checkpoint failed: " << e.what() << std::endl;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            busy_ = false;
+            num_written_ += written ? 1 : 0;
+        }
+        cv_.notify_all();
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "alignment_result.h"
+#include "fasta.h"
+#include "opencl_utils.h"
+#include "scoring.h"
+
+// Row scan state at a row boundary: enough to continue a scan without redoing the chunks and
+// rows before it.
+struct RowScanCheckpoint {
+    uint64_t reference_hash = 0;
+    uint64_t reference_length = 0;
+    uint64_t query_hash = 0;
+    ScoringScheme scoring;
+    uint64_t chunk_length = 0;  // plan the chunks were cut with
+    uint64_t chunk_overlap = 0;
+    uint64_t chunk = 0;         // next chunk to scan, num_chunks once the scan is done
+    uint64_t row = 0;           // rows of that chunk already done
+    AlignmentResult best;       // over all completed chunks
+
+    // Row size ints each, only when row > 0: the last finished H and F rows and the column
+    // maxima of the chunk so far.
+    std::vector<int32_t> h_prev_row;
+    std::vector<int32_t> f_prev_row;
+    std::vector<int32_t> column_max;
+};
+
+// Rows are stored zigzag varint coded, which takes most H and F values down to a byte.
+// The file is written next to path and renamed over it, so a crash never leaves half of one.
+void WriteCheckpoint(const std::string & path, const RowScanCheckpoint & checkpoint);
+
+// False if there is no checkpoint at path; throws if the file is not a valid one.
+bool ReadCheckpoint(const std::string & path, RowScanCheckpoint & checkpoint);
+
+// Writes checkpoints on its own thread, one at a time, so the scan only pays for queueing the
+// row reads. A failed write is reported and the scan goes on.
+class CheckpointWriter {
+public:
+    explicit CheckpointWriter(const std::string & path);
+    ~CheckpointWriter(); // finishes the checkpoint in progress
+
+    CheckpointWriter(const CheckpointWriter & other) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter & other) = delete;
+
+    // True while a checkpoint is being written; the scan skips taking a new one until then.
+    bool IsBusy();
+
+    // The ready events are waited on and released before the checkpoint is written, e.g. the
+    // non-blocking reads filling its rows. Waits for the previous checkpoint if it is still busy.
+    void Write(std::unique_ptr<RowScanCheckpoint> checkpoint, std::vector<cl_event> ready);
+
+    size_t GetNumWritten();
+
+private:
+    void WriterLoop();
+
+    std::string path_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unique_ptr<RowScanCheckpoint> pending_;
+    std::vector<cl_event> pending_ready_;
+    bool busy_;
+    bool stop_;
+    size_t num_written_;
+    std::thread thread_;
+};
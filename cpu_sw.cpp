@@ -0,0 +1,97 @@
+#include "cpu_sw.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+AlignmentResult CpuSmithWaterman(const std::string & query, const char * reference, size_t begin, size_t end, const ScoringScheme & scoring) {
+    const size_t query_length = query.size();
+
+    // H and E columns over the query, swept across the reference one residue at a time
+    std::vector<int32_t> h_col(query_length, 0);
+    std::vector<int32_t> e_col(query_length, 0);
+
+    AlignmentResult result;
+    for (size_t j = begin; j < end; ++j) {
+        const char c = reference[j];
+        int32_t h_diag = 0;
+        int32_t h_up = 0;
+        int32_t f = 0;
+        for (size_t i = 0; i < query_length; ++i) {
+            const int32_t h_left = h_col[i];
+            const int32_t e = std::max(e_col[i], h_left + scoring.gap_start_penalty) + scoring.gap_extend_penalty;
+            f = std::max(f, h_up + scoring.gap_start_penalty) + scoring.gap_extend_penalty;
+            const int32_t h = std::max(std::max(h_diag + GetSubstitutionScore(query[i], c, scoring), std::max(e, f)), 0);
+            h_diag = h_left;
+            h_up = h;
+            h_col[i] = h;
+            e_col[i] = e;
+            if (h > result.score) {
+                result.score = h;
+                result.reference_end = j + 1;
+            }
+        }
+    }
+
+    return result;
+}
+
+size_t GetChunkOverlap(size_t query_length, const ScoringScheme & scoring) {
+    if (scoring.gap_extend_penalty >= 0 || scoring.match <= 0) {
+        throw std::logic_error("Chunk overlap needs a positive match score and a negative gap extension");
+    }
+
+    // Every reference residue beyond the query length is paid for with at least one gap extension
+    const size_t max_gap_columns = static_cast<size_t>(scoring.match) * query_length / static_cast<size_t>(-scoring.gap_extend_penalty);
+    return query_length + max_gap_columns;
+}
+
+std::vector<AlignmentResult> CpuAlignQueries(ThreadPool & pool, const std::vector<std::string> & queries, const std::string & reference, const ScoringScheme & scoring,
+                                                size_t chunk_size, size_t query_batch_size) {
+    const NumaReplicas replicas(pool, reference, NumaPlacement::kDefault);
+    return CpuAlignQueries(pool, queries, replicas, scoring, chunk_size, query_batch_size);
+}
+
+std::vector<AlignmentResult> CpuAlignQueries(ThreadPool & pool, const std::vector<std::string> & queries, const NumaReplicas & reference, const ScoringScheme & scoring,
+                                                size_t chunk_size, size_t query_batch_size) {
+    chunk_size = std::max<size_t>(chunk_size, 1);
+    query_batch_size = std::max<size_t>(query_batch_size, 1);
+
+    size_t max_query_length = 0;
+    for (const auto & query : queries) {
+        max_query_length = std::max(max_query_length, query.size());
+    }
+    const size_t overlap = GetChunkOverlap(max_query_length, scoring);
+
+    const size_t num_chunks = std::max<size_t>((reference.size() + chunk_size - 1) / chunk_size, 1);
+    const size_t num_batches = (queries.size() + query_batch_size - 1) / query_batch_size;
+
+    // chunk_results[c * queries.size() + q]
+    std::vector<AlignmentResult> chunk_results(num_chunks * queries.size());
+    pool.ParallelFor(0, num_chunks * num_batches, 1, [&](size_t task_begin, size_t task_end) {
+        for (size_t task = task_begin; task < task_end; ++task) {
+            const size_t chunk = task / num_batches;
+            const size_t batch = task % num_batches;
+
+            const size_t begin = std::min(chunk * chunk_size, reference.size());
+            const size_t end = std::min(begin + chunk_size + overlap, reference.size());
+            const size_t last_query = std::min((batch + 1) * query_batch_size, queries.size());
+            for (size_t q = batch * query_batch_size; q < last_query; ++q) {
+                chunk_results[chunk * queries.size() + q] = CpuSmithWaterman(queries[q], reference.Get(), begin, end, scoring);
+            }
+        }
+    });
+
+    std::vector<AlignmentResult> results(queries.size());
+    pool.ParallelFor(0, queries.size(), query_batch_size, [&](size_t query_begin, size_t query_end) {
+        for (size_t q = query_begin; q < query_end; ++q) {
+            for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+                const AlignmentResult & candidate = chunk_results[chunk * queries.size() + q];
+                if (candidate.score > results[q].score) {
+                    results[q] = candidate;
+                }
+            }
+        }
+    });
+
+    return results;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "alignment_result.h"
+#include "numa.h"
+#include "scoring.h"
+#include "thread_pool.h"
+
+// Scalar affine-gap local alignment of query against reference[begin, end), using the same
+// recurrence as the OpenCL kernels. reference_end is relative to the start of reference.
+AlignmentResult CpuSmithWaterman(const std::string & query, const char * reference, size_t begin, size_t end, const ScoringScheme & scoring);
+
+// Longest stretch of reference a positive scoring local alignment of a query of this length can
+// cover. Chunks are extended by this much so no alignment is lost at a chunk boundary.
+size_t GetChunkOverlap(size_t query_length, const ScoringScheme & scoring);
+
+// Cuts the reference into chunks and the queries into batches and runs each (chunk, batch) pair
+// as one pool task; the per-chunk results are then merged per query, also on the pool.
+std::vector<AlignmentResult> CpuAlignQueries(ThreadPool & pool, const std::vector<std::string> & queries, const std::string & reference, const ScoringScheme & scoring,
+                                                size_t chunk_size = 1 << 20, size_t query_batch_size = 16);
+
+// As above, every task reading the copy of the reference on its own worker's node.
+std::vector<AlignmentResult> CpuAlignQueries(ThreadPool & pool, const std::vector<std::string> & queries, const NumaReplicas & reference, const ScoringScheme & scoring,
+                                                size_t chunk_size = 1 << 20, size_t query_batch_size = 16);
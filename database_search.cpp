@@ -0,0 +1,251 @@
+#include "database_search.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <queue>
+#include <stdexcept>
+
+#include "thread_pool.h"
+
+namespace {
+    // Per scratch buffer, on top of the memory plan, so that a search takes several launches and
+    // merging overlaps with scoring.
+    const cl_ulong kMaxScratchBufferSize = 256 * 1024 * 1024;
+
+    struct HeapEntry {
+        int32_t score;
+        size_t sequence_index;
+    };
+
+    // Orders the heap so that the worst kept hit is on top: lowest score, then latest index.
+    bool operator<(const HeapEntry & lhs, const HeapEntry & rhs) {
+        if (lhs.score != rhs.score) {
+            return lhs.score > rhs.score;
+        }
+        return lhs.sequence_index < rhs.sequence_index;
+    }
+}
+
+DatabaseSearch::DatabaseSearch(cl_context context, cl_device_id device_id, cl_command_queue command_queue, cl_program program, std::vector<FastaRecord> database, size_t lane_width)
+    : context_(context), device_id_(device_id), command_queue_(command_queue), database_(std::move(database)), lane_width_(lane_width), num_residues_(0), packed_size_(0) {
+    cl_int error = CL_SUCCESS;
+    kernel_ = clCreateKernel(program, "database_search_kernel", &error);
+    CheckError(error);
+
+    // Sort by length, longest first, so that each batch wastes as few lane-columns as possible
+    sorted_order_.resize(database_.size());
+    std::iota(sorted_order_.begin(), sorted_order_.end(), 0);
+    std::stable_sort(sorted_order_.begin(), sorted_order_.end(), [this](size_t lhs, size_t rhs) {
+        return database_[lhs].sequence.size() > database_[rhs].sequence.size();
+    });
+
+    num_batches_ = (database_.size() + lane_width_ - 1) / lane_width_;
+
+    // Bin into batches and pack each batch lane-interleaved
+    size_t packed_size = 0;
+    batch_offsets_.resize(num_batches_);
+    for (size_t b = 0; b < num_batches_; ++b) {
+        if (packed_size > std::numeric_limits<cl_uint>::max()) {
+            throw std::runtime_error("Database too large for 32-bit batch offsets");
+        }
+        batch_offsets_[b] = static_cast<cl_uint>(packed_size);
+        packed_size += database_[sorted_order_[b * lane_width_]].sequence.size() * lane_width_;
+    }
+
+    for (const auto & record : database_) {
+        num_residues_ += record.sequence.size();
+    }
+
+    // Check the resident part against the device before building anything
+    packed_size_ = packed_size;
+    budget_ = GetMemoryBudget(device_id_);
+    last_plan_ = PlanSearch(1);
+    if (!last_plan_.fits) {
+        PrintMemoryPlan(last_plan_);
+        throw std::runtime_error("Database does not fit in device memory");
+    }
+
+    std::vector<char> packed_db(std::max<size_t>(packed_size, 1), 0);
+    std::vector<cl_int> lengths(std::max<size_t>(num_batches_ * lane_width_, 1), 0);
+    GetThreadPool().ParallelFor(0, num_batches_, 64, [&](size_t batch_begin, size_t batch_end) {
+        for (size_t k = batch_begin * lane_width_; k < std::min(batch_end * lane_width_, sorted_order_.size()); ++k) {
+            const std::string & sequence = database_[sorted_order_[k]].sequence;
+            const size_t lane = k % lane_width_;
+            char * batch = packed_db.data() + batch_offsets_[k / lane_width_];
+            for (size_t j = 0; j < sequence.size(); ++j) {
+                batch[j * lane_width_ + lane] = sequence[j];
+            }
+            lengths[k] = static_cast<cl_int>(sequence.size());
+        }
+    });
+
+    std::vector<cl_uint> batch_offsets(batch_offsets_);
+    batch_offsets.resize(std::max<size_t>(num_batches_, 1), 0);
+
+    packed_db_buffer_ = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, packed_db.size(), packed_db.data(), &error);
+    CheckError(error);
+
+    batch_offsets_buffer_ = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint) * batch_offsets.size(), batch_offsets.data(), &error);
+    CheckError(error);
+
+    lengths_buffer_ = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_int) * lengths.size(), lengths.data(), &error);
+    CheckError(error);
+}
+
+DatabaseSearch::~DatabaseSearch() {
+    clReleaseMemObject(packed_db_buffer_);
+    clReleaseMemObject(batch_offsets_buffer_);
+    clReleaseMemObject(lengths_buffer_);
+    clReleaseKernel(kernel_);
+}
+
+MemoryPlan DatabaseSearch::PlanSearch(size_t query_length) {
+    PlanRequest request;
+    request.engine = EngineKind::kDatabaseSearch;
+    request.max_query_length = query_length;
+    request.reference_length = num_residues_;
+    request.num_sequences = database_.size();
+    request.lane_width = lane_width_;
+    request.packed_database_size = packed_size_;
+    request.max_scratch_size = kMaxScratchBufferSize;
+    return PlanMemory(request, budget_);
+}
+
+std::vector<DatabaseHit> DatabaseSearch::Search(const std::string & query, const ScoringScheme & scoring, size_t top_n) {
+    last_stats_ = DatabaseSearchStats();
+    last_stats_.num_sequences = database_.size();
+
+    if (query.empty() || num_batches_ == 0 || top_n == 0) {
+        return {};
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    last_plan_ = PlanSearch(query.size());
+    if (!last_plan_.fits) {
+        throw std::runtime_error("Query too long for the device scratch space");
+    }
+
+    const size_t sequences_per_launch = last_plan_.sequences_per_launch;
+    const size_t batches_per_launch = sequences_per_launch / lane_width_;
+
+    cl_int error = CL_SUCCESS;
+    cl_mem query_buffer = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, query.size(), const_cast<char*>(query.data()), &error);
+    CheckError(error);
+
+    cl_mem h_col_buffer = clCreateBuffer(context_, CL_MEM_READ_WRITE, sizeof(cl_int) * query.size() * sequences_per_launch, NULL, &error);
+    CheckError(error);
+
+    cl_mem e_col_buffer = clCreateBuffer(context_, CL_MEM_READ_WRITE, sizeof(cl_int) * query.size() * sequences_per_launch, NULL, &error);
+    CheckError(error);
+
+    // Double buffered so the device can score chunk k while the host merges chunk k-1
+    cl_mem scores_buffers[2];
+    std::vector<cl_int> host_scores[2];
+    for (int k = 0; k < 2; ++k) {
+        scores_buffers[k] = clCreateBuffer(context_, CL_MEM_WRITE_ONLY, sizeof(cl_int) * sequences_per_launch, NULL, &error);
+        CheckError(error);
+        host_scores[k].resize(sequences_per_launch);
+    }
+
+    const cl_int query_length = static_cast<cl_int>(query.size());
+    error = clSetKernelArg(kernel_, 0, sizeof(cl_mem), &query_buffer);
+    error |= clSetKernelArg(kernel_, 1, sizeof(cl_int), &query_length);
+    error |= clSetKernelArg(kernel_, 2, sizeof(cl_mem), &packed_db_buffer_);
+    error |= clSetKernelArg(kernel_, 3, sizeof(cl_mem), &batch_offsets_buffer_);
+    error |= clSetKernelArg(kernel_, 4, sizeof(cl_mem), &lengths_buffer_);
+    error |= clSetKernelArg(kernel_, 7, sizeof(cl_int), &scoring.match);
+    error |= clSetKernelArg(kernel_, 8, sizeof(cl_int), &scoring.mismatch);
+    error |= clSetKernelArg(kernel_, 9, sizeof(cl_mem), &h_col_buffer);
+    error |= clSetKernelArg(kernel_, 10, sizeof(cl_mem), &e_col_buffer);
+    CheckError(error);
+
+    std::priority_queue<HeapEntry> top_hits;
+    auto merge_chunk = [&](size_t first_batch, size_t num_sequences, const std::vector<cl_int> & scores) {
+        for (size_t k = 0; k < num_sequences; ++k) {
+            HeapEntry entry { scores[k], sorted_order_[first_batch * lane_width_ + k] };
+            if (top_hits.size() < top_n) {
+                top_hits.push(entry);
+            } else if (entry < top_hits.top()) {
+                top_hits.pop();
+                top_hits.push(entry);
+            }
+        }
+    };
+
+    cl_event prev_kernel_finished = nullptr;
+    cl_event prev_read_finished = nullptr;
+    size_t prev_first_batch = 0;
+    size_t prev_num_sequences = 0;
+
+    for (size_t first_batch = 0, chunk = 0; first_batch < num_batches_; first_batch += batches_per_launch, ++chunk) {
+        const size_t num_batches = std::min(batches_per_launch, num_batches_ - first_batch);
+        const size_t num_sequences = std::min(num_batches * lane_width_, database_.size() - first_batch * lane_width_);
+        cl_mem scores_buffer = scores_buffers[chunk % 2];
+
+        const cl_uint first_batch_arg = static_cast<cl_uint>(first_batch);
+        const cl_uint num_sequences_arg = static_cast<cl_uint>(num_sequences);
+        error = clSetKernelArg(kernel_, 5, sizeof(cl_uint), &first_batch_arg);
+        error |= clSetKernelArg(kernel_, 6, sizeof(cl_uint), &num_sequences_arg);
+        error |= clSetKernelArg(kernel_, 11, sizeof(cl_mem), &scores_buffer);
+        CheckError(error);
+
+        // The scratch columns are shared between launches, so chain them on the (possibly out of order) queue
+        cl_event kernel_finished;
+        size_t global = num_batches * lane_width_;
+        size_t local = lane_width_;
+        error = clEnqueueNDRangeKernel(command_queue_, kernel_, 1, NULL, &global, &local, prev_kernel_finished ? 1 : 0, prev_kernel_finished ? &prev_kernel_finished : nullptr, &kernel_finished);
+        CheckError(error);
+
+        cl_event read_finished;
+        error = clEnqueueReadBuffer(command_queue_, scores_buffer, CL_FALSE, 0, sizeof(cl_int) * num_sequences, host_scores[chunk % 2].data(), 1, &kernel_finished, &read_finished);
+        CheckError(error);
+        clFlush(command_queue_);
+
+        if (prev_read_finished) {
+            error = clWaitForEvents(1, &prev_read_finished);
+            CheckError(error);
+            clReleaseEvent(prev_read_finished);
+            clReleaseEvent(prev_kernel_finished);
+            merge_chunk(prev_first_batch, prev_num_sequences, host_scores[(chunk + 1) % 2]);
+        }
+
+        prev_kernel_finished = kernel_finished;
+        prev_read_finished = read_finished;
+        prev_first_batch = first_batch;
+        prev_num_sequences = num_sequences;
+        ++last_stats_.num_launches;
+    }
+
+    error = clWaitForEvents(1, &prev_read_finished);
+    CheckError(error);
+    clReleaseEvent(prev_read_finished);
+    clReleaseEvent(prev_kernel_finished);
+    merge_chunk(prev_first_batch, prev_num_sequences, host_scores[(last_stats_.num_launches + 1) % 2]);
+
+    clReleaseMemObject(query_buffer);
+    clReleaseMemObject(h_col_buffer);
+    clReleaseMemObject(e_col_buffer);
+    clReleaseMemObject(scores_buffers[0]);
+    clReleaseMemObject(scores_buffers[1]);
+
+    std::vector<DatabaseHit> hits;
+    hits.reserve(top_hits.size());
+    while (!top_hits.empty()) {
+        const HeapEntry & entry = top_hits.top();
+        const FastaRecord & record = database_[entry.sequence_index];
+        hits.push_back(DatabaseHit { entry.sequence_index, record.name, record.sequence.size(), entry.score });
+        top_hits.pop();
+    }
+    std::reverse(hits.begin(), hits.end());
+
+    auto stop = std::chrono::steady_clock::now();
+    last_stats_.cells = static_cast<uint64_t>(query.size()) * num_residues_;
+    last_stats_.seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() / 1000000000.0;
+    last_stats_.gcups = last_stats_.seconds > 0 ? last_stats_.cells / last_stats_.seconds / 1000000000.0 : 0.0;
+
+    return hits;
+}
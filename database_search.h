@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "fasta.h"
+#include "memory_planner.h"
+#include "opencl_utils.h"
+#include "scoring.h"
+
+struct DatabaseHit {
+    size_t sequence_index; // index into the database as it was read
+    std::string name;
+    size_t length;
+    int32_t score;
+};
+
+struct DatabaseSearchStats {
+    size_t num_sequences = 0;
+    size_t num_launches = 0;
+    uint64_t cells = 0;
+    double seconds = 0.0;
+    double gcups = 0.0;
+};
+
+// SWIPE-style database scan: one query against many short references. The database is sorted by
+// length and cut into batches of lane_width sequences; each batch is stored lane-interleaved and
+// runs as one work group, one work item per sequence. Scores stream back chunk by chunk into a
+// top-N heap while the device works on the next chunk.
+class DatabaseSearch {
+public:
+    DatabaseSearch(cl_context context, cl_device_id device_id, cl_command_queue command_queue, cl_program program, std::vector<FastaRecord> database, size_t lane_width = 64);
+    ~DatabaseSearch();
+
+    DatabaseSearch(const DatabaseSearch & other) = delete;
+    DatabaseSearch& operator=(const DatabaseSearch & other) = delete;
+
+    // Hits are returned best first; ties keep database order.
+    std::vector<DatabaseHit> Search(const std::string & query, const ScoringScheme & scoring, size_t top_n);
+
+    const DatabaseSearchStats & GetLastStats() { return last_stats_; }
+    const MemoryPlan & GetLastPlan() { return last_plan_; }
+    size_t GetNumSequences() { return database_.size(); }
+    uint64_t GetNumResidues() { return num_residues_; }
+
+private:
+    MemoryPlan PlanSearch(size_t query_length);
+
+    cl_context context_;
+    cl_device_id device_id_;
+    cl_command_queue command_queue_;
+    cl_kernel kernel_;
+
+    std::vector<FastaRecord> database_;
+    size_t lane_width_;
+    size_t num_batches_;
+    uint64_t num_residues_;
+    uint64_t packed_size_;
+    MemoryBudget budget_;
+
+    std::vector<size_t> sorted_order_;   // sorted position -> database index
+    std::vector<cl_uint> batch_offsets_; // start of each batch in packed_db_buffer_
+
+    cl_mem packed_db_buffer_;
+    cl_mem batch_offsets_buffer_;
+    cl_mem lengths_buffer_;
+
+    DatabaseSearchStats last_stats_;
+    MemoryPlan last_plan_;
+};
@@ -0,0 +1,154 @@
+#include "fasta.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include "thread_pool.h"
+
+namespace {
+    // Sequence bodies are cleaned in pieces of about this size, cut at line boundaries
+    const size_t kFastaBlockSize = 4 * 1024 * 1024;
+
+    struct FastaBlock {
+        size_t record;
+        size_t begin;
+        size_t end;
+        size_t out_offset;
+    };
+
+    // Calls fn on every residue of [begin, end), which must start at a line start. Skips
+    // whitespace and ';' comment lines.
+    template <class F>
+    void ForEachResidue(const std::vector<char> & text, size_t begin, size_t end, F && fn) {
+        bool line_start = true;
+        bool comment = false;
+        for (size_t k = begin; k < end; ++k) {
+            const char c = text[k];
+            if (c == '\n') {
+                line_start = true;
+                comment = false;
+                continue;
+            }
+            if (line_start && c == ';') {
+                comment = true;
+            }
+            line_start = false;
+            if (!comment && !std::isspace(static_cast<unsigned char>(c))) {
+                fn(c);
+            }
+        }
+    }
+}
+
+std::vector<FastaRecord> ReadFasta(const std::string & filename) {
+    std::ifstream input_file(filename, std::ios_base::in | std::ios_base::binary);
+    if (!input_file) {
+        throw std::runtime_error("Unable to open FASTA file " + filename);
+    }
+
+    // Pipes and /dev/stdin have no size to read up front; those are read through to the end
+    std::vector<char> text;
+    input_file.seekg(0, std::ios::end);
+    const std::streamoff size = input_file.tellg();
+    if (size >= 0) {
+        text.resize(static_cast<size_t>(size));
+        input_file.seekg(0, std::ios::beg);
+        input_file.read(text.data(), text.size());
+    } else {
+        input_file.clear();
+        text.assign(std::istreambuf_iterator<char>(input_file), std::istreambuf_iterator<char>());
+    }
+
+    // Headers are found serially (memchr for '>' is cheap), the bodies are cleaned on the pool
+    std::vector<FastaRecord> records;
+    std::vector<std::pair<size_t, size_t>> bodies;
+    size_t first_header = text.size();
+    for (size_t k = 0; k < text.size(); ) {
+        const char * found = static_cast<const char *>(std::memchr(text.data() + k, '>', text.size() - k));
+        if (!found) {
+            break;
+        }
+
+        const size_t header = found - text.data();
+        k = header + 1;
+        if (header != 0 && text[header - 1] != '\n') {
+            continue;
+        }
+
+        const char * newline = static_cast<const char *>(std::memchr(text.data() + header, '\n', text.size() - header));
+        const size_t header_end = newline ? newline - text.data() : text.size();
+
+        FastaRecord record;
+        size_t name_end = header + 1;
+        while (name_end < header_end && !std::isspace(static_cast<unsigned char>(text[name_end]))) {
+            ++name_end;
+        }
+        record.name.assign(text.data() + header + 1, text.data() + name_end);
+        records.push_back(std::move(record));
+
+        if (!bodies.empty()) {
+            bodies.back().second = header;
+        } else {
+            first_header = header;
+        }
+        bodies.emplace_back(std::min(header_end + 1, text.size()), text.size());
+        k = std::min(header_end + 1, text.size());
+    }
+
+    ForEachResidue(text, 0, first_header, [&filename](char) {
+        throw std::runtime_error("FASTA file " + filename + " does not start with a header");
+    });
+
+    std::vector<FastaBlock> blocks;
+    for (size_t r = 0; r < bodies.size(); ++r) {
+        size_t begin = bodies[r].first;
+        const size_t end = bodies[r].second;
+        do {
+            size_t block_end = std::min(begin + kFastaBlockSize, end);
+            while (block_end < end && text[block_end - 1] != '\n') {
+                ++block_end;
+            }
+            blocks.push_back(FastaBlock { r, begin, block_end, 0 });
+            begin = block_end;
+        } while (begin < end);
+    }
+
+    ThreadPool & pool = GetThreadPool();
+
+    // First pass counts the residues of each block, second pass writes them at their offset
+    std::vector<size_t> block_sizes(blocks.size(), 0);
+    pool.ParallelFor(0, blocks.size(), 1, [&](size_t block_begin, size_t block_end) {
+        for (size_t b = block_begin; b < block_end; ++b) {
+            ForEachResidue(text, blocks[b].begin, blocks[b].end, [&block_sizes, b](char) { ++block_sizes[b]; });
+        }
+    });
+
+    for (size_t b = 0; b < blocks.size(); ++b) {
+        std::string & sequence = records[blocks[b].record].sequence;
+        blocks[b].out_offset = sequence.size();
+        sequence.resize(sequence.size() + block_sizes[b]);
+    }
+
+    pool.ParallelFor(0, blocks.size(), 1, [&](size_t block_begin, size_t block_end) {
+        for (size_t b = block_begin; b < block_end; ++b) {
+            char * out = &records[blocks[b].record].sequence[0] + blocks[b].out_offset;
+            ForEachResidue(text, blocks[b].begin, blocks[b].end, [&out](char c) {
+                *out++ = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+            });
+        }
+    });
+
+    return records;
+}
+
+uint64_t HashSequence(const std::string & sequence) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : sequence) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
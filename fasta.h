@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct FastaRecord {
+    std::string name;     // header up to the first whitespace, without the '>'
+    std::string sequence; // upper-cased, line breaks removed
+};
+
+std::vector<FastaRecord> ReadFasta(const std::string & filename);
+
+// FNV-1a over the residues; identifies a sequence by content (checkpoints, result cache).
+uint64_t HashSequence(const std::string & sequence);
@@ -0,0 +1,308 @@
+#include "hit_writer.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    const char kBinaryMagic[8] = { 'S', 'W', 'H', 'I', 'T', 'S', '0', '1' };
+    const size_t kWriteBufferSize = 8 * 1024 * 1024;
+    const size_t kQueueSlots = 1024; // batches, a power of two
+    const int kSpinsBeforeSleep = 64;
+    const auto kIdleSleep = std::chrono::microseconds(500);
+    const auto kIdleFlush = std::chrono::milliseconds(100); // a partial buffer goes out after this long without hits
+
+    bool EndsWith(const std::string & value, const std::string & suffix) {
+        return value.size() >= suffix.size() && value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    template <class T>
+    void AppendRaw(std::vector<char> & buffer, const T & value) {
+        const char * bytes = reinterpret_cast<const char *>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    void AppendString(std::vector<char> & buffer, const std::string & value) {
+        buffer.insert(buffer.end(), value.begin(), value.end());
+    }
+
+    void AppendUnsigned(std::vector<char> & buffer, uint64_t value) {
+        char digits[20];
+        size_t length = 0;
+        do {
+            digits[length++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value > 0);
+        while (length > 0) {
+            buffer.push_back(digits[--length]);
+        }
+    }
+
+    void AppendSigned(std::vector<char> & buffer, int64_t value) {
+        if (value < 0) {
+            buffer.push_back('-');
+            AppendUnsigned(buffer, static_cast<uint64_t>(-(value + 1)) + 1);
+        } else {
+            AppendUnsigned(buffer, static_cast<uint64_t>(value));
+        }
+    }
+}
+
+HitFormat GetHitFormat(const std::string & filename) {
+    if (EndsWith(filename, ".sam")) {
+        return HitFormat::kSam;
+    } else if (EndsWith(filename, ".hits")) {
+        return HitFormat::kBinary;
+    }
+    return HitFormat::kTabular;
+}
+
+HitWriter::HitWriter(const std::string & filename, HitFormat format, std::vector<std::string> query_names,
+                     std::vector<std::string> reference_names, std::vector<uint64_t> reference_lengths)
+    : format_(format), query_names_(std::move(query_names)), reference_names_(std::move(reference_names)),
+      reference_lengths_(std::move(reference_lengths)), slots_(new Slot[kQueueSlots]), slot_mask_(kQueueSlots - 1) {
+    if (filename == "-") {
+        // Whatever went through std::cout so far comes first
+        std::cout.flush();
+        fd_ = STDOUT_FILENO;
+        owns_fd_ = false;
+    } else {
+        fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("Could not open " + filename + ": " + std::strerror(errno));
+        }
+        owns_fd_ = true;
+    }
+
+    for (size_t k = 0; k < kQueueSlots; ++k) {
+        slots_[k].sequence.store(k, std::memory_order_relaxed);
+    }
+
+    buffer_.reserve(kWriteBufferSize + 4096);
+    if (format_ == HitFormat::kSam) {
+        AppendString(buffer_, "@HD\tVN:1.6\tSO:unsorted\n");
+        for (size_t k = 0; k < reference_names_.size(); ++k) {
+            AppendString(buffer_, "@SQ\tSN:");
+            AppendString(buffer_, reference_names_[k]);
+            AppendString(buffer_, "\tLN:");
+            AppendUnsigned(buffer_, k < reference_lengths_.size() ? reference_lengths_[k] : 0);
+            buffer_.push_back('\n');
+        }
+        AppendString(buffer_, "@PG\tID:SmithWatermanOpenCL\tPN:main\n");
+    } else if (format_ == HitFormat::kBinary) {
+        buffer_.insert(buffer_.end(), kBinaryMagic, kBinaryMagic + sizeof(kBinaryMagic));
+    } else {
+        AppendString(buffer_, "#query\treference\tscore\treference_begin\treference_end\tcigar\n");
+    }
+
+    thread_ = std::thread([this]() { WriterLoop(); });
+}
+
+HitWriter::~HitWriter() {
+    try {
+        Close();
+    } catch (const std::exception & e) {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+void HitWriter::Write(std::vector<Hit> hits) {
+    if (hits.empty()) {
+        return;
+    }
+
+    if (!TryPush(hits)) {
+        ++producer_stalls_;
+        int spins = 0;
+        while (!TryPush(hits)) {
+            if (++spins < kSpinsBeforeSleep) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(kIdleSleep);
+            }
+        }
+    }
+}
+
+void HitWriter::Close() {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+
+    closing_ = true;
+    thread_.join();
+
+    if (owns_fd_ && close(fd_) != 0 && !failed_) {
+        error_ = errno;
+        failed_ = true;
+    }
+    if (failed_) {
+        throw std::runtime_error(std::string("Could not write hits: ") + std::strerror(error_));
+    }
+}
+
+HitWriterStats HitWriter::GetStats() {
+    HitWriterStats stats;
+    stats.hits = hits_;
+    stats.batches = batches_;
+    stats.bytes = bytes_;
+    stats.writes = writes_;
+    stats.producer_stalls = producer_stalls_;
+    return stats;
+}
+
+bool HitWriter::TryPush(std::vector<Hit> & hits) {
+    uint64_t position = push_position_.load(std::memory_order_relaxed);
+    Slot * slot = nullptr;
+    while (true) {
+        slot = &slots_[position & slot_mask_];
+        const uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+        const int64_t difference = static_cast<int64_t>(sequence) - static_cast<int64_t>(position);
+        if (difference == 0) {
+            if (push_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return false; // full: the writer has not taken this slot's previous batch yet
+        } else {
+            position = push_position_.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->hits = std::move(hits);
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+bool HitWriter::TryPop(std::vector<Hit> & hits) {
+    // Only the writer thread pops
+    const uint64_t position = pop_position_.load(std::memory_order_relaxed);
+    Slot & slot = slots_[position & slot_mask_];
+    if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+        return false;
+    }
+
+    hits = std::move(slot.hits);
+    slot.hits = std::vector<Hit>();
+    slot.sequence.store(position + slot_mask_ + 1, std::memory_order_release);
+    pop_position_.store(position + 1, std::memory_order_relaxed);
+    return true;
+}
+
+void HitWriter::WriterLoop() {
+    std::vector<Hit> hits;
+    int idle_spins = 0;
+    auto last_hit = std::chrono::steady_clock::now();
+
+    while (true) {
+        // Close comes after the last Write returned: seen before a pop, an empty queue stays empty
+        const bool closing = closing_;
+        if (TryPop(hits)) {
+            for (const Hit & hit : hits) {
+                Format(hit);
+                if (buffer_.size() >= kWriteBufferSize) {
+                    Flush();
+                }
+            }
+            hits_ += hits.size();
+            ++batches_;
+            idle_spins = 0;
+            last_hit = std::chrono::steady_clock::now();
+            continue;
+        }
+
+        if (closing) {
+            break;
+        }
+
+        if (++idle_spins < kSpinsBeforeSleep) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (!buffer_.empty() && std::chrono::steady_clock::now() - last_hit >= kIdleFlush) {
+            Flush();
+        }
+        std::this_thread::sleep_for(kIdleSleep);
+    }
+
+    Flush();
+}
+
+void HitWriter::Format(const Hit & hit) {
+    const std::string & query_name = query_names_[hit.query_index];
+    const std::string & reference_name = reference_names_[hit.reference_index];
+    const bool has_cigar = !hit.cigar.empty();
+
+    if (format_ == HitFormat::kBinary) {
+        AppendRaw(buffer_, hit.query_index);
+        AppendRaw(buffer_, hit.reference_index);
+        AppendRaw(buffer_, hit.score);
+        AppendRaw(buffer_, hit.reference_begin);
+        AppendRaw(buffer_, hit.reference_end);
+        return;
+    }
+
+    if (format_ == HitFormat::kSam) {
+        // QNAME FLAG RNAME POS MAPQ CIGAR RNEXT PNEXT TLEN SEQ QUAL. A mapped record needs POS and
+        // CIGAR, which only a traceback gives, so a hit without one is unmapped but keeps AS and XE.
+        const bool mapped = hit.score > 0 && has_cigar;
+        AppendString(buffer_, query_name);
+        AppendString(buffer_, mapped ? "\t0\t" : "\t4\t");
+        AppendString(buffer_, mapped ? reference_name : "*");
+        buffer_.push_back('\t');
+        AppendUnsigned(buffer_, mapped ? hit.reference_begin + 1 : 0);
+        AppendString(buffer_, mapped ? "\t255\t" : "\t0\t");
+        AppendString(buffer_, mapped ? hit.cigar : "*");
+        AppendString(buffer_, "\t*\t0\t0\t*\t*\tAS:i:");
+        AppendSigned(buffer_, hit.score);
+        AppendString(buffer_, "\tXE:i:");
+        AppendUnsigned(buffer_, hit.reference_end);
+        buffer_.push_back('\n');
+        return;
+    }
+
+    AppendString(buffer_, query_name);
+    buffer_.push_back('\t');
+    AppendString(buffer_, reference_name);
+    buffer_.push_back('\t');
+    AppendSigned(buffer_, hit.score);
+    buffer_.push_back('\t');
+    if (has_cigar) {
+        AppendUnsigned(buffer_, hit.reference_begin);
+    } else {
+        buffer_.push_back('*');
+    }
+    buffer_.push_back('\t');
+    AppendUnsigned(buffer_, hit.reference_end);
+    buffer_.push_back('\t');
+    AppendString(buffer_, has_cigar ? hit.cigar : "*");
+    buffer_.push_back('\n');
+}
+
+void HitWriter::Flush() {
+    const char * data = buffer_.data();
+    size_t size = buffer_.size();
+    while (size > 0 && !failed_) {
+        ssize_t written = write(fd_, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            // Keep draining the queue so producers never block on a dead file
+            error_ = errno;
+            failed_ = true;
+            break;
+        }
+        data += written;
+        size -= written;
+        bytes_ += written;
+        ++writes_;
+    }
+    buffer_.clear();
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class HitFormat {
+    kTabular, // query, reference, score, reference begin and end, CIGAR
+    kSam,     // SAM records, one per hit, score in AS:i and end in XE:i; unmapped without a CIGAR
+    kBinary,  // "SWHITS01", then packed records of query and reference index, score, begin, end
+};
+
+// .sam is SAM, .hits binary, anything else tabular.
+HitFormat GetHitFormat(const std::string & filename);
+
+// query_index and reference_index point into the name tables the writer was made with.
+// reference_begin and cigar are only known when a traceback was done; cigar is empty otherwise.
+struct Hit {
+    uint32_t query_index = 0;
+    uint32_t reference_index = 0;
+    int32_t score = 0;
+    uint64_t reference_begin = 0;
+    uint64_t reference_end = 0; // one past the last aligned residue, as in AlignmentResult
+    std::string cigar;
+};
+
+struct HitWriterStats {
+    uint64_t hits = 0;
+    uint64_t batches = 0;
+    uint64_t bytes = 0;
+    uint64_t writes = 0;          // write calls, each of up to the buffer size
+    uint64_t producer_stalls = 0; // Write found the queue full and had to wait for the writer
+};
+
+// Streams hits to a file (or stdout for "-") from its own thread. Write only moves a batch into
+// a bounded lock-free queue; the writer thread formats batches into one large buffer and issues a
+// write when it fills, so the threads producing hits never wait on I/O, only on a queue that the
+// disk has let fill up.
+class HitWriter {
+public:
+    HitWriter(const std::string & filename, HitFormat format, std::vector<std::string> query_names,
+              std::vector<std::string> reference_names, std::vector<uint64_t> reference_lengths);
+    ~HitWriter(); // closes, reporting rather than throwing errors
+
+    HitWriter(const HitWriter & other) = delete;
+    HitWriter& operator=(const HitWriter & other) = delete;
+
+    // Safe to call from several threads at once.
+    void Write(std::vector<Hit> hits);
+
+    // Drains the queue, flushes and closes the file. Throws if any write failed.
+    void Close();
+
+    HitWriterStats GetStats();
+
+private:
+    // Bounded multi-producer queue after Vyukov: every slot carries a sequence number that says
+    // whether it is free for the producer at that position or full for the consumer at it.
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        std::vector<Hit> hits;
+    };
+
+    bool TryPush(std::vector<Hit> & hits);
+    bool TryPop(std::vector<Hit> & hits);
+    void WriterLoop();
+    void Format(const Hit & hit);
+    void Flush();
+
+    HitFormat format_;
+    std::vector<std::string> query_names_;
+    std::vector<std::string> reference_names_;
+    std::vector<uint64_t> reference_lengths_;
+
+    int fd_;
+    bool owns_fd_;
+    std::vector<char> buffer_; // writer thread only
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t slot_mask_;
+    std::atomic<uint64_t> push_position_{0};
+    std::atomic<uint64_t> pop_position_{0};
+
+    std::atomic<bool> closing_{false};
+    std::atomic<bool> failed_{false};
+    int error_ = 0; // errno of the failed write, read after the writer thread is joined
+    bool closed_ = false;
+    std::thread thread_;
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> batches_{0};
+    std::atomic<uint64_t> bytes_{0};
+    std::atomic<uint64_t> writes_{0};
+    std::atomic<uint64_t> producer_stalls_{0};
+};
@@ -5,42 +5,20 @@
 #include <fstream>
 #include <cassert>
 #include <chrono>
-#include <map>
 
-#include <random>
 
-#ifdef __APPLE__
-#include "OpenCL/opencl.h"
-#else
-#include "CL/cl.h"
-#endif
-
-//#include "omp.h"
-
-std::string GenerateRandomNucleotideString(size_t length) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(0, 3);
-
-    std::vector<char> vec(length);
-
-    std::generate_n(vec.begin(), length, [&dis, &gen]() {
-        switch(dis(gen)) {
-            case 0:
-                return 'A';
-            case 1:
-                return 'C';
-            case 2:
-                return 'G';
-            case 3:
-                return 'T';
-            default:
-                throw std::logic_error("Random number generator too large");
-        }
-    });
-
-    return std::string(vec.begin(), vec.end());
-}
+#include "checkpoint.h"
+#include "cpu_sw.h"
+#include "database_search.h"
+#include "fasta.h"
+#include "hit_writer.h"
+#include "memory_planner.h"
+#include "opencl_utils.h"
+#include "scoring.h"
+#include "sw_daemon.h"
+#include "sw_engine.h"
+#include "synthetic.h"
+#include "thread_pool.h"
 
 template <class T>
 class Matrix {
@@ -113,129 +91,6 @@ private:
 //    size_t length_;
 //};
 
-const char *getErrorString(cl_int error)
-{
-    switch(error){
-            // run-time and JIT compiler errors
-        case 0: return "CL_SUCCESS";
-        case -1: return "CL_DEVICE_NOT_FOUND";
-        case -2: return "CL_DEVICE_NOT_AVAILABLE";
-        case -3: return "CL_COMPILER_NOT_AVAILABLE";
-        case -4: return "CL_MEM_OBJECT_ALLOCATION_FAILURE";
-        case -5: return "CL_OUT_OF_RESOURCES";
-        case -6: return "CL_OUT_OF_HOST_MEMORY";
-        case -7: return "CL_PROFILING_INFO_NOT_AVAILABLE";
-        case -8: return "CL_MEM_COPY_OVERLAP";
-        case -9: return "CL_IMAGE_FORMAT_MISMATCH";
-        case -10: return "CL_IMAGE_FORMAT_NOT_SUPPORTED";
-        case -11: return "CL_BUILD_PROGRAM_FAILURE";
-        case -12: return "CL_MAP_FAILURE";
-        case -13: return "CL_MISALIGNED_SUB_BUFFER_OFFSET";
-        case -14: return "CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST";
-        case -15: return "CL_COMPILE_PROGRAM_FAILURE";
-        case -16: return "CL_LINKER_NOT_AVAILABLE";
-        case -17: return "CL_LINK_PROGRAM_FAILURE";
-        case -18: return "CL_DEVICE_PARTITION_FAILED";
-        case -19: return "CL_KERNEL_ARG_INFO_NOT_AVAILABLE";
-
-            // compile-time errors
-        case -30: return "CL_INVALID_VALUE";
-        case -31: return "CL_INVALID_DEVICE_TYPE";
-        case -32: return "CL_INVALID_PLATFORM";
-        case -33: return "CL_INVALID_DEVICE";
-        case -34: return "CL_INVALID_CONTEXT";
-        case -35: return "CL_INVALID_QUEUE_PROPERTIES";
-        case -36: return "CL_INVALID_COMMAND_QUEUE";
-        case -37: return "CL_INVALID_HOST_PTR";
-        case -38: return "CL_INVALID_MEM_OBJECT";
-        case -39: return "CL_INVALID_IMAGE_FORMAT_DESCRIPTOR";
-        case -40: return "CL_INVALID_IMAGE_SIZE";
-        case -41: return "CL_INVALID_SAMPLER";
-        case -42: return "CL_INVALID_BINARY";
-        case -43: return "CL_INVALID_BUILD_OPTIONS";
-        case -44: return "CL_INVALID_PROGRAM";
-        case -45: return "CL_INVALID_PROGRAM_EXECUTABLE";
-        case -46: return "CL_INVALID_KERNEL_NAME";
-        case -47: return "CL_INVALID_KERNEL_DEFINITION";
-        case -48: return "CL_INVALID_KERNEL";
-        case -49: return "CL_INVALID_ARG_INDEX";
-        case -50: return "CL_INVALID_ARG_VALUE";
-        case -51: return "CL_INVALID_ARG_SIZE";
-        case -52: return "CL_INVALID_KERNEL_ARGS";
-        case -53: return "CL_INVALID_WORK_DIMENSION";
-        case -54: return "CL_INVALID_WORK_GROUP_SIZE";
-        case -55: return "CL_INVALID_WORK_ITEM_SIZE";
-        case -56: return "CL_INVALID_GLOBAL_OFFSET";
-        case -57: return "CL_INVALID_EVENT_WAIT_LIST";
-        case -58: return "CL_INVALID_EVENT";
-        case -59: return "CL_INVALID_OPERATION";
-        case -60: return "CL_INVALID_GL_OBJECT";
-        case -61: return "CL_INVALID_BUFFER_SIZE";
-        case -62: return "CL_INVALID_MIP_LEVEL";
-        case -63: return "CL_INVALID_GLOBAL_WORK_SIZE";
-        case -64: return "CL_INVALID_PROPERTY";
-        case -65: return "CL_INVALID_IMAGE_DESCRIPTOR";
-        case -66: return "CL_INVALID_COMPILER_OPTIONS";
-        case -67: return "CL_INVALID_LINKER_OPTIONS";
-        case -68: return "CL_INVALID_DEVICE_PARTITION_COUNT";
-
-            // extension errors
-        case -1000: return "CL_INVALID_GL_SHAREGROUP_REFERENCE_KHR";
-        case -1001: return "CL_PLATFORM_NOT_FOUND_KHR";
-        case -1002: return "CL_INVALID_D3D10_DEVICE_KHR";
-        case -1003: return "CL_INVALID_D3D10_RESOURCE_KHR";
-        case -1004: return "CL_D3D10_RESOURCE_ALREADY_ACQUIRED_KHR";
-        case -1005: return "CL_D3D10_RESOURCE_NOT_ACQUIRED_KHR";
-        default: return "Unknown OpenCL error";
-    }
-}
-
-void CheckError (cl_int error)
-{
-    if (error != CL_SUCCESS) {
-        std::cerr << "OpenCL call failed with error " << error << std::endl;
-        std::cerr << getErrorString(error) << std::endl;
-        throw std::runtime_error(getErrorString(error));
-    }
-}
-
-
-std::vector<char> ReadKernelFromFilename(const std::string & filename) {
-    std::ifstream input_file(filename, std::ios_base::in | std::ios_base::binary);
-    input_file.seekg(0, std::ios::end);
-    auto length = input_file.tellg();
-    std::vector<char> vec(length);
-    input_file.seekg(0, std::ios::beg);
-    input_file.read(vec.data(), length);
-    return vec;
-}
-
-std::string GetPlatformName (cl_platform_id id)
-{
-    size_t size = 0;
-    clGetPlatformInfo (id, CL_PLATFORM_NAME, 0, nullptr, &size);
-
-    std::string result;
-    result.resize (size);
-    clGetPlatformInfo (id, CL_PLATFORM_NAME, size,
-                       const_cast<char*> (result.data ()), nullptr);
-
-    return result;
-}
-
-std::string GetDeviceName (cl_device_id id)
-{
-    size_t size = 0;
-    clGetDeviceInfo (id, CL_DEVICE_NAME, 0, nullptr, &size);
-
-    std::string result;
-    result.resize (size);
-    clGetDeviceInfo (id, CL_DEVICE_NAME, size,
-                     const_cast<char*> (result.data ()), nullptr);
-
-    return result;
-}
-
 void ZeroRow(cl_mem row, size_t row_size, cl_kernel kernel, cl_command_queue command_queue) {
     cl_int error = CL_SUCCESS;
     error = clSetKernelArg(kernel, 0, sizeof(cl_mem), &row);
@@ -246,726 +101,1049 @@ void ZeroRow(cl_mem row, size_t row_size, cl_kernel kernel, cl_command_queue com
     CheckError(error);
 }
 
-namespace cl {
-    struct DeviceInfo {
-        cl_uint device_address_bits;
-        cl_bool device_available;
-        cl_bool device_compiler_available;
-        cl_device_fp_config device_double_fp_config;
-        cl_bool device_endian_little;
-        cl_bool device_error_correction_support;
-        cl_device_exec_capabilities device_execution_capabilities;
-        std::string device_extensions;
-        cl_ulong device_global_mem_cache_size;
-        cl_device_mem_cache_type device_global_mem_cache_type;
-        cl_uint device_global_mem_cacheline_size;
-        cl_ulong device_global_mem_size;
-        cl_device_fp_config device_half_fp_config;
-        cl_bool device_image_support;
-        size_t device_image2d_max_height;
-        size_t device_image2d_max_width;
-        size_t device_image3d_max_depth;
-        size_t device_image3d_max_height;
-        size_t device_image3d_max_width;
-        cl_ulong device_local_mem_size;
-        cl_device_local_mem_type device_local_mem_type;
-        cl_uint device_max_clock_frequency;
-        cl_uint device_max_compute_units;
-        cl_uint device_max_constant_args;
-        cl_ulong device_max_constant_buffer_size;
-        cl_ulong device_max_mem_alloc_size;
-        size_t device_max_parameter_size;
-        cl_uint device_max_read_image_args;
-        cl_uint device_max_samplers;
-        size_t device_max_work_group_size;
-        cl_uint device_max_work_item_dimensions;
-        std::vector<size_t> device_max_work_item_sizes;
-        cl_uint device_max_write_image_args;
-        cl_uint device_mem_base_addr_align;
-        cl_uint device_min_data_type_align_size;
-        std::string device_name;
-        cl_platform_id device_platform;
-        cl_uint device_preferred_vector_width_char;
-        cl_uint device_preferred_vector_width_short;
-        cl_uint device_preferred_vector_width_int;
-        cl_uint device_preferred_vector_width_long;
-        cl_uint device_preferred_vector_width_float;
-        cl_uint device_preferred_vector_width_double;
-        std::string device_profile;
-        size_t device_profiling_timer_resolution; // in nanoseconds
-        cl_command_queue_properties device_queue_properties;
-        cl_device_fp_config device_single_fp_config;
-        cl_device_type device_type;
-        std::string device_vendor;
-        cl_uint device_vendor_id;
-        std::string device_version;
-        std::string driver_version;
-    };
-}
+struct RowScanOptions {
+    std::string query_filename;     // first record is the query, a random one when empty
+    std::string reference_filename; // first record is the reference, a random one when empty
+    std::string checkpoint_filename; // no checkpoints when empty
+    bool resume = false;
+    std::chrono::seconds checkpoint_interval = std::chrono::seconds(60);
+};
 
-cl::DeviceInfo GetDeviceInfo(cl_device_id device_id) {
-    cl::DeviceInfo device_info;
+std::string ReadFirstSequence(const std::string & filename) {
+    if (IsPackedFile(filename)) {
+        return Unpack(GetThreadPool(), ReadPacked(filename));
+    }
 
-    #define GETDEVICEINFO(param_name, struct_name) clGetDeviceInfo(device_id, param_name, sizeof(device_info.struct_name), &device_info.struct_name, nullptr);
+    std::vector<FastaRecord> records = ReadFasta(filename);
+    if (records.empty()) {
+        throw std::runtime_error("No sequence in " + filename);
+    }
+    return std::move(records.front().sequence);
+}
 
-    cl_int error;
-    error = clGetDeviceInfo(device_id, CL_DEVICE_ADDRESS_BITS, sizeof(device_info.device_address_bits), &device_info.device_address_bits, nullptr);
-    CheckError(error);
+void RunRowScan(cl_context context, cl_device_id device_id, cl_command_queue command_queue, cl_program program, const ScoringScheme & scoring, const RowScanOptions & options) {
+    cl_int error = CL_SUCCESS;
 
-    error = GETDEVICEINFO(CL_DEVICE_AVAILABLE, device_available);
+    cl_kernel f_mat_and_h_hat_mat_row_kernel = clCreateKernel(program, "f_mat_and_h_hat_mat_row_kernel", &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_COMPILER_AVAILABLE, device_compiler_available);
-    CheckError(error);
+//    cl_kernel h_hat_mat_row_kernel = clCreateKernel(program, "h_hat_mat_row_kernel", &error);
+//    CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_DOUBLE_FP_CONFIG, device_double_fp_config);
+    cl_kernel upsweep_kernel = clCreateKernel(program, "upsweep", &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_ENDIAN_LITTLE, device_endian_little);
+    cl_kernel downsweep_kernel = clCreateKernel(program, "downsweep", &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_ERROR_CORRECTION_SUPPORT, device_error_correction_support);
+    cl_kernel h_mat_row_kernel = clCreateKernel(program, "h_mat_row_kernel", &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_EXECUTION_CAPABILITIES, device_execution_capabilities);
+    cl_kernel column_max_kernel = clCreateKernel(program, "column_max_kernel", &error);
     CheckError(error);
 
-    size_t device_extensions_str_size;
-    error = clGetDeviceInfo(device_id, CL_DEVICE_EXTENSIONS, 0, nullptr, &device_extensions_str_size);
-    CheckError(error);
-    std::vector<char> device_extensions_vec(device_extensions_str_size);
-    error = clGetDeviceInfo(device_id, CL_DEVICE_EXTENSIONS, device_extensions_str_size, device_extensions_vec.data(), nullptr);
-    CheckError(error);
-    device_info.device_extensions = std::string(device_extensions_vec.begin(), device_extensions_vec.end());
-    CheckError(error);
+    cl_kernel zero_kernel = clCreateKernel(program, "zero", &error);
 
-    error = GETDEVICEINFO(CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, device_global_mem_cache_size);
-    CheckError(error);
+    using DataType = int32_t;
 
-    error = GETDEVICEINFO(CL_DEVICE_GLOBAL_MEM_CACHE_TYPE, device_global_mem_cache_type);
-    CheckError(error);
+    DataType match = scoring.match;
+    DataType mismatch = scoring.mismatch;
 
-    error = GETDEVICEINFO(CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE, device_global_mem_cacheline_size);
-    CheckError(error);
+//    std::string seq1 = "CAGCCTCGCTTAG";
+//    std::string seq2 = "AATGCCATTGCCGG";
 
-    error = GETDEVICEINFO(CL_DEVICE_GLOBAL_MEM_SIZE, device_global_mem_size);
-    CheckError(error);
+    const uint64_t seed = GetSyntheticSeed();
+    std::string seq1 = options.reference_filename.empty() ? Unpack(GetThreadPool(), GenerateReference(GetThreadPool(), seed, 20'000'000)) : ReadFirstSequence(options.reference_filename); // columns
+    std::string seq2 = options.query_filename.empty() ? Unpack(GetThreadPool(), GenerateReference(GetThreadPool(), seed + 1, 150)) : ReadFirstSequence(options.query_filename); // rows
 
-//    error = GETDEVICEINFO(CL_DEVICE_HALF_FP_CONFIG, device_half_fp_config);
-//    CheckError(error);
-// Possibly bugged in OSX?
+    std::cout << "seq1.size(): " << seq1.size() << std::endl;
+    std::cout << "seq2.size(): " << seq2.size() << std::endl;
 
-    error = GETDEVICEINFO(CL_DEVICE_IMAGE_SUPPORT, device_image_support);
-    CheckError(error);
+    // Only two rows of each matrix are ever live on the device; the reference is cut into
+    // chunks if even those do not fit.
+    PlanRequest request;
+    request.engine = EngineKind::kRowScan;
+    request.max_query_length = seq2.size();
+    request.reference_length = seq1.size();
+    request.num_row_buffers = 6;
+    request.num_profile_rows = 5; // A, C, G, T and one for anything else, which mismatches everything
+    request.num_checkpoint_rows = options.checkpoint_filename.empty() ? 0 : 3;
+    request.scoring = scoring;
+    const MemoryPlan plan = PlanMemory(request, GetMemoryBudget(device_id));
+    PrintMemoryPlan(plan);
+    if (!plan.fits) {
+        throw std::runtime_error("Row scan does not fit in memory");
+    }
 
-    error = GETDEVICEINFO(CL_DEVICE_IMAGE2D_MAX_HEIGHT, device_image2d_max_height);
-    CheckError(error);
+    const size_t buffer_row_size = static_cast<size_t>(plan.chunk_length) + 1;
+    const size_t buffer_padded_row_size = plan.padded_row_size;
+
+    std::cout << "Padded row size: " << buffer_padded_row_size << std::endl;
+
+    // A checkpoint only fits the exact sequences, scoring and chunking it was taken with
+    RowScanCheckpoint resume_state;
+    resume_state.reference_hash = HashSequence(seq1);
+    resume_state.reference_length = seq1.size();
+    resume_state.query_hash = HashSequence(seq2);
+    resume_state.scoring = scoring;
+    resume_state.chunk_length = plan.chunk_length;
+    resume_state.chunk_overlap = plan.chunk_overlap;
+
+    if (options.resume) {
+        RowScanCheckpoint checkpoint;
+        if (!ReadCheckpoint(options.checkpoint_filename, checkpoint)) {
+            std::cout << "No checkpoint at " << options.checkpoint_filename << ", starting from the beginning" << std::endl;
+        } else if (checkpoint.reference_hash != resume_state.reference_hash || checkpoint.reference_length != resume_state.reference_length || checkpoint.query_hash != resume_state.query_hash) {
+            throw std::runtime_error("Checkpoint " + options.checkpoint_filename + " is for different sequences");
+        } else if (checkpoint.scoring.match != scoring.match || checkpoint.scoring.mismatch != scoring.mismatch
+                   || checkpoint.scoring.gap_start_penalty != scoring.gap_start_penalty || checkpoint.scoring.gap_extend_penalty != scoring.gap_extend_penalty) {
+            throw std::runtime_error("Checkpoint " + options.checkpoint_filename + " is for a different scoring scheme");
+        } else if (checkpoint.chunk_length != plan.chunk_length || checkpoint.chunk_overlap != plan.chunk_overlap || checkpoint.chunk > plan.num_chunks) {
+            throw std::runtime_error("Checkpoint " + options.checkpoint_filename + " was taken with a different chunk plan");
+        } else {
+            resume_state = std::move(checkpoint);
+            std::cout << "Resuming at chunk " << resume_state.chunk << " of " << plan.num_chunks << ", row " << resume_state.row << std::endl;
+        }
+    }
 
-    error = GETDEVICEINFO(CL_DEVICE_IMAGE2D_MAX_WIDTH, device_image2d_max_width);
-    CheckError(error);
+    std::unique_ptr<CheckpointWriter> checkpoint_writer;
+    if (!options.checkpoint_filename.empty()) {
+        checkpoint_writer.reset(new CheckpointWriter(options.checkpoint_filename));
+    }
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    AlignmentResult best = resume_state.best;
+
+    // Header of every checkpoint taken from here on
+    auto new_checkpoint = [&](size_t chunk, size_t row) {
+        std::unique_ptr<RowScanCheckpoint> checkpoint(new RowScanCheckpoint());
+        checkpoint->reference_hash = resume_state.reference_hash;
+        checkpoint->reference_length = resume_state.reference_length;
+        checkpoint->query_hash = resume_state.query_hash;
+        checkpoint->scoring = scoring;
+        checkpoint->chunk_length = plan.chunk_length;
+        checkpoint->chunk_overlap = plan.chunk_overlap;
+        checkpoint->chunk = chunk;
+        checkpoint->row = row;
+        checkpoint->best = best;
+        return checkpoint;
+    };
 
-    error = GETDEVICEINFO(CL_DEVICE_IMAGE3D_MAX_DEPTH, device_image3d_max_depth);
-    CheckError(error);
+    auto pow_of_2 = [](const size_t pow)
+    {
+        return 1 << pow;
+    };
 
-    error = GETDEVICEINFO(CL_DEVICE_IMAGE3D_MAX_HEIGHT, device_image3d_max_height);
-    CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_IMAGE3D_MAX_WIDTH, device_image3d_max_width);
-    CheckError(error);
+    auto log2 = [](size_t num) {
+        size_t log = 0;
 
-    error = GETDEVICEINFO(CL_DEVICE_LOCAL_MEM_SIZE, device_local_mem_size);
-    CheckError(error);
+        while (num != 0) {
+            num = num >> 1;
+            ++log;
+        }
 
-    error = GETDEVICEINFO(CL_DEVICE_LOCAL_MEM_TYPE, device_local_mem_type);
-    CheckError(error);
+        return log-1;
+    };
 
-    error = GETDEVICEINFO(CL_DEVICE_MAX_CLOCK_FREQUENCY, device_max_clock_frequency);
-    CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_MAX_COMPUTE_UNITS, device_max_compute_units);
-    CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_MAX_CONSTANT_ARGS, device_max_constant_args);
+    cl_mem f_mat_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * buffer_row_size, NULL, &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, device_max_constant_buffer_size);
+    cl_mem f_mat_prev_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * buffer_row_size, NULL, &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_MAX_MEM_ALLOC_SIZE, device_max_mem_alloc_size);
+    cl_mem h_mat_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * buffer_row_size, NULL, &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_MAX_PARAMETER_SIZE, device_max_parameter_size);
+    cl_mem h_mat_prev_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * buffer_row_size, NULL, &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_MAX_READ_IMAGE_ARGS, device_max_read_image_args);
+    cl_mem h_hat_mat_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * buffer_row_size, NULL, &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_MAX_SAMPLERS, device_max_samplers);
+    cl_mem padded_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * buffer_padded_row_size, NULL, &error); // This also doubles as e_mat row
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_MAX_WORK_GROUP_SIZE, device_max_work_group_size);
+    cl_mem a_subs_score_row_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(DataType) * buffer_row_size, NULL, &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, device_max_work_item_dimensions);
+    cl_mem c_subs_score_row_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(DataType) * buffer_row_size, NULL, &error);
     CheckError(error);
 
-//    error = GETDEVICEINFO(CL_DEVICE_MAX_WORK_ITEM_SIZES, device_max_work_item_sizes); // vector
-//    CheckError(error);
-
-    error = GETDEVICEINFO(CL_DEVICE_MAX_WRITE_IMAGE_ARGS, device_max_write_image_args);
+    cl_mem g_subs_score_row_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(DataType) * buffer_row_size, NULL, &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_MEM_BASE_ADDR_ALIGN, device_mem_base_addr_align);
+    cl_mem t_subs_score_row_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(DataType) * buffer_row_size, NULL, &error);
     CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_MIN_DATA_TYPE_ALIGN_SIZE, device_min_data_type_align_size);
+    // The same for every chunk: column 0, then mismatch everywhere
+    std::vector<DataType> n_vec(buffer_row_size, mismatch);
+    n_vec[0] = 0;
+    cl_mem n_subs_score_row_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(DataType) * buffer_row_size, n_vec.data(), &error);
     CheckError(error);
 
-    size_t device_name_str_size;
-    error = clGetDeviceInfo(device_id, CL_DEVICE_NAME, 0, nullptr, &device_name_str_size);
-    CheckError(error);
-    std::vector<char> device_name_vec(device_name_str_size);
-    error = clGetDeviceInfo(device_id, CL_DEVICE_NAME, device_name_str_size, device_name_vec.data(), nullptr);
-    CheckError(error);
-    device_info.device_name = std::string(device_name_vec.begin(), device_name_vec.end());
+    cl_mem column_max_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * buffer_row_size, NULL, &error);
     CheckError(error);
 
+    std::chrono::steady_clock::duration sw_time(0);
+    for (size_t chunk = static_cast<size_t>(resume_state.chunk); chunk < plan.num_chunks; ++chunk) {
+        const size_t chunk_begin = static_cast<size_t>(plan.GetChunkBegin(chunk));
+        const size_t chunk_length = std::min(static_cast<size_t>(plan.chunk_length), seq1.size() - chunk_begin);
+        const size_t row_size = chunk_length + 1;
+        const size_t padded_row_size = GetPaddedRowSize(row_size);
 
-    error = GETDEVICEINFO(CL_DEVICE_PLATFORM, device_platform);
-    CheckError(error);
+        // Resuming inside this chunk: continue from the rows the checkpoint saved. The queue is out
+        // of order, so the restored rows are not zeroed at all rather than zeroed and overwritten.
+        const bool resuming = chunk == resume_state.chunk && resume_state.row > 0;
 
-    error = GETDEVICEINFO(CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR, device_preferred_vector_width_char);
-    CheckError(error);
+        ZeroRow(f_mat_row_buffer, row_size, zero_kernel, command_queue);
+        ZeroRow(h_mat_row_buffer, row_size, zero_kernel, command_queue);
+        ZeroRow(h_hat_mat_row_buffer, row_size, zero_kernel, command_queue);
+        ZeroRow(padded_row_buffer, padded_row_size, zero_kernel, command_queue);
+        ZeroRow(a_subs_score_row_buffer, row_size, zero_kernel, command_queue);
+        ZeroRow(c_subs_score_row_buffer, row_size, zero_kernel, command_queue);
+        ZeroRow(g_subs_score_row_buffer, row_size, zero_kernel, command_queue);
+        ZeroRow(t_subs_score_row_buffer, row_size, zero_kernel, command_queue);
+        if (!resuming) {
+            ZeroRow(f_mat_prev_row_buffer, row_size, zero_kernel, command_queue);
+            ZeroRow(h_mat_prev_row_buffer, row_size, zero_kernel, command_queue);
+            ZeroRow(column_max_buffer, row_size, zero_kernel, command_queue);
+        }
 
-    error = GETDEVICEINFO(CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT, device_preferred_vector_width_short);
-    CheckError(error);
+        size_t first_row = 1;
+        if (resuming) {
+            if (resume_state.h_prev_row.size() != row_size || resume_state.f_prev_row.size() != row_size || resume_state.column_max.size() != row_size
+                || resume_state.row >= seq2.size()) {
+                throw std::runtime_error("Checkpoint " + options.checkpoint_filename + " rows do not match its chunk");
+            }
+            error = clEnqueueWriteBuffer(command_queue, h_mat_prev_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, resume_state.h_prev_row.data(), 0, nullptr, nullptr);
+            error |= clEnqueueWriteBuffer(command_queue, f_mat_prev_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, resume_state.f_prev_row.data(), 0, nullptr, nullptr);
+            error |= clEnqueueWriteBuffer(command_queue, column_max_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, resume_state.column_max.data(), 0, nullptr, nullptr);
+            CheckError(error);
+            first_row = static_cast<size_t>(resume_state.row) + 1;
+        }
 
-    error = GETDEVICEINFO(CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, device_preferred_vector_width_int);
-    CheckError(error);
+        clFinish(command_queue);
 
-    error = GETDEVICEINFO(CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG, device_preferred_vector_width_long);
-    CheckError(error);
+        cl_mem query_character_row_score_map[256];
+        std::fill_n(query_character_row_score_map, 256, n_subs_score_row_buffer);
+        {
+            std::vector<DataType> a_vec(row_size, 0);
+            std::vector<DataType> c_vec(row_size, 0);
+            std::vector<DataType> g_vec(row_size, 0);
+            std::vector<DataType> t_vec(row_size, 0);
+            GetThreadPool().ParallelFor(1, row_size, 1 << 20, [&](size_t begin, size_t end) {
+                for (size_t c = begin; c < end; ++c) {
+                    a_vec[c] = seq1[chunk_begin + c - 1] == 'A' ? match : mismatch;
+                    c_vec[c] = seq1[chunk_begin + c - 1] == 'C' ? match : mismatch;
+                    g_vec[c] = seq1[chunk_begin + c - 1] == 'G' ? match : mismatch;
+                    t_vec[c] = seq1[chunk_begin + c - 1] == 'T' ? match : mismatch;
+                }
+            });
 
-    error = GETDEVICEINFO(CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, device_preferred_vector_width_float);
-    CheckError(error);
+            clEnqueueWriteBuffer(command_queue, a_subs_score_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, a_vec.data(), 0, nullptr, nullptr);
+            clEnqueueWriteBuffer(command_queue, c_subs_score_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, c_vec.data(), 0, nullptr, nullptr);
+            clEnqueueWriteBuffer(command_queue, g_subs_score_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, g_vec.data(), 0, nullptr, nullptr);
+            clEnqueueWriteBuffer(command_queue, t_subs_score_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, t_vec.data(), 0, nullptr, nullptr);
 
-    error = GETDEVICEINFO(CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE, device_preferred_vector_width_double);
-    CheckError(error);
+            query_character_row_score_map['A'] = a_subs_score_row_buffer;
+            query_character_row_score_map['C'] = c_subs_score_row_buffer;
+            query_character_row_score_map['G'] = g_subs_score_row_buffer;
+            query_character_row_score_map['T'] = t_subs_score_row_buffer;
 
-    size_t device_profile_str_size;
-    error = clGetDeviceInfo(device_id, CL_DEVICE_PROFILE, 0, nullptr, &device_profile_str_size);
-    CheckError(error);
-    std::vector<char> device_profile_vec(device_profile_str_size);
-    error = clGetDeviceInfo(device_id, CL_DEVICE_PROFILE, device_profile_str_size, device_profile_vec.data(), nullptr);
-    CheckError(error);
-    device_info.device_profile = std::string(device_profile_vec.begin(), device_profile_vec.end());
-    CheckError(error);
+            clFinish(command_queue);
+        }
 
-    error = GETDEVICEINFO(CL_DEVICE_PROFILING_TIMER_RESOLUTION, device_profiling_timer_resolution);
-    CheckError(error);
+        // Reads of the last checkpoint's rows, which the next row's kernels must not overtake
+        std::vector<cl_event> checkpoint_reads;
 
-    error = GETDEVICEINFO(CL_DEVICE_QUEUE_PROPERTIES, device_queue_properties);
-    CheckError(error);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t r = first_row; r <= seq2.size(); ++r) {
+            cl_event f_mat_and_h_hat_mat_finished;
+            // Calculate f_mat_row
+            {
+                error = 0;
+                error = clSetKernelArg(f_mat_and_h_hat_mat_row_kernel, 0, sizeof(cl_mem), &f_mat_prev_row_buffer);
+                error |= clSetKernelArg(f_mat_and_h_hat_mat_row_kernel, 1, sizeof(cl_mem), &h_mat_prev_row_buffer);
+                error |= clSetKernelArg(f_mat_and_h_hat_mat_row_kernel, 2, sizeof(cl_mem), &f_mat_row_buffer);
+                error |= clSetKernelArg(f_mat_and_h_hat_mat_row_kernel, 3, sizeof(cl_mem), &query_character_row_score_map[static_cast<unsigned char>(seq2[r-1])]);
+                error |= clSetKernelArg(f_mat_and_h_hat_mat_row_kernel, 4, sizeof(cl_mem), &h_hat_mat_row_buffer);
 
-    error = GETDEVICEINFO(CL_DEVICE_SINGLE_FP_CONFIG, device_single_fp_config);
-    CheckError(error);
+                CheckError(error);
 
-    error = GETDEVICEINFO(CL_DEVICE_TYPE, device_type);
-    CheckError(error);
+                size_t global = row_size;
+                error = clEnqueueNDRangeKernel(command_queue, f_mat_and_h_hat_mat_row_kernel, 1, NULL, &global, nullptr,
+                                               static_cast<cl_uint>(checkpoint_reads.size()), checkpoint_reads.empty() ? nullptr : checkpoint_reads.data(), &f_mat_and_h_hat_mat_finished);
+                CheckError(error);
 
-    size_t device_vendor_str_size;
-    error = clGetDeviceInfo(device_id, CL_DEVICE_VENDOR, 0, nullptr, &device_vendor_str_size);
-    CheckError(error);
-    std::vector<char> device_vendor_vec(device_vendor_str_size);
-    error = clGetDeviceInfo(device_id, CL_DEVICE_VENDOR, device_vendor_str_size, device_vendor_vec.data(), nullptr);
-    CheckError(error);
-    device_info.device_vendor = std::string(device_vendor_vec.begin(), device_vendor_vec.end());
-    CheckError(error);
+                for (cl_event event : checkpoint_reads) {
+                    clReleaseEvent(event);
+                }
+                checkpoint_reads.clear();
+            }
 
-    error = GETDEVICEINFO(CL_DEVICE_VENDOR_ID, device_vendor_id);
-    CheckError(error);
+            cl_event padded_row_buffer_load_finished;
+            {
+                error = clEnqueueCopyBuffer(command_queue, h_hat_mat_row_buffer, padded_row_buffer, 0, 0, row_size * sizeof(DataType), 1, &f_mat_and_h_hat_mat_finished, &padded_row_buffer_load_finished);
+                CheckError(error);
+                clReleaseEvent(f_mat_and_h_hat_mat_finished);
+            }
 
-    size_t device_version_str_size;
-    error = clGetDeviceInfo(device_id, CL_DEVICE_VERSION, 0, nullptr, &device_version_str_size);
-    CheckError(error);
-    std::vector<char> device_version_vec(device_version_str_size);
-    error = clGetDeviceInfo(device_id, CL_DEVICE_VERSION, device_version_str_size, device_version_vec.data(), nullptr);
-    CheckError(error);
-    device_info.device_version = std::string(device_version_vec.begin(), device_version_vec.end());
-    CheckError(error);
+            cl_event upsweep_finished;
+            {
+                // Upsweep
+                std::vector<cl_event> upsweep_row_finished(log2(padded_row_size) - 1);
+                for (size_t depth = 0; depth < log2(padded_row_size); ++depth) {
+                    error = 0;
+                    error = clSetKernelArg(upsweep_kernel, 0, sizeof(cl_mem), &padded_row_buffer);
+                    error |= clSetKernelArg(upsweep_kernel, 1, sizeof(cl_int), &depth);
+                    CheckError(error);
+
+                    size_t global = padded_row_size / pow_of_2(depth+1);
+                    if (depth == log2(padded_row_size) - 1) {
+                        // Last iteration
+                        error = clEnqueueNDRangeKernel(command_queue, upsweep_kernel, 1, NULL, &global, nullptr, 1, &upsweep_row_finished[depth-1], &upsweep_finished);
+                    } else if (depth == 0) {
+                        // First iteration
+                        error = clEnqueueNDRangeKernel(command_queue, upsweep_kernel, 1, NULL, &global, nullptr, 1, &padded_row_buffer_load_finished, &upsweep_row_finished[depth]);
+                        clReleaseEvent(padded_row_buffer_load_finished);
+                    } else {
+                        error = clEnqueueNDRangeKernel(command_queue, upsweep_kernel, 1, NULL, &global, nullptr, 1, &upsweep_row_finished[depth-1], &upsweep_row_finished[depth]);
+                    }
+                    CheckError(error);
+                }
 
-    size_t driver_version_str_size;
-    error = clGetDeviceInfo(device_id, CL_DRIVER_VERSION, 0, nullptr, &driver_version_str_size);
-    CheckError(error);
-    std::vector<char> driver_version_vec(driver_version_str_size);
-    error = clGetDeviceInfo(device_id, CL_DRIVER_VERSION, driver_version_str_size, driver_version_vec.data(), nullptr);
-    CheckError(error);
-    device_info.driver_version = std::string(driver_version_vec.begin(), driver_version_vec.end());
-    CheckError(error);
+                for (auto & event : upsweep_row_finished) {
+                    clReleaseEvent(event);
+                }
+            }
 
-    return device_info;
+            cl_event downsweep_initialization_finished;
+            DataType zero = 0;
+            {
+                error = clEnqueueWriteBuffer(command_queue, padded_row_buffer, CL_FALSE, (padded_row_size-1) * sizeof(DataType), sizeof(DataType), &zero, 1, &upsweep_finished, &downsweep_initialization_finished);
+                CheckError(error);
+                clReleaseEvent(upsweep_finished);
+            }
 
-#undef GETDEVICEINFO
-}
+            cl_event downsweep_finished;
+            {
+            // Downsweep
+            std::vector<cl_event> downsweep_row_finished(log2(padded_row_size) - 1);
+
+                for (int64_t depth = log2(padded_row_size) - 1; depth >= 0; --depth) {
+                    error = 0;
+                    error = clSetKernelArg(downsweep_kernel, 0, sizeof(cl_mem), &padded_row_buffer);
+                    error |= clSetKernelArg(downsweep_kernel, 1, sizeof(cl_int), &depth);
+                    CheckError(error);
+
+                    size_t global = padded_row_size / pow_of_2(depth+1);
+
+                    if (depth == log2(padded_row_size) - 1) {
+                        // First iteration
+                        error = clEnqueueNDRangeKernel(command_queue, downsweep_kernel, 1, NULL, &global, nullptr, 1, &downsweep_initialization_finished, &downsweep_row_finished[depth-1]);
+                        clReleaseEvent(downsweep_initialization_finished);
+                    } else if (depth == 0) {
+                        // Last iteration
+                        error = clEnqueueNDRangeKernel(command_queue, downsweep_kernel, 1, NULL, &global, nullptr, 1, &downsweep_row_finished[depth], &downsweep_finished);
+                    } else {
+                        error = clEnqueueNDRangeKernel(command_queue, downsweep_kernel, 1, NULL, &global, nullptr, 1, &downsweep_row_finished[depth], &downsweep_row_finished[depth-1]);
+                    }
+
+                    CheckError(error);
+                }
 
-void PrintDeviceInfo(cl_device_id device_id) {
-    auto info = GetDeviceInfo(device_id);
-
-    std::cout << "Address Bits: " << info.device_address_bits << std::endl;
-    std::cout << "Available: " << info.device_available << std::endl;
-    std::cout << "Compiler Available: " << info.device_compiler_available << std::endl;
-    std::cout << "Double FP Config: " << info.device_double_fp_config << std::endl;
-    std::cout << "Little Endian: " << info.device_endian_little << std::endl;
-    std::cout << "ECC Support: " << info.device_error_correction_support << std::endl;
-    std::cout << "Execution Capabilities: " << info.device_execution_capabilities << std::endl;
-    std::cout << "Device Extensions: " << info.device_extensions << std::endl;
-    std::cout << "Global Mem Cache Size: " << info.device_global_mem_cache_size << std::endl;
-    std::cout << "Global Mem Cache Type: " << info.device_global_mem_cache_type << std::endl;
-    std::cout << "Global Mem Cacheline Size: " << info.device_global_mem_cacheline_size << std::endl;
-    std::cout << "Global Mem Size: " << info.device_global_mem_size << std::endl;
-//    std::cout << "Half FP Config: " << info.device_half_fp_config << std::endl;
-    std::cout << "Image support: " << info.device_image_support << std::endl;
-    std::cout << "2D Image Max Height: " << info.device_image2d_max_height << std::endl;
-    std::cout << "2D Image Max Width: " << info.device_image2d_max_width << std::endl;
-    std::cout << "3D Image Max Depth: " << info.device_image3d_max_depth << std::endl;
-    std::cout << "3D Image Max Height: " << info.device_image3d_max_height << std::endl;
-    std::cout << "3D Image Max Width: " << info.device_image3d_max_width << std::endl;
-    std::cout << "Local Mem Size: " << info.device_local_mem_size << std::endl;
-    std::cout << "Local Mem Type: " << info.device_local_mem_type << std::endl;
-    std::cout << "Max Clock Freq (MHz): " << info.device_max_clock_frequency << std::endl;
-    std::cout << "Max Compute Units: " << info.device_max_compute_units << std::endl;
-    std::cout << "Max Const Args: " << info.device_max_constant_args << std::endl;
-    std::cout << "Max Const Buffer Size: " << info.device_max_constant_buffer_size << std::endl;
-    std::cout << "Max Allocation Size: " << info.device_max_mem_alloc_size << std::endl;
-    std::cout << "Max Parameter Size: " << info.device_max_parameter_size << std::endl;
-    std::cout << "Max Read Image Args: " << info.device_max_read_image_args << std::endl;
-    std::cout << "Max Samplers: " << info.device_max_samplers << std::endl;
-    std::cout << "Max Work Group Size: " << info.device_max_work_group_size << std::endl;
-    std::cout << "Max Work Item Dimensions: " << info.device_max_work_item_dimensions << std::endl;
-//    std::cout << "Max work item sizes: " << info.device_max_work_item_sizes << std::endl; //vector
-    std::cout << "Max Write Image Args: " << info.device_max_write_image_args << std::endl;
-    std::cout << "Mem Base Addr Alignment: " << info.device_mem_base_addr_align << std::endl;
-    std::cout << "Min Data Type Alignment: " << info.device_min_data_type_align_size << std::endl;
-    std::cout << "Device Name: " << info.device_name << std::endl;
-    std::cout << "Device Platform: " << info.device_platform << std::endl;
-    std::cout << "Preferred Vector Width (Char): " << info.device_preferred_vector_width_char << std::endl;
-    std::cout << "Preferred Vector Width (Short): " << info.device_preferred_vector_width_short << std::endl;
-    std::cout << "Preferred Vector Width (Int): " << info.device_preferred_vector_width_int << std::endl;
-    std::cout << "Preferred Vector Width (Long): " << info.device_preferred_vector_width_long << std::endl;
-    std::cout << "Preferred Vector Width (Float): " << info.device_preferred_vector_width_float << std::endl;
-    std::cout << "Preferred Vector Width (Double): " << info.device_preferred_vector_width_double << std::endl;
-    std::cout << "Profile: " << info.device_profile << std::endl;
-    std::cout << "Timer Resolution (ns): " << info.device_profiling_timer_resolution << std::endl;
-    std::cout << "Queue Properties: " << info.device_queue_properties << std::endl;
-    std::cout << "Single FP Config: " << info.device_single_fp_config << std::endl;
-    std::cout << "Device Type: " << info.device_type << std::endl;
-    std::cout << "Device Vendor: " << info.device_vendor << std::endl;
-    std::cout << "Device Vendor ID: " << info.device_vendor_id << std::endl;
-    std::cout << "Device Version: " << info.device_version << std::endl;
-    std::cout << "Driver Version: " << info.driver_version << std::endl;
-}
+                for (auto & event : downsweep_row_finished) {
+                    clReleaseEvent(event);
+                }
+            }
 
-size_t GetPaddedRowSize(size_t input_row_size) {
-    --input_row_size;
-    input_row_size |= input_row_size >> 1;
-    input_row_size |= input_row_size >> 2;
-    input_row_size |= input_row_size >> 4;
-    input_row_size |= input_row_size >> 8;
-    input_row_size |= input_row_size >> 16;
-    input_row_size |= input_row_size >> 32;
-    ++input_row_size;
-    // std::cout << "Row size rounded up to next power of 2: " << padded_row_size << std::endl;
-
-    return input_row_size;
-}
+            // Calculate h_mat_row
+            cl_event h_mat_finished;
+            {
+                error = 0;
+                error = clSetKernelArg(h_mat_row_kernel, 0, sizeof(cl_mem), &h_hat_mat_row_buffer);
+                error |= clSetKernelArg(h_mat_row_kernel, 1, sizeof(cl_mem), &padded_row_buffer);
+                error |= clSetKernelArg(h_mat_row_kernel, 2, sizeof(cl_mem), &h_mat_row_buffer);
 
-int main ()
-{
-    cl_uint platformIdCount = 0;
-    clGetPlatformIDs (0, nullptr, &platformIdCount);
+                CheckError(error);
 
-    if (platformIdCount == 0) {
-        std::cerr << "No OpenCL platform found" << std::endl;
-        return 1;
-    } else {
-        std::cout << "Found " << platformIdCount << " platform(s)" << std::endl;
-    }
+                size_t global = row_size;
+                error = clEnqueueNDRangeKernel(command_queue, h_mat_row_kernel, 1, NULL, &global, nullptr, 1, &downsweep_finished, &h_mat_finished);
+                CheckError(error);
+                clReleaseEvent(downsweep_finished);
+            }
 
-    std::vector<cl_platform_id> platformIds (platformIdCount);
-    clGetPlatformIDs (platformIdCount, platformIds.data(), nullptr);
+            // Fold h_mat_row into the column maxima
+            {
+                error = clSetKernelArg(column_max_kernel, 0, sizeof(cl_mem), &h_mat_row_buffer);
+                error |= clSetKernelArg(column_max_kernel, 1, sizeof(cl_mem), &column_max_buffer);
+                CheckError(error);
 
-    for (cl_uint i = 0; i < platformIdCount; ++i) {
-        std::cout << "\t (" << (i+1) << ") : " << GetPlatformName (platformIds [i]) << std::endl;
-    }
+                size_t global = row_size;
+                error = clEnqueueNDRangeKernel(command_queue, column_max_kernel, 1, NULL, &global, nullptr, 1, &h_mat_finished, nullptr);
+                CheckError(error);
+                clReleaseEvent(h_mat_finished);
+            }
 
-    cl_uint deviceIdCount = 0;
-    clGetDeviceIDs (platformIds[0], CL_DEVICE_TYPE_ALL, 0, nullptr, &deviceIdCount);
+            {
+                clFinish(command_queue);
+            }
 
-    if (deviceIdCount == 0) {
-        std::cerr << "No OpenCL devices found" << std::endl;
-        return 1;
-    } else {
-        std::cout << "Found " << deviceIdCount << " device(s)" << std::endl;
-    }
+            std::swap(f_mat_row_buffer, f_mat_prev_row_buffer);
+            std::swap(h_mat_row_buffer, h_mat_prev_row_buffer);
 
-    std::vector<cl_device_id> deviceIds (deviceIdCount);
-    clGetDeviceIDs (platformIds [0], CL_DEVICE_TYPE_ALL, deviceIdCount,
-                    deviceIds.data (), nullptr);
+            // Only the reads are queued here; the writer thread waits for them and writes the file
+            if (checkpoint_writer && r < seq2.size() && std::chrono::steady_clock::now() - last_checkpoint >= options.checkpoint_interval && !checkpoint_writer->IsBusy()) {
+                std::unique_ptr<RowScanCheckpoint> checkpoint = new_checkpoint(chunk, r);
+                checkpoint->h_prev_row.resize(row_size);
+                checkpoint->f_prev_row.resize(row_size);
+                checkpoint->column_max.resize(row_size);
 
-    for (cl_uint i = 0; i < deviceIdCount; ++i) {
-        std::cout << "\t (" << (i+1) << ") : " << GetDeviceName (deviceIds [i]) << std::endl;
+                checkpoint_reads.resize(3);
+                error = clEnqueueReadBuffer(command_queue, h_mat_prev_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, checkpoint->h_prev_row.data(), 0, nullptr, &checkpoint_reads[0]);
+                error |= clEnqueueReadBuffer(command_queue, f_mat_prev_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, checkpoint->f_prev_row.data(), 0, nullptr, &checkpoint_reads[1]);
+                error |= clEnqueueReadBuffer(command_queue, column_max_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, checkpoint->column_max.data(), 0, nullptr, &checkpoint_reads[2]);
+                CheckError(error);
+                clFlush(command_queue);
+
+                for (cl_event event : checkpoint_reads) {
+                    clRetainEvent(event);
+                }
+                checkpoint_writer->Write(std::move(checkpoint), checkpoint_reads);
+                last_checkpoint = std::chrono::steady_clock::now();
+            }
+        }
+        auto stop = std::chrono::steady_clock::now();
+        sw_time += stop - start;
+
+        for (cl_event event : checkpoint_reads) {
+            clReleaseEvent(event);
+        }
+
+        // Earliest column on ties, the same rule the engine merges with
+        std::vector<DataType> column_max(row_size);
+        error = clEnqueueReadBuffer(command_queue, column_max_buffer, CL_TRUE, 0, sizeof(DataType) * row_size, column_max.data(), 0, nullptr, nullptr);
+        CheckError(error);
+        for (size_t c = 1; c < row_size; ++c) {
+            if (column_max[c] > best.score || (column_max[c] == best.score && chunk_begin + c < best.reference_end)) {
+                best.score = column_max[c];
+                best.reference_end = chunk_begin + c;
+            }
+        }
+
+        if (checkpoint_writer && std::chrono::steady_clock::now() - last_checkpoint >= options.checkpoint_interval && !checkpoint_writer->IsBusy()) {
+            checkpoint_writer->Write(new_checkpoint(chunk + 1, 0), {});
+            last_checkpoint = std::chrono::steady_clock::now();
+        }
     }
 
-    const cl_context_properties contextProperties [] = { CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platformIds[0]), 0, 0 };
+    // The finished scan is checkpointed too, so resuming it again only reports the result
+    if (checkpoint_writer) {
+        checkpoint_writer->Write(new_checkpoint(plan.num_chunks, 0), {});
+        checkpoint_writer.reset();
+    }
 
-    cl_int error = CL_SUCCESS;
-    cl_context context = clCreateContext (contextProperties, deviceIdCount, deviceIds.data (), nullptr, nullptr, &error);
-    CheckError (error);
-    
-    std::cout << "Context created" << std::endl;
+    std::cout << "Best alignment: score " << best.score << ", reference end " << best.reference_end << std::endl;
 
-    size_t DEVICE_NUMBER=2;
+    auto SW_time_milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(sw_time).count();
 
-    PrintDeviceInfo(deviceIds[DEVICE_NUMBER]);
+    std::cout << "SW took: " << SW_time_milliseconds << " ms" << std::endl;
+    std::cout << "Estimated time to search entire genome: " << std::chrono::duration_cast<std::chrono::nanoseconds>(sw_time).count() * (3000000000 / seq1.size()) / 1000000000.0 << " s" << std::endl;
 
-#ifdef __APPLE__ // Apple doesn't support out of order execution wtf?
-    cl_command_queue command_queue = clCreateCommandQueue (context, deviceIds[DEVICE_NUMBER], 0, &error);
-#else
-    cl_command_queue command_queue = clCreateCommandQueue (context, deviceIds[DEVICE_NUMBER], CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &error);
-#endif
-    CheckError (error);
+    clReleaseMemObject(f_mat_row_buffer);
+    clReleaseMemObject(f_mat_prev_row_buffer);
+    clReleaseMemObject(h_mat_row_buffer);
+    clReleaseMemObject(h_mat_prev_row_buffer);
+    clReleaseMemObject(h_hat_mat_row_buffer);
+    clReleaseMemObject(padded_row_buffer);
+    clReleaseMemObject(a_subs_score_row_buffer);
+    clReleaseMemObject(c_subs_score_row_buffer);
+    clReleaseMemObject(g_subs_score_row_buffer);
+    clReleaseMemObject(t_subs_score_row_buffer);
+    clReleaseMemObject(n_subs_score_row_buffer);
+    clReleaseMemObject(column_max_buffer);
 
-    cl_uint count = 1;
 
-    // Here we're ready to actually run the code
-    std::vector<char> kernel_bytes = ReadKernelFromFilename("/Users/hocheung20/SmithWatermanOpenCL/src/SW_kernels.cl");
+    clReleaseKernel(f_mat_and_h_hat_mat_row_kernel);
+    //clReleaseKernel(h_hat_mat_row_kernel);
+    clReleaseKernel(upsweep_kernel);
+    clReleaseKernel(downsweep_kernel);
+    clReleaseKernel(h_mat_row_kernel);
+    clReleaseKernel(column_max_kernel);
+    clReleaseKernel(zero_kernel);
+}
 
-    std::string kernel_bytes_string(kernel_bytes.begin(), kernel_bytes.end());
+void RunDatabaseSearch(cl_context context, cl_device_id device_id, cl_command_queue command_queue, cl_program program, const ScoringScheme & scoring,
+                       const std::string & query_filename, const std::string & database_filename, size_t top_n) {
+    std::vector<FastaRecord> queries = ReadFasta(query_filename);
 
-    const char * source = kernel_bytes_string.c_str();
-    size_t sourceSize[] = {strlen(source)};
+    auto load_start = std::chrono::steady_clock::now();
+    DatabaseSearch database_search(context, device_id, command_queue, program, ReadFasta(database_filename));
+    auto load_stop = std::chrono::steady_clock::now();
 
-    cl_program program = clCreateProgramWithSource(context, count, &source, sourceSize, &error);
-    CheckError(error);
+    std::cout << "Database: " << database_search.GetNumSequences() << " sequences, " << database_search.GetNumResidues() << " residues, loaded in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(load_stop - load_start).count() << " ms" << std::endl;
 
-    clFinish(command_queue);
+    for (const FastaRecord & query : queries) {
+        std::vector<DatabaseHit> hits = database_search.Search(query.sequence, scoring, top_n);
+        const DatabaseSearchStats & stats = database_search.GetLastStats();
+        if (&query == &queries.front()) {
+            PrintMemoryPlan(database_search.GetLastPlan());
+        }
 
-    error = clBuildProgram(program, 0, nullptr, nullptr, nullptr, nullptr);
-    if (error != CL_SUCCESS) {
-        std::cerr << "OpenCL call failed with error " << error << std::endl;
-        std::cerr << getErrorString(error) << std::endl;
-        size_t build_log_size;
-        cl_int build_info_error = clGetProgramBuildInfo(program, deviceIds[DEVICE_NUMBER], CL_PROGRAM_BUILD_LOG, 0, nullptr, &build_log_size);
-        CheckError(build_info_error);
-        std::vector<char> error_buffer_vec(build_log_size);
-        build_info_error = clGetProgramBuildInfo(program, deviceIds[DEVICE_NUMBER], CL_PROGRAM_BUILD_LOG, error_buffer_vec.size(), error_buffer_vec.data(), nullptr);
-        CheckError(build_info_error);
-        std::cerr << error_buffer_vec.data() << std::endl;
-        throw std::runtime_error(getErrorString(error));
+        std::cout << "Query: " << query.name << " (" << query.sequence.size() << " residues)" << std::endl;
+        for (size_t k = 0; k < hits.size(); ++k) {
+            std::cout << "\t" << (k+1) << "\t" << hits[k].name << "\t" << hits[k].length << "\t" << hits[k].score << "\n";
+        }
+        std::cout << "Search took: " << stats.seconds * 1000.0 << " ms in " << stats.num_launches << " launch(es), " << stats.gcups << " GCUPS" << std::endl;
     }
+}
 
-    cl_kernel f_mat_and_h_hat_mat_row_kernel = clCreateKernel(program, "f_mat_and_h_hat_mat_row_kernel", &error);
-    CheckError(error);
+// placement is default, interleave or replicate, or compare to time interleave against replicate
+void RunCpuAlignment(const ScoringScheme & scoring, const std::string & query_filename, const std::string & reference_filename, const std::string & placement) {
+    ThreadPool & pool = GetThreadPool();
 
-//    cl_kernel h_hat_mat_row_kernel = clCreateKernel(program, "h_hat_mat_row_kernel", &error);
-//    CheckError(error);
+    auto load_start = std::chrono::steady_clock::now();
+    std::vector<FastaRecord> query_records = ReadFasta(query_filename);
+    std::vector<FastaRecord> references = ReadFasta(reference_filename);
+    auto load_stop = std::chrono::steady_clock::now();
 
-    cl_kernel upsweep_kernel = clCreateKernel(program, "upsweep", &error);
-    CheckError(error);
+    std::cout << "Loaded " << query_records.size() << " queries and " << references.size() << " reference(s) in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(load_stop - load_start).count() << " ms" << std::endl;
 
-    cl_kernel downsweep_kernel = clCreateKernel(program, "downsweep", &error);
-    CheckError(error);
+    std::vector<std::string> queries;
+    size_t query_residues = 0;
+    for (auto & record : query_records) {
+        query_residues += record.sequence.size();
+        queries.push_back(record.sequence);
+    }
 
-    cl_kernel h_mat_row_kernel = clCreateKernel(program, "h_mat_row_kernel", &error);
-    CheckError(error);
+    std::vector<NumaPlacement> placements;
+    if (placement == "compare") {
+        placements = { NumaPlacement::kInterleave, NumaPlacement::kReplicate };
+    } else {
+        placements = { ParseNumaPlacement(placement) };
+    }
+    std::cout << "NUMA: " << GetNumaTopology().GetNumNodes() << " node(s), worker threads " << (pool.IsPinned() ? "pinned to them" : "not pinned") << std::endl;
+
+    for (const FastaRecord & reference : references) {
+        std::vector<AlignmentResult> first_results;
+        double first_seconds = 0.0;
+        bool first = true;
+        for (NumaPlacement reference_placement : placements) {
+            auto place_start = std::chrono::steady_clock::now();
+            const NumaReplicas replicas(pool, reference.sequence, reference_placement);
+            auto start = std::chrono::steady_clock::now();
+            std::vector<AlignmentResult> results = CpuAlignQueries(pool, queries, replicas, scoring);
+            auto stop = std::chrono::steady_clock::now();
+
+            if (first) {
+                std::cout << "Reference: " << reference.name << " (" << reference.sequence.size() << " residues)" << std::endl;
+                for (size_t q = 0; q < results.size(); ++q) {
+                    std::cout << "\t" << query_records[q].name << "\t" << results[q].score << "\t" << results[q].reference_end << "\n";
+                }
+            } else if (results.size() != first_results.size()
+                       || !std::equal(results.begin(), results.end(), first_results.begin(), [](const AlignmentResult & lhs, const AlignmentResult & rhs) {
+                              return lhs.score == rhs.score && lhs.reference_end == rhs.reference_end;
+                          })) {
+                throw std::logic_error("CPU results depend on the NUMA placement");
+            }
 
-    cl_kernel zero_kernel = clCreateKernel(program, "zero", &error);
+            const double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() / 1000000000.0;
+            std::cout << "CPU SW took: " << seconds * 1000.0 << " ms, " << query_residues * reference.sequence.size() / seconds / 1000000000.0 << " GCUPS"
+                      << " with " << GetNumaPlacementName(reference_placement) << " placement ("
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(start - place_start).count() << " ms to place)";
+            if (!first) {
+                std::cout << ", " << first_seconds / seconds << "x of " << GetNumaPlacementName(placements.front());
+            }
+            std::cout << std::endl;
 
-    using DataType = int32_t;
+            if (first) {
+                first_results = std::move(results);
+                first_seconds = seconds;
+                first = false;
+            }
+        }
+    }
 
-    DataType match = 5;
-    DataType mismatch = -3;
-    DataType gap_start_penalty = -8;
-    DataType gap_extend_penalty = -1;
+    PrintThreadPoolStats(pool);
+}
 
-//    std::string seq1 = "CAGCCTCGCTTAG";
-//    std::string seq2 = "AATGCCATTGCCGG";
+// Results kept in memory when the CLI turns the result cache on; one entry is about 150 bytes
+const size_t kResultCacheEntries = 1 << 20;
 
-    std::string seq1 = GenerateRandomNucleotideString(20'000'000); // columns
-    std::string seq2 = GenerateRandomNucleotideString(150); // rows
+void PrintResultCacheStats(const ResultCacheStats & stats) {
+    std::cout << "Result cache: " << stats.memory_hits << " memory hit(s), " << stats.disk_hits << " disk hit(s), " << stats.misses << " miss(es), "
+              << stats.duplicates << " repeat(s) within a batch, hit rate " << 100.0 * stats.GetHitRate() << "%; "
+              << stats.memory_entries << " entries in memory, " << stats.disk_entries << " on disk" << std::endl;
+}
 
-    std::cout << "seq1.size(): " << seq1.size() << std::endl;
-    std::cout << "seq2.size(): " << seq2.size() << std::endl;
+void PrintHitWriterStats(HitWriter & writer) {
+    const HitWriterStats stats = writer.GetStats();
+    std::cerr << "Hits written: " << stats.hits << " in " << stats.batches << " batch(es), " << stats.bytes << " bytes in " << stats.writes
+              << " write(s), " << stats.producer_stalls << " stall(s) on a full queue" << std::endl;
+}
 
-    Matrix<DataType> h_mat(seq2.size() + 1, seq1.size() + 1, 0);
+// Hits written to stdout ("-") keep it to themselves, whatever their format: everything else the
+// run prints goes to stderr instead. Call before anything is printed.
+void ReserveStdoutForHits(const std::string & hits_filename) {
+    if (hits_filename == "-") {
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+}
 
-    const size_t row_size = seq1.size() + 1;
-    const size_t padded_row_size = GetPaddedRowSize(row_size);
+// Hit output for every query against every reference, in the format the file name asks for
+std::unique_ptr<HitWriter> CreateHitWriter(const std::string & filename, const std::vector<FastaRecord> & query_records, const std::vector<FastaRecord> & reference_records) {
+    std::vector<std::string> query_names;
+    for (const FastaRecord & query : query_records) {
+        query_names.push_back(query.name);
+    }
+    std::vector<std::string> reference_names;
+    std::vector<uint64_t> reference_lengths;
+    for (const FastaRecord & reference : reference_records) {
+        reference_names.push_back(reference.name);
+        reference_lengths.push_back(reference.sequence.size());
+    }
+    return std::unique_ptr<HitWriter>(new HitWriter(filename, GetHitFormat(filename), std::move(query_names), std::move(reference_names), std::move(reference_lengths)));
+}
 
-    std::cout << "Padded row size: " << padded_row_size << std::endl;
+void RunEngineAlignment(const std::string & query_filename, const std::string & reference_filename, size_t batch_size, AlignmentMethod method, size_t prefix_snapshots,
+                        const std::string & result_cache, const std::string & hits_filename) {
+    std::vector<FastaRecord> query_records = ReadFasta(query_filename);
+    std::vector<FastaRecord> references = ReadFasta(reference_filename);
+
+    SmithWatermanEngineOptions options;
+    options.method = method;
+    options.prefix_snapshots = prefix_snapshots;
+    if (!result_cache.empty()) {
+        options.result_cache_entries = kResultCacheEntries;
+        options.result_cache_path = result_cache == "-" ? "" : result_cache;
+    }
+    SmithWatermanEngine engine(options);
 
-    auto pow_of_2 = [](const size_t pow)
-    {
-        return 1 << pow;
-    };
+    size_t max_query_length = 0;
+    for (const FastaRecord & query : query_records) {
+        max_query_length = std::max(max_query_length, query.sequence.size());
+    }
+    for (const FastaRecord & reference : references) {
+        std::cout << "Reference: " << reference.name << std::endl;
+        const EngineKind kind = engine.ChooseEngine(max_query_length, reference.sequence.size());
+        PrintMemoryPlan(engine.PlanJob(kind, std::min(batch_size, query_records.size()), max_query_length, reference.sequence.size()));
+    }
 
+    auto start = std::chrono::steady_clock::now();
 
-    auto log2 = [](size_t num) {
-        size_t log = 0;
+    // Submit everything up front so the engine can overlap consecutive jobs
+    std::vector<std::future<std::vector<AlignmentResult>>> jobs;
+    uint64_t cells = 0;
+    for (const FastaRecord & reference : references) {
+        auto reference_ptr = std::make_shared<const std::string>(reference.sequence);
+        for (size_t q = 0; q < query_records.size(); q += batch_size) {
+            std::vector<std::string> query_batch;
+            for (size_t k = q; k < std::min(q + batch_size, query_records.size()); ++k) {
+                query_batch.push_back(query_records[k].sequence);
+                cells += query_records[k].sequence.size() * reference.sequence.size();
+            }
+            jobs.push_back(engine.Submit(std::move(query_batch), reference_ptr));
+        }
+    }
 
-        while (num != 0) {
-            num = num >> 1;
-            ++log;
+    std::unique_ptr<HitWriter> hit_writer;
+    if (!hits_filename.empty()) {
+        hit_writer = CreateHitWriter(hits_filename, query_records, references);
+    }
+
+    size_t job = 0;
+    for (size_t r = 0; r < references.size(); ++r) {
+        if (!hit_writer) {
+            std::cout << "Reference: " << references[r].name << " (" << references[r].sequence.size() << " residues)" << std::endl;
         }
+        for (size_t q = 0; q < query_records.size(); q += batch_size) {
+            std::vector<AlignmentResult> results = jobs[job++].get();
+            if (hit_writer) {
+                std::vector<Hit> hits(results.size());
+                for (size_t k = 0; k < results.size(); ++k) {
+                    hits[k].query_index = static_cast<uint32_t>(q + k);
+                    hits[k].reference_index = static_cast<uint32_t>(r);
+                    hits[k].score = results[k].score;
+                    hits[k].reference_end = results[k].reference_end;
+                }
+                hit_writer->Write(std::move(hits));
+                continue;
+            }
+            for (size_t k = 0; k < results.size(); ++k) {
+                std::cout << "\t" << query_records[q + k].name << "\t" << results[k].score << "\t" << results[k].reference_end << "\n";
+            }
+        }
+    }
+    if (hit_writer) {
+        hit_writer->Close();
+    }
 
-        return log-1;
-    };
+    auto stop = std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() / 1000000000.0;
+    std::cout << "Engine took: " << seconds * 1000.0 << " ms for " << jobs.size() << " job(s), " << cells / seconds / 1000000000.0 << " GCUPS" << std::endl;
+    if (hit_writer) {
+        PrintHitWriterStats(*hit_writer);
+    }
 
+    const SmithWatermanEngineStats stats = engine.GetStats();
+    std::cout << "Cells computed: " << stats.cells << ", saved by shared query prefixes: " << stats.cells_saved
+              << " (" << (stats.cells + stats.cells_saved > 0 ? 100.0 * stats.cells_saved / (stats.cells + stats.cells_saved) : 0.0) << "%)" << std::endl;
+    if (!result_cache.empty()) {
+        PrintResultCacheStats(stats.cache);
+    }
+}
 
+void RunSegmentedAlignment(const std::string & query_filename, const std::string & reference_filename, size_t batch_size, const std::string & hits_filename) {
+    std::vector<FastaRecord> query_records = ReadFasta(query_filename);
+    std::vector<FastaRecord> reference_records = ReadFasta(reference_filename);
+    if (reference_records.empty()) {
+        throw std::runtime_error("No sequence in " + reference_filename);
+    }
 
-    cl_mem f_mat_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * row_size, NULL, &error);
-    CheckError(error);
+    SmithWatermanEngine engine;
+
+    auto references = std::make_shared<std::vector<std::string>>();
+    size_t packed_length = 0;
+    size_t longest_reference = 0;
+    size_t max_query_length = 0;
+    for (const FastaRecord & reference : reference_records) {
+        references->push_back(reference.sequence);
+        if (!reference.sequence.empty()) {
+            // Behind a separator, like the engine packs it; the first one's is column 0
+            packed_length += (packed_length > 0 ? 1 : 0) + reference.sequence.size();
+            longest_reference = std::max(longest_reference, reference.sequence.size());
+        }
+    }
+    for (const FastaRecord & query : query_records) {
+        max_query_length = std::max(max_query_length, query.sequence.size());
+    }
+    PrintMemoryPlan(engine.PlanSegmentedJob(std::min(batch_size, query_records.size()), max_query_length, packed_length, longest_reference));
 
-    cl_mem f_mat_prev_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * row_size, NULL, &error);
-    CheckError(error);
+    auto start = std::chrono::steady_clock::now();
 
-    cl_mem h_mat_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * row_size, NULL, &error);
-    CheckError(error);
+    std::vector<std::future<std::vector<AlignmentResult>>> jobs;
+    uint64_t cells = 0;
+    for (size_t q = 0; q < query_records.size(); q += batch_size) {
+        std::vector<std::string> query_batch;
+        for (size_t k = q; k < std::min(q + batch_size, query_records.size()); ++k) {
+            query_batch.push_back(query_records[k].sequence);
+            cells += query_records[k].sequence.size() * packed_length;
+        }
+        jobs.push_back(engine.SubmitSegmented(std::move(query_batch), references));
+    }
 
-    cl_mem h_mat_prev_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * row_size, NULL, &error);
-    CheckError(error);
+    std::unique_ptr<HitWriter> hit_writer;
+    if (!hits_filename.empty()) {
+        hit_writer = CreateHitWriter(hits_filename, query_records, reference_records);
+    }
 
-    cl_mem h_hat_mat_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * row_size, NULL, &error);
-    CheckError(error);
+    size_t job = 0;
+    for (size_t q = 0; q < query_records.size(); q += batch_size) {
+        std::vector<AlignmentResult> results = jobs[job++].get();
+        if (hit_writer) {
+            std::vector<Hit> hits(results.size());
+            for (size_t k = 0; k < results.size(); ++k) {
+                hits[k].query_index = static_cast<uint32_t>(q + k / reference_records.size());
+                hits[k].reference_index = static_cast<uint32_t>(k % reference_records.size());
+                hits[k].score = results[k].score;
+                hits[k].reference_end = results[k].reference_end;
+            }
+            hit_writer->Write(std::move(hits));
+            continue;
+        }
+        for (size_t k = 0; k < results.size(); ++k) {
+            const FastaRecord & query = query_records[q + k / reference_records.size()];
+            const FastaRecord & reference = reference_records[k % reference_records.size()];
+            std::cout << query.name << "\t" << reference.name << "\t" << results[k].score << "\t" << results[k].reference_end << "\n";
+        }
+    }
+    if (hit_writer) {
+        hit_writer->Close();
+    }
 
-    cl_mem padded_row_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(DataType) * padded_row_size, NULL, &error); // This also doubles as e_mat row
-    CheckError(error);
+    auto stop = std::chrono::steady_clock::now();
+    const double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() / 1000000000.0;
+    std::cout << "Segmented scan took: " << seconds * 1000.0 << " ms for " << reference_records.size() << " reference(s), " << cells / seconds / 1000000000.0 << " GCUPS" << std::endl;
+    if (hit_writer) {
+        PrintHitWriterStats(*hit_writer);
+    }
+}
 
-    cl_mem a_subs_score_row_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(DataType) * row_size, NULL, &error);
-    CheckError(error);
+bool EndsWith(const std::string & value, const std::string & suffix) {
+    return value.size() >= suffix.size() && value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
 
-    cl_mem c_subs_score_row_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(DataType) * row_size, NULL, &error);
-    CheckError(error);
+void RunGenerate(uint64_t length, const std::string & output_filename, uint64_t seed) {
+    ThreadPool & pool = GetThreadPool();
 
-    cl_mem g_subs_score_row_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(DataType) * row_size, NULL, &error);
-    CheckError(error);
+    auto start = std::chrono::steady_clock::now();
+    const PackedSequence reference = GenerateReference(pool, seed, length);
+    auto generated = std::chrono::steady_clock::now();
 
-    cl_mem t_subs_score_row_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(DataType) * row_size, NULL, &error);
-    CheckError(error);
+    // .pack keeps the 2 bit form, anything else is FASTA
+    if (EndsWith(output_filename, ".pack")) {
+        WritePacked(output_filename, reference);
+    } else {
+        WritePackedAsFasta(pool, output_filename, "synthetic_" + std::to_string(seed), reference);
+    }
+    auto written = std::chrono::steady_clock::now();
 
-    ZeroRow(f_mat_row_buffer, row_size, zero_kernel, command_queue);
-    ZeroRow(f_mat_prev_row_buffer, row_size, zero_kernel, command_queue);
-    ZeroRow(h_mat_row_buffer, row_size, zero_kernel, command_queue);
-    ZeroRow(h_mat_prev_row_buffer, row_size, zero_kernel, command_queue);
-    ZeroRow(h_hat_mat_row_buffer, row_size, zero_kernel, command_queue);
-    ZeroRow(padded_row_buffer, padded_row_size, zero_kernel, command_queue);
-    ZeroRow(a_subs_score_row_buffer, row_size, zero_kernel, command_queue);
-    ZeroRow(c_subs_score_row_buffer, row_size, zero_kernel, command_queue);
-    ZeroRow(g_subs_score_row_buffer, row_size, zero_kernel, command_queue);
-    ZeroRow(t_subs_score_row_buffer, row_size, zero_kernel, command_queue);
+    std::cout << "Generated " << length << " residues with seed " << seed << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(generated - start).count() << " ms, wrote " << output_filename << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(written - generated).count() << " ms" << std::endl;
+}
 
-    clFinish(command_queue);
+void RunSimulate(const std::string & reference_filename, const std::string & reads_filename, const ReadSimulationOptions & options) {
+    const std::string reference = ReadFirstSequence(reference_filename);
 
-    std::map<char, cl_mem> query_character_row_score_map;
-    {
-        // A
-        std::vector<DataType> a_vec(row_size, 0);
-        for (int c = 1; c < row_size; ++c) {
-            a_vec[c] = seq1[c-1] == 'A' ? match : mismatch;
-        }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<SimulatedRead> reads = SimulateReads(GetThreadPool(), reference, options);
+    auto sampled = std::chrono::steady_clock::now();
+
+    const std::string truth_filename = reads_filename + ".truth.tsv";
+    WriteSimulatedReads(reads_filename, truth_filename, reads);
+    auto written = std::chrono::steady_clock::now();
+
+    uint64_t snps = 0;
+    uint64_t insertions = 0;
+    uint64_t deletions = 0;
+    for (const SimulatedRead & read : reads) {
+        snps += read.num_snps;
+        insertions += read.num_insertions;
+        deletions += read.num_deletions;
+    }
+    std::cout << "Sampled " << reads.size() << " read(s) of " << options.read_length << " with seed " << options.seed << ": " << snps << " SNP(s), "
+              << insertions << " insertion(s), " << deletions << " deletion(s) in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(sampled - start).count() << " ms; wrote " << reads_filename << " and "
+              << truth_filename << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(written - sampled).count() << " ms" << std::endl;
+}
 
-        clEnqueueWriteBuffer(command_queue, a_subs_score_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, a_vec.data(), 0, nullptr, nullptr);
+// Daemon requests are chunked as if their queries were at least this long, so a reference is cut
+// the same way whatever batch arrives and the warmed profiles stay valid for reads up to here
+const size_t kDaemonPlannedQueryLength = 1000;
 
-        // C
-        std::vector<DataType> c_vec(row_size, 0);
-        for (int c = 1; c < row_size; ++c) {
-            c_vec[c] = seq1[c-1] == 'C' ? match : mismatch;
-        }
+void RunDaemon(const std::string & socket_path, const std::string & reference_filename, const std::string & result_cache_path) {
+    std::vector<FastaRecord> references = ReadFasta(reference_filename);
 
-        clEnqueueWriteBuffer(command_queue, c_subs_score_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, c_vec.data(), 0, nullptr, nullptr);
+    SmithWatermanEngineOptions options;
+    options.max_cached_references = std::max<size_t>(references.size(), 1);
+    options.result_cache_entries = kResultCacheEntries;
+    options.result_cache_path = result_cache_path;
+    options.planned_query_length = kDaemonPlannedQueryLength;
+    SmithWatermanEngine engine(options);
 
-        // G
-        std::vector<DataType> g_vec(row_size, 0);
-        for (int c = 1; c < row_size; ++c) {
-            g_vec[c] = seq1[c-1] == 'G' ? match : mismatch;
-        }
+    SmithWatermanDaemon daemon(engine, std::move(references), socket_path);
+    daemon.Serve();
+}
 
-        clEnqueueWriteBuffer(command_queue, g_subs_score_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, g_vec.data(), 0, nullptr, nullptr);
+void RunDaemonClient(const std::string & socket_path, const std::string & query_filename, uint32_t reference_index) {
+    std::vector<FastaRecord> query_records = ReadFasta(query_filename);
 
-        // T
-        std::vector<DataType> t_vec(row_size, 0);
-        for (int c = 1; c < row_size; ++c) {
-            t_vec[c] = seq1[c-1] == 'T' ? match : mismatch;
-        }
+    std::vector<std::string> queries;
+    for (auto & record : query_records) {
+        queries.push_back(record.sequence);
+    }
 
-        clEnqueueWriteBuffer(command_queue, t_subs_score_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, t_vec.data(), 0, nullptr, nullptr);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<AlignmentResult> results = DaemonAlign(socket_path, reference_index, queries);
+    auto stop = std::chrono::steady_clock::now();
 
-        query_character_row_score_map.emplace('A', a_subs_score_row_buffer);
-        query_character_row_score_map.emplace('C', c_subs_score_row_buffer);
-        query_character_row_score_map.emplace('G', g_subs_score_row_buffer);
-        query_character_row_score_map.emplace('T', t_subs_score_row_buffer);
+    for (size_t q = 0; q < results.size(); ++q) {
+        std::cout << query_records[q].name << "\t" << results[q].score << "\t" << results[q].reference_end << "\n";
+    }
+    std::cout << "Request took: " << std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count() << " us" << std::endl;
+}
 
-        clFinish(command_queue);
+int main (int argc, char * argv[])
+{
+    const bool search_mode = argc > 1 && std::string(argv[1]) == "search";
+    if (search_mode && argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " search <query.fasta> <database.fasta> [top_n]" << std::endl;
+        return 1;
     }
 
+    // Without arguments the row scan runs on random sequences, never checkpointed
+    RowScanOptions scan_options;
+    if (argc > 1 && std::string(argv[1]) == "scan") {
+        if (argc < 4) {
+            std::cerr << "Usage: " << argv[0] << " scan <query.fasta> <reference.fasta> [checkpoint_file [interval_seconds] [--resume]]" << std::endl;
+            return 1;
+        }
+        scan_options.query_filename = argv[2];
+        scan_options.reference_filename = argv[3];
+        scan_options.checkpoint_filename = argc > 4 ? argv[4] : "";
+        for (int k = 5; k < argc; ++k) {
+            if (std::string(argv[k]) == "--resume") {
+                scan_options.resume = true;
+            } else {
+                scan_options.checkpoint_interval = std::chrono::seconds(std::stoul(argv[k]));
+            }
+        }
+    }
 
-    auto start = std::chrono::steady_clock::now();
-    for (size_t r = 1; r < h_mat.GetNumRows(); ++r) {
-        cl_event f_mat_and_h_hat_mat_finished;
-        // Calculate f_mat_row
-        {
-            error = 0;
-            error = clSetKernelArg(f_mat_and_h_hat_mat_row_kernel, 0, sizeof(cl_mem), &f_mat_prev_row_buffer);
-            error |= clSetKernelArg(f_mat_and_h_hat_mat_row_kernel, 1, sizeof(cl_mem), &h_mat_prev_row_buffer);
-            error |= clSetKernelArg(f_mat_and_h_hat_mat_row_kernel, 2, sizeof(cl_mem), &f_mat_row_buffer);
-            error |= clSetKernelArg(f_mat_and_h_hat_mat_row_kernel, 3, sizeof(cl_mem), &(query_character_row_score_map[seq2[r-1]]));
-            error |= clSetKernelArg(f_mat_and_h_hat_mat_row_kernel, 4, sizeof(cl_mem), &h_hat_mat_row_buffer);
+    if (argc > 1 && std::string(argv[1]) == "cpu") {
+        if (argc < 4) {
+            std::cerr << "Usage: " << argv[0] << " cpu <query.fasta> <reference.fasta> [default|interleave|replicate|compare]" << std::endl;
+            return 1;
+        }
+        RunCpuAlignment(ScoringScheme(), argv[2], argv[3], argc > 4 ? argv[4] : "default");
+        return 0;
+    }
 
-            CheckError(error);
+    if (argc > 1 && std::string(argv[1]) == "align") {
+        const std::string method = argc > 5 ? argv[5] : "auto";
+        const size_t batch_size = argc > 4 ? std::stoul(argv[4]) : 16;
+        if (argc < 4 || batch_size == 0 || (method != "auto" && method != "rowscan" && method != "wavefront")) {
+            std::cerr << "Usage: " << argv[0] << " align <query.fasta> <reference.fasta> [batch_size] [auto|rowscan|wavefront] [prefix_snapshots] [result_cache_file|-] [hits_file|-]" << std::endl;
+            std::cerr << "       hits files ending in .sam are written as SAM, .hits as binary, anything else as tab separated" << std::endl;
+            std::cerr << "       with hits on stdout (-) everything else goes to stderr" << std::endl;
+            return 1;
+        }
+        ReserveStdoutForHits(argc > 8 ? argv[8] : "");
+        RunEngineAlignment(argv[2], argv[3], batch_size,
+                           method == "rowscan" ? AlignmentMethod::kRowScan : method == "wavefront" ? AlignmentMethod::kWavefront : AlignmentMethod::kAuto,
+                           argc > 6 ? std::stoul(argv[6]) : 0, argc > 7 ? argv[7] : "", argc > 8 ? argv[8] : "");
+        return 0;
+    }
 
-            size_t global = row_size;
-            error = clEnqueueNDRangeKernel(command_queue, f_mat_and_h_hat_mat_row_kernel, 1, NULL, &global, nullptr, 0, nullptr, &f_mat_and_h_hat_mat_finished);
-            CheckError(error);
+    if (argc > 1 && std::string(argv[1]) == "segments") {
+        const size_t batch_size = argc > 4 ? std::stoul(argv[4]) : 16;
+        if (argc < 4 || batch_size == 0) {
+            std::cerr << "Usage: " << argv[0] << " segments <query.fasta> <references.fasta> [batch_size] [hits_file|-]" << std::endl;
+            return 1;
         }
+        ReserveStdoutForHits(argc > 5 ? argv[5] : "");
+        RunSegmentedAlignment(argv[2], argv[3], batch_size, argc > 5 ? argv[5] : "");
+        return 0;
+    }
 
-        cl_event padded_row_buffer_load_finished;
-        {
-            error = clEnqueueCopyBuffer(command_queue, h_hat_mat_row_buffer, padded_row_buffer, 0, 0, row_size * sizeof(DataType), 1, &f_mat_and_h_hat_mat_finished, &padded_row_buffer_load_finished);
-            CheckError(error);
-            clReleaseEvent(f_mat_and_h_hat_mat_finished);
+    if (argc > 1 && std::string(argv[1]) == "generate") {
+        if (argc < 4) {
+            std::cerr << "Usage: " << argv[0] << " generate <length> <reference.fasta|reference.pack> [seed]" << std::endl;
+            return 1;
         }
+        RunGenerate(std::stoull(argv[2]), argv[3], argc > 4 ? std::stoull(argv[4], nullptr, 0) : GetSyntheticSeed());
+        return 0;
+    }
 
-        cl_event upsweep_finished;
-        {
-            // Upsweep
-            std::vector<cl_event> upsweep_row_finished(log2(padded_row_size) - 1);
-            for (size_t depth = 0; depth < log2(padded_row_size); ++depth) {
-                error = 0;
-                error = clSetKernelArg(upsweep_kernel, 0, sizeof(cl_mem), &padded_row_buffer);
-                error |= clSetKernelArg(upsweep_kernel, 1, sizeof(cl_int), &depth);
-                CheckError(error);
+    if (argc > 1 && std::string(argv[1]) == "simulate") {
+        if (argc < 5) {
+            std::cerr << "Usage: " << argv[0] << " simulate <reference.fasta|reference.pack> <reads.fasta> <num_reads> [read_length] [snp_rate] [indel_rate] [seed]" << std::endl;
+            std::cerr << "       the true position and CIGAR of every read go to <reads.fasta>.truth.tsv" << std::endl;
+            return 1;
+        }
+        ReadSimulationOptions options;
+        options.num_reads = std::stoul(argv[4]);
+        if (argc > 5) {
+            options.read_length = std::stoul(argv[5]);
+        }
+        if (argc > 6) {
+            options.snp_rate = std::stod(argv[6]);
+        }
+        if (argc > 7) {
+            // Split evenly between insertions and deletions
+            options.insertion_rate = options.deletion_rate = std::stod(argv[7]) / 2;
+        }
+        options.seed = argc > 8 ? std::stoull(argv[8], nullptr, 0) : GetSyntheticSeed();
+        RunSimulate(argv[2], argv[3], options);
+        return 0;
+    }
 
-                size_t global = padded_row_size / pow_of_2(depth+1);
-                if (depth == log2(padded_row_size) - 1) {
-                    // Last iteration
-                    error = clEnqueueNDRangeKernel(command_queue, upsweep_kernel, 1, NULL, &global, nullptr, 1, &upsweep_row_finished[depth-1], &upsweep_finished);
-                } else if (depth == 0) {
-                    // First iteration
-                    error = clEnqueueNDRangeKernel(command_queue, upsweep_kernel, 1, NULL, &global, nullptr, 1, &padded_row_buffer_load_finished, &upsweep_row_finished[depth]);
-                    clReleaseEvent(padded_row_buffer_load_finished);
-                } else {
-                    error = clEnqueueNDRangeKernel(command_queue, upsweep_kernel, 1, NULL, &global, nullptr, 1, &upsweep_row_finished[depth-1], &upsweep_row_finished[depth]);
-                }
-                CheckError(error);
-            }
+    if (argc > 1 && std::string(argv[1]) == "serve") {
+        if (argc < 4) {
+            std::cerr << "Usage: " << argv[0] << " serve <socket_path> <reference.fasta> [result_cache_file]" << std::endl;
+            return 1;
+        }
+        RunDaemon(argv[2], argv[3], argc > 4 ? argv[4] : "");
+        return 0;
+    }
 
-            for (auto & event : upsweep_row_finished) {
-                clReleaseEvent(event);
-            }
+    if (argc > 1 && std::string(argv[1]) == "client") {
+        if (argc < 4) {
+            std::cerr << "Usage: " << argv[0] << " client <socket_path> <query.fasta> [reference_index]" << std::endl;
+            std::cerr << "       " << argv[0] << " client <socket_path> stats|shutdown" << std::endl;
+            return 1;
         }
 
-        cl_event downsweep_initialization_finished;
-        DataType zero = 0;
-        {
-            error = clEnqueueWriteBuffer(command_queue, padded_row_buffer, CL_FALSE, (padded_row_size-1) * sizeof(DataType), sizeof(DataType), &zero, 1, &upsweep_finished, &downsweep_initialization_finished);
-            CheckError(error);
-            clReleaseEvent(upsweep_finished);
+        const std::string command = argv[3];
+        if (command == "stats") {
+            std::cout << DaemonStats(argv[2]) << std::endl;
+        } else if (command == "shutdown") {
+            DaemonShutdown(argv[2]);
+        } else {
+            RunDaemonClient(argv[2], command, argc > 4 ? std::stoul(argv[4]) : 0);
         }
+        return 0;
+    }
 
-        cl_event downsweep_finished;
-        {
-        // Downsweep
-        std::vector<cl_event> downsweep_row_finished(log2(padded_row_size) - 1);
+    cl_uint platformIdCount = 0;
+    clGetPlatformIDs (0, nullptr, &platformIdCount);
 
-            for (int64_t depth = log2(padded_row_size) - 1; depth >= 0; --depth) {
-                error = 0;
-                error = clSetKernelArg(downsweep_kernel, 0, sizeof(cl_mem), &padded_row_buffer);
-                error |= clSetKernelArg(downsweep_kernel, 1, sizeof(cl_int), &depth);
-                CheckError(error);
+    if (platformIdCount == 0) {
+        std::cerr << "No OpenCL platform found" << std::endl;
+        return 1;
+    } else {
+        std::cout << "Found " << platformIdCount << " platform(s)" << std::endl;
+    }
 
-                size_t global = padded_row_size / pow_of_2(depth+1);
-
-                if (depth == log2(padded_row_size) - 1) {
-                    // First iteration
-                    error = clEnqueueNDRangeKernel(command_queue, downsweep_kernel, 1, NULL, &global, nullptr, 1, &downsweep_initialization_finished, &downsweep_row_finished[depth-1]);
-                    clReleaseEvent(downsweep_initialization_finished);
-                } else if (depth == 0) {
-                    // Last iteration
-                    error = clEnqueueNDRangeKernel(command_queue, downsweep_kernel, 1, NULL, &global, nullptr, 1, &downsweep_row_finished[depth], &downsweep_finished);
-                } else {
-                    error = clEnqueueNDRangeKernel(command_queue, downsweep_kernel, 1, NULL, &global, nullptr, 1, &downsweep_row_finished[depth], &downsweep_row_finished[depth-1]);
-                }
+    std::vector<cl_platform_id> platformIds (platformIdCount);
+    clGetPlatformIDs (platformIdCount, platformIds.data(), nullptr);
 
-                CheckError(error);
-            }
+    for (cl_uint i = 0; i < platformIdCount; ++i) {
+        std::cout << "\t (" << (i+1) << ") : " << GetPlatformName (platformIds [i]) << std::endl;
+    }
 
-            for (auto & event : downsweep_row_finished) {
-                clReleaseEvent(event);
-            }
-        }
+    cl_uint deviceIdCount = 0;
+    clGetDeviceIDs (platformIds[0], CL_DEVICE_TYPE_ALL, 0, nullptr, &deviceIdCount);
 
-        // Calculate h_mat_row
-        cl_event h_mat_finished;
-        {
-            error = 0;
-            error = clSetKernelArg(h_mat_row_kernel, 0, sizeof(cl_mem), &h_hat_mat_row_buffer);
-            error |= clSetKernelArg(h_mat_row_kernel, 1, sizeof(cl_mem), &padded_row_buffer);
-            error |= clSetKernelArg(h_mat_row_kernel, 2, sizeof(cl_mem), &h_mat_row_buffer);
+    if (deviceIdCount == 0) {
+        std::cerr << "No OpenCL devices found" << std::endl;
+        return 1;
+    } else {
+        std::cout << "Found " << deviceIdCount << " device(s)" << std::endl;
+    }
 
-            CheckError(error);
+    std::vector<cl_device_id> deviceIds (deviceIdCount);
+    clGetDeviceIDs (platformIds [0], CL_DEVICE_TYPE_ALL, deviceIdCount,
+                    deviceIds.data (), nullptr);
 
-            size_t global = row_size;
-            error = clEnqueueNDRangeKernel(command_queue, h_mat_row_kernel, 1, NULL, &global, nullptr, 1, &downsweep_finished, &h_mat_finished);
-            CheckError(error);
-            clReleaseEvent(downsweep_finished);
-        }
+    for (cl_uint i = 0; i < deviceIdCount; ++i) {
+        std::cout << "\t (" << (i+1) << ") : " << GetDeviceName (deviceIds [i]) << std::endl;
+    }
 
-//        // Copy to host
-//        {
-//            error = clEnqueueReadBuffer(command_queue, h_mat_row_buffer, CL_FALSE, 0, sizeof(DataType) * row_size, h_mat[r], 1, &h_mat_finished, nullptr);
-//            CheckError(error);
-//            clReleaseEvent(h_mat_finished);
-//        }
+    const cl_context_properties contextProperties [] = { CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platformIds[0]), 0, 0 };
 
-        {
-            clFinish(command_queue);
-        }
+    cl_int error = CL_SUCCESS;
+    cl_context context = clCreateContext (contextProperties, deviceIdCount, deviceIds.data (), nullptr, nullptr, &error);
+    CheckError (error);
+    
+    std::cout << "Context created" << std::endl;
 
-        std::swap(f_mat_row_buffer, f_mat_prev_row_buffer);
-        std::swap(h_mat_row_buffer, h_mat_prev_row_buffer);
-    }
-    auto stop = std::chrono::steady_clock::now();
-    auto SW_time_milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count();
+    size_t DEVICE_NUMBER=2;
 
-    std::cout << "SW took: " << SW_time_milliseconds << " ms" << std::endl;
-    std::cout << "Estimated time to search entire genome: " << std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count() * (3000000000 / seq1.size()) / 1000000000.0 << " s" << std::endl;
+    PrintDeviceInfo(deviceIds[DEVICE_NUMBER]);
 
-//    for (int r = 0; r < h_mat.GetNumRows(); ++r) {
-//        for (int c = 0; c < h_mat.GetNumCols(); ++c) {
-//            std::cout << h_mat[r][c] << "\t";
-//        }
-//        std::cout << "\n";
-//    }
-//    std::cout << std::endl;
+#ifdef __APPLE__ // Apple doesn't support out of order execution wtf?
+    cl_command_queue command_queue = clCreateCommandQueue (context, deviceIds[DEVICE_NUMBER], 0, &error);
+#else
+    cl_command_queue command_queue = clCreateCommandQueue (context, deviceIds[DEVICE_NUMBER], CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &error);
+#endif
+    CheckError (error);
 
-    clReleaseMemObject(f_mat_row_buffer);
-    clReleaseMemObject(f_mat_prev_row_buffer);
-    clReleaseMemObject(h_mat_row_buffer);
-    clReleaseMemObject(h_mat_prev_row_buffer);
-    clReleaseMemObject(h_hat_mat_row_buffer);
-    clReleaseMemObject(padded_row_buffer);
-    clReleaseMemObject(a_subs_score_row_buffer);
-    clReleaseMemObject(c_subs_score_row_buffer);
-    clReleaseMemObject(g_subs_score_row_buffer);
-    clReleaseMemObject(t_subs_score_row_buffer);
+    ScoringScheme scoring;
 
+    cl_program program = BuildProgramFromFile(context, deviceIds[DEVICE_NUMBER], SW_KERNELS_FILENAME, GetBuildOptions(scoring));
 
-    clReleaseKernel(f_mat_and_h_hat_mat_row_kernel);
-    //clReleaseKernel(h_hat_mat_row_kernel);
-    clReleaseKernel(upsweep_kernel);
-    clReleaseKernel(downsweep_kernel);
-    clReleaseKernel(h_mat_row_kernel);
-    clReleaseKernel(zero_kernel);
+    if (search_mode) {
+        size_t top_n = argc > 4 ? std::stoul(argv[4]) : 10;
+        RunDatabaseSearch(context, deviceIds[DEVICE_NUMBER], command_queue, program, scoring, argv[2], argv[3], top_n);
+    } else {
+        RunRowScan(context, deviceIds[DEVICE_NUMBER], command_queue, program, scoring, scan_options);
+    }
 
     clReleaseProgram(program);
 
@@ -0,0 +1,311 @@
+#include "memory_planner.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "alignment_result.h"
+#include "cpu_sw.h"
+
+namespace {
+    // Drivers keep part of global memory for themselves; leave the same share of host RAM to the OS.
+    const double kDeviceMemoryFraction = 0.9;
+    const double kHostMemoryFraction = 0.8;
+
+    void AddBuffer(std::vector<BufferPlan> & buffers, const std::string & name, uint64_t bytes, size_t count) {
+        if (count > 0) {
+            buffers.push_back(BufferPlan { name, bytes, count });
+        }
+    }
+
+    // Totals the buffer lists and decides whether the plan fits.
+    void FinishPlan(MemoryPlan & plan, const MemoryBudget & budget) {
+        plan.device_bytes = 0;
+        plan.largest_allocation = 0;
+        for (const auto & buffer : plan.device_buffers) {
+            plan.device_bytes += buffer.bytes * buffer.count;
+            plan.largest_allocation = std::max(plan.largest_allocation, buffer.bytes);
+        }
+
+        plan.host_bytes = 0;
+        for (const auto & buffer : plan.host_buffers) {
+            plan.host_bytes += buffer.bytes * buffer.count;
+        }
+
+        plan.fits = plan.device_bytes <= plan.device_budget && plan.host_bytes <= plan.host_budget && plan.largest_allocation <= budget.device_max_mem_alloc_size;
+    }
+
+    MemoryPlan PlanRowScanChunk(const PlanRequest & request, const MemoryBudget & budget, size_t row_size, size_t padded_row_size, uint64_t overlap) {
+        MemoryPlan plan;
+        plan.engine = request.engine;
+        plan.device_budget = static_cast<uint64_t>(budget.device_global_mem_size * kDeviceMemoryFraction);
+        plan.host_budget = static_cast<uint64_t>(budget.host_mem_size * kHostMemoryFraction);
+
+        plan.chunk_length = row_size - 1;
+        plan.padded_row_size = padded_row_size;
+        if (plan.chunk_length >= request.reference_length) {
+            plan.chunk_overlap = 0;
+            plan.num_chunks = 1;
+        } else {
+            plan.chunk_overlap = overlap;
+            const uint64_t stride = plan.chunk_length - overlap;
+            plan.num_chunks = static_cast<size_t>(1 + (request.reference_length - plan.chunk_length + stride - 1) / stride);
+        }
+
+        const size_t w = request.score_width;
+        const size_t num_streams = std::max<size_t>(request.num_streams, 1);
+        AddBuffer(plan.device_buffers, "row", w * row_size, request.num_row_buffers * num_streams);
+        AddBuffer(plan.device_buffers, "padded row", w * padded_row_size, num_streams);
+        plan.profiles_cached = request.cache_profiles;
+        const size_t num_profiles = request.num_resident_profiles + (request.cache_profiles ? plan.num_chunks : 0);
+        AddBuffer(plan.device_buffers, "score profile row", w * row_size, request.num_profile_rows * num_profiles);
+        AddBuffer(plan.device_buffers, "group max/index", sizeof(cl_int) * request.reduce_num_groups, 2 * num_streams);
+        if (request.segmented) {
+            // Every segment is at least one residue and its boundary column
+            const size_t max_segments = row_size / 2 + 1;
+            AddBuffer(plan.device_buffers, "segment flags", sizeof(cl_int) * padded_row_size, request.num_resident_profiles + num_streams);
+            AddBuffer(plan.device_buffers, "segment offsets", sizeof(cl_uint) * (max_segments + 1), request.num_resident_profiles);
+            AddBuffer(plan.device_buffers, "segment max/end", sizeof(cl_int) * max_segments, 2 * num_streams);
+        }
+
+        AddBuffer(plan.host_buffers, "reference", request.reference_length, 1);
+        AddBuffer(plan.host_buffers, "queries", request.max_query_length, request.query_batch);
+        AddBuffer(plan.host_buffers, "profile staging row", w * row_size, request.num_profile_rows * num_streams);
+        AddBuffer(plan.host_buffers, "checkpoint row", w * row_size, request.num_checkpoint_rows);
+        AddBuffer(plan.host_buffers, "results", sizeof(AlignmentResult) + 2 * sizeof(cl_int) * request.reduce_num_groups, request.query_batch);
+
+        FinishPlan(plan, budget);
+        return plan;
+    }
+
+    MemoryPlan PlanRowScanChunks(const PlanRequest & request, const MemoryBudget & budget) {
+        const size_t full_row_size = static_cast<size_t>(request.reference_length + 1);
+        // Segmented chunks hold whole references, so nothing is cut at a boundary
+        const uint64_t overlap = request.max_query_length > 0 && !request.segmented ? GetChunkOverlap(request.max_query_length, request.scoring) : 0;
+
+        // Halve the padded row until everything fits. Below full size every chunk fills its padded
+        // row exactly, so the scan never works on padding.
+        MemoryPlan plan;
+        for (size_t padded_row_size = GetPaddedRowSize(full_row_size); padded_row_size >= 1; padded_row_size >>= 1) {
+            const size_t row_size = std::min(padded_row_size, full_row_size);
+            if (row_size < full_row_size && (row_size - 1 <= overlap || row_size - 1 < request.longest_segment)) {
+                break; // chunks would not advance past their own overlap, or not hold a whole segment
+            }
+
+            plan = PlanRowScanChunk(request, budget, row_size, padded_row_size, overlap);
+            if (plan.fits) {
+                break;
+            }
+        }
+        return plan;
+    }
+
+    MemoryPlan PlanRowScan(const PlanRequest & request, const MemoryBudget & budget) {
+        MemoryPlan plan = PlanRowScanChunks(request, budget);
+        if (!plan.fits && request.cache_profiles) {
+            // Too long to keep resident whole: its profiles live only as long as the job
+            PlanRequest uncached = request;
+            uncached.cache_profiles = false;
+            plan = PlanRowScanChunks(uncached, budget);
+        }
+        return plan;
+    }
+
+    MemoryPlan PlanWavefrontChunk(const PlanRequest & request, const MemoryBudget & budget, uint64_t chunk_length, uint64_t overlap) {
+        MemoryPlan plan;
+        plan.engine = request.engine;
+        plan.device_budget = static_cast<uint64_t>(budget.device_global_mem_size * kDeviceMemoryFraction);
+        plan.host_budget = static_cast<uint64_t>(budget.host_mem_size * kHostMemoryFraction);
+
+        plan.chunk_length = chunk_length;
+        if (chunk_length >= request.reference_length) {
+            plan.chunk_overlap = 0;
+            plan.num_chunks = 1;
+        } else {
+            plan.chunk_overlap = overlap;
+            const uint64_t stride = chunk_length - overlap;
+            plan.num_chunks = static_cast<size_t>(1 + (request.reference_length - chunk_length + stride - 1) / stride);
+        }
+
+        const size_t w = request.score_width;
+        const size_t num_streams = std::max<size_t>(request.num_streams, 1);
+        const size_t query_length = std::max<size_t>(request.max_query_length, 1);
+        const size_t tile_rows = (query_length + request.tile_rows - 1) / request.tile_rows;
+        AddBuffer(plan.device_buffers, "border row (H, F)", w * std::max<uint64_t>(chunk_length, 1), 2 * num_streams);
+        AddBuffer(plan.device_buffers, "reference chunk", std::max<uint64_t>(chunk_length, 1), num_streams);
+        AddBuffer(plan.device_buffers, "border column (H, E)", w * query_length, 2 * num_streams);
+        AddBuffer(plan.device_buffers, "best score/end", sizeof(cl_int) * query_length, 2 * num_streams);
+        AddBuffer(plan.device_buffers, "query", query_length, num_streams);
+        AddBuffer(plan.device_buffers, "corner", sizeof(cl_int) * tile_rows, num_streams);
+
+        AddBuffer(plan.host_buffers, "reference", request.reference_length, 1);
+        AddBuffer(plan.host_buffers, "queries", request.max_query_length, request.query_batch);
+        AddBuffer(plan.host_buffers, "results", sizeof(AlignmentResult) + 2 * sizeof(cl_int) * query_length, request.query_batch);
+
+        FinishPlan(plan, budget);
+        return plan;
+    }
+
+    MemoryPlan PlanWavefront(const PlanRequest & request, const MemoryBudget & budget) {
+        const uint64_t overlap = request.max_query_length > 0 ? GetChunkOverlap(request.max_query_length, request.scoring) : 0;
+
+        // Only the border row and the reference chunk grow with the chunk, so size it directly.
+        // Columns are int in the kernel.
+        const uint64_t max_chunk_length = std::numeric_limits<cl_int>::max();
+        MemoryPlan plan = PlanWavefrontChunk(request, budget, std::min(request.reference_length, max_chunk_length), overlap);
+        if (plan.fits || request.reference_length == 0) {
+            return plan;
+        }
+
+        MemoryPlan fixed = PlanWavefrontChunk(request, budget, 0, overlap);
+        if (!fixed.fits) {
+            return fixed;
+        }
+
+        const size_t num_streams = std::max<size_t>(request.num_streams, 1);
+        const uint64_t device_per_column = num_streams * (2 * request.score_width + 1);
+        uint64_t chunk_length = (fixed.device_budget - fixed.device_bytes) / device_per_column;
+        chunk_length = std::min<uint64_t>(chunk_length, budget.device_max_mem_alloc_size / request.score_width);
+        chunk_length = std::min(chunk_length, max_chunk_length);
+        if (chunk_length <= overlap) {
+            return PlanWavefrontChunk(request, budget, overlap + 1, overlap);
+        }
+
+        return PlanWavefrontChunk(request, budget, chunk_length, overlap);
+    }
+
+    MemoryPlan PlanDatabaseSearchLaunch(const PlanRequest & request, const MemoryBudget & budget, size_t batches_per_launch) {
+        MemoryPlan plan;
+        plan.engine = request.engine;
+        plan.device_budget = static_cast<uint64_t>(budget.device_global_mem_size * kDeviceMemoryFraction);
+        plan.host_budget = static_cast<uint64_t>(budget.host_mem_size * kHostMemoryFraction);
+
+        const size_t num_batches = (request.num_sequences + request.lane_width - 1) / request.lane_width;
+        const size_t sequences_per_launch = batches_per_launch * request.lane_width;
+        plan.sequences_per_launch = sequences_per_launch;
+        plan.num_chunks = batches_per_launch > 0 ? (num_batches + batches_per_launch - 1) / batches_per_launch : 0;
+
+        const size_t w = request.score_width;
+        AddBuffer(plan.device_buffers, "packed database", std::max<uint64_t>(request.packed_database_size, 1), 1);
+        AddBuffer(plan.device_buffers, "batch offsets", sizeof(cl_uint) * std::max<size_t>(num_batches, 1), 1);
+        AddBuffer(plan.device_buffers, "lengths", sizeof(cl_int) * std::max<size_t>(num_batches * request.lane_width, 1), 1);
+        AddBuffer(plan.device_buffers, "query", std::max<size_t>(request.max_query_length, 1), 1);
+        AddBuffer(plan.device_buffers, "h/e scratch column", w * request.max_query_length * sequences_per_launch, 2);
+        AddBuffer(plan.device_buffers, "scores", sizeof(cl_int) * sequences_per_launch, 2);
+
+        AddBuffer(plan.host_buffers, "database", request.reference_length, 1);
+        AddBuffer(plan.host_buffers, "sorted order", sizeof(size_t) * request.num_sequences, 1);
+        AddBuffer(plan.host_buffers, "query", request.max_query_length, 1);
+        AddBuffer(plan.host_buffers, "scores", sizeof(cl_int) * sequences_per_launch, 2);
+
+        FinishPlan(plan, budget);
+        return plan;
+    }
+
+    MemoryPlan PlanDatabaseSearch(const PlanRequest & request, const MemoryBudget & budget) {
+        const size_t num_batches = (request.num_sequences + request.lane_width - 1) / request.lane_width;
+
+        // Everything but the per-launch buffers is fixed; size the launch from what is left
+        MemoryPlan fixed = PlanDatabaseSearchLaunch(request, budget, 0);
+        if (!fixed.fits || num_batches == 0) {
+            return fixed;
+        }
+
+        const uint64_t device_per_batch = request.lane_width * (2 * request.score_width * request.max_query_length + 2 * sizeof(cl_int));
+        const uint64_t host_per_batch = request.lane_width * 2 * sizeof(cl_int);
+        const uint64_t scratch_per_batch = request.lane_width * request.score_width * std::max<size_t>(request.max_query_length, 1);
+
+        uint64_t batches = num_batches;
+        batches = std::min<uint64_t>(batches, (fixed.device_budget - fixed.device_bytes) / device_per_batch);
+        batches = std::min<uint64_t>(batches, (fixed.host_budget - fixed.host_bytes) / host_per_batch);
+        batches = std::min<uint64_t>(batches, budget.device_max_mem_alloc_size / scratch_per_batch);
+        if (request.max_scratch_size > 0) {
+            batches = std::min<uint64_t>(batches, std::max<uint64_t>(request.max_scratch_size / scratch_per_batch, 1));
+        }
+        if (batches == 0) {
+            MemoryPlan plan = PlanDatabaseSearchLaunch(request, budget, 1);
+            plan.fits = false;
+            return plan;
+        }
+
+        return PlanDatabaseSearchLaunch(request, budget, static_cast<size_t>(batches));
+    }
+
+    std::string FormatBytes(uint64_t bytes) {
+        const char * units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+        double value = static_cast<double>(bytes);
+        size_t unit = 0;
+        while (value >= 1024.0 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+            value /= 1024.0;
+            ++unit;
+        }
+
+        char text[32];
+        snprintf(text, sizeof(text), unit == 0 ? "%.0f %s" : "%.1f %s", value, units[unit]);
+        return text;
+    }
+}
+
+const char * GetEngineName(EngineKind engine) {
+    switch (engine) {
+        case EngineKind::kRowScan:
+            return "row scan";
+        case EngineKind::kWavefront:
+            return "wavefront";
+        case EngineKind::kDatabaseSearch:
+            return "database search";
+    }
+    return "unknown";
+}
+
+MemoryBudget GetMemoryBudget(cl_device_id device_id) {
+    MemoryBudget budget;
+    cl_int error = clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(budget.device_global_mem_size), &budget.device_global_mem_size, nullptr);
+    error |= clGetDeviceInfo(device_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(budget.device_max_mem_alloc_size), &budget.device_max_mem_alloc_size, nullptr);
+    CheckError(error);
+
+    const long pages = sysconf(_SC_PHYS_PAGES);
+    const long page_size = sysconf(_SC_PAGE_SIZE);
+    budget.host_mem_size = pages > 0 && page_size > 0 ? static_cast<uint64_t>(pages) * static_cast<uint64_t>(page_size) : 0;
+
+    return budget;
+}
+
+MemoryPlan PlanMemory(const PlanRequest & request, const MemoryBudget & budget) {
+    switch (request.engine) {
+        case EngineKind::kRowScan:
+            return PlanRowScan(request, budget);
+        case EngineKind::kWavefront:
+            return PlanWavefront(request, budget);
+        case EngineKind::kDatabaseSearch:
+            return PlanDatabaseSearch(request, budget);
+    }
+    throw std::logic_error("Unknown engine");
+}
+
+void PrintMemoryPlan(const MemoryPlan & plan) {
+    std::cout << "Memory plan (" << GetEngineName(plan.engine) << "): " << (plan.fits ? "fits" : "DOES NOT FIT") << std::endl;
+    if (plan.engine == EngineKind::kRowScan) {
+        std::cout << "\t" << plan.num_chunks << " chunk(s) of " << plan.chunk_length << " residues, overlap " << plan.chunk_overlap
+                  << ", padded row " << plan.padded_row_size << (plan.profiles_cached ? ", profiles cached" : "") << "\n";
+    } else if (plan.engine == EngineKind::kWavefront) {
+        std::cout << "\t" << plan.num_chunks << " chunk(s) of " << plan.chunk_length << " residues, overlap " << plan.chunk_overlap << "\n";
+    } else {
+        std::cout << "\t" << plan.num_chunks << " launch(es) of up to " << plan.sequences_per_launch << " sequences\n";
+    }
+
+    std::cout << "\tdevice: " << FormatBytes(plan.device_bytes) << " of " << FormatBytes(plan.device_budget)
+              << ", largest allocation " << FormatBytes(plan.largest_allocation) << "\n";
+    for (const auto & buffer : plan.device_buffers) {
+        std::cout << "\t\t" << buffer.name << ": " << buffer.count << " x " << FormatBytes(buffer.bytes) << "\n";
+    }
+
+    std::cout << "\thost: " << FormatBytes(plan.host_bytes) << " of " << FormatBytes(plan.host_budget) << "\n";
+    for (const auto & buffer : plan.host_buffers) {
+        std::cout << "\t\t" << buffer.name << ": " << buffer.count << " x " << FormatBytes(buffer.bytes) << "\n";
+    }
+    std::cout << std::flush;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "opencl_utils.h"
+#include "scoring.h"
+
+enum class EngineKind {
+    kRowScan,
+    kWavefront,
+    kDatabaseSearch,
+};
+
+const char * GetEngineName(EngineKind engine);
+
+struct MemoryBudget {
+    cl_ulong device_global_mem_size = 0;
+    cl_ulong device_max_mem_alloc_size = 0;
+    uint64_t host_mem_size = 0;
+};
+
+// Device limits from clGetDeviceInfo, host memory from sysconf.
+MemoryBudget GetMemoryBudget(cl_device_id device_id);
+
+struct PlanRequest {
+    EngineKind engine = EngineKind::kRowScan;
+    size_t score_width = sizeof(cl_int);
+    size_t query_batch = 1;
+    size_t max_query_length = 0;
+    uint64_t reference_length = 0;     // row scan: one reference; database search: all residues
+    size_t num_streams = 1;            // row scan: streams with their own row buffers
+    size_t num_resident_profiles = 1;  // row scan: chunk profiles alive besides the cached ones
+    bool cache_profiles = false;       // row scan: every chunk profile of the reference stays resident
+    size_t num_row_buffers = 6;        // row scan: f, f_prev, h, h_prev, h_hat, column_max
+    size_t num_profile_rows = 5;       // row scan: A, C, G, T, N substitution rows
+    size_t reduce_num_groups = 0;      // row scan: per-group max/index results
+    size_t num_checkpoint_rows = 0;    // row scan: host rows staged for a checkpoint
+    bool segmented = false;            // row scan: packed references, one segment each, no overlap
+    uint64_t longest_segment = 0;      // row scan, segmented: a chunk must hold at least this one
+    ScoringScheme scoring;             // row scan, wavefront: bounds the chunk overlap
+    size_t tile_rows = 64;             // wavefront: query rows per tile
+    size_t num_sequences = 0;          // database search
+    size_t lane_width = 64;            // database search
+    uint64_t packed_database_size = 0; // database search: bytes of the lane-packed database
+    uint64_t max_scratch_size = 0;     // database search: cap per scratch buffer, 0 for none
+};
+
+struct BufferPlan {
+    std::string name;
+    uint64_t bytes = 0; // each
+    size_t count = 0;
+};
+
+struct MemoryPlan {
+    EngineKind engine = EngineKind::kRowScan;
+    bool fits = false;
+
+    // Row scan, wavefront: the reference is processed in chunks of chunk_length residues, consecutive
+    // chunks sharing chunk_overlap residues so no alignment is cut at a boundary.
+    uint64_t chunk_length = 0;
+    uint64_t chunk_overlap = 0;
+    size_t num_chunks = 0;
+    size_t padded_row_size = 0; // row scan only
+    bool profiles_cached = false; // row scan: room for every chunk profile of the reference
+
+    // Database search: work items (sequences) per launch
+    size_t sequences_per_launch = 0;
+
+    std::vector<BufferPlan> device_buffers;
+    std::vector<BufferPlan> host_buffers;
+    uint64_t device_bytes = 0;
+    uint64_t host_bytes = 0;
+    uint64_t largest_allocation = 0;
+    uint64_t device_budget = 0;
+    uint64_t host_budget = 0;
+
+    uint64_t GetChunkBegin(size_t chunk) const { return chunk * (chunk_length - chunk_overlap); }
+};
+
+// Picks the largest chunk (row scan, wavefront) or launch (database search) whose exact byte count fits
+// both the device and host budgets, with no single buffer above device_max_mem_alloc_size.
+// fits is false when even the smallest useful configuration does not. A row scan that cannot keep
+// every chunk profile resident is planned again without, leaving profiles_cached false.
+MemoryPlan PlanMemory(const PlanRequest & request, const MemoryBudget & budget);
+
+void PrintMemoryPlan(const MemoryPlan & plan);
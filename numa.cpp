@@ -0,0 +1,256 @@
+#include "numa.h"
+
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+    // From linux/mempolicy.h, so there is no dependency on libnuma
+    const int kMpolPreferred = 1;
+    const int kMpolInterleave = 3;
+
+    const size_t kMaxCopyThreadsPerNode = 4;
+    const size_t kInterleaveCopyGrain = 16 * 1024 * 1024;
+
+    thread_local int pinned_node = -1;
+
+    std::vector<int> ParseCpuList(const std::string & list) {
+        // "0-3,8-11"
+        std::vector<int> cpus;
+        size_t k = 0;
+        while (k < list.size()) {
+            size_t end = list.find(',', k);
+            if (end == std::string::npos) {
+                end = list.size();
+            }
+            const std::string range = list.substr(k, end - k);
+            const size_t dash = range.find('-');
+            if (!range.empty() && range.find_first_not_of(" \n") != std::string::npos) {
+                const int first = std::stoi(range.substr(0, dash));
+                const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++cpu) {
+                    cpus.push_back(cpu);
+                }
+            }
+            k = end + 1;
+        }
+        return cpus;
+    }
+
+    NumaTopology ReadNumaTopology() {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            for (int cpu = 0; cpu < static_cast<int>(std::thread::hardware_concurrency()); ++cpu) {
+                CPU_SET(cpu, &allowed);
+            }
+        }
+
+        std::vector<int> node_ids;
+        if (DIR * dir = opendir("/sys/devices/system/node")) {
+            while (dirent * entry = readdir(dir)) {
+                if (std::strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+                    node_ids.push_back(std::atoi(entry->d_name + 4));
+                }
+            }
+            closedir(dir);
+        }
+        std::sort(node_ids.begin(), node_ids.end());
+
+        NumaTopology topology;
+        for (int node_id : node_ids) {
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(node_id) + "/cpulist");
+            std::string list;
+            std::getline(in, list);
+
+            std::vector<int> cpus;
+            for (int cpu : ParseCpuList(list)) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                    cpus.push_back(cpu);
+                }
+            }
+            // Memory-only nodes and nodes outside our cpuset have no threads to serve
+            if (!cpus.empty()) {
+                topology.node_ids.push_back(node_id);
+                topology.cpus.push_back(std::move(cpus));
+            }
+        }
+
+        if (topology.node_ids.empty()) {
+            topology.node_ids.push_back(0);
+            topology.cpus.emplace_back();
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    topology.cpus.back().push_back(cpu);
+                }
+            }
+        }
+
+        for (size_t node = 0; node < topology.cpus.size(); ++node) {
+            for (int cpu : topology.cpus[node]) {
+                if (cpu >= static_cast<int>(topology.cpu_nodes.size())) {
+                    topology.cpu_nodes.resize(cpu + 1, -1);
+                }
+                topology.cpu_nodes[cpu] = static_cast<int>(node);
+            }
+        }
+        return topology;
+    }
+
+    // Best effort: without NUMA support in the kernel the pages just stay where first touch puts them
+    void SetMemoryPolicy(void * address, size_t length, int mode, const std::vector<int> & node_ids) {
+        const size_t bits_per_word = 8 * sizeof(unsigned long);
+        const int max_node_id = *std::max_element(node_ids.begin(), node_ids.end());
+        std::vector<unsigned long> mask(static_cast<size_t>(max_node_id) / bits_per_word + 1, 0);
+        for (int node_id : node_ids) {
+            mask[node_id / bits_per_word] |= 1ul << (node_id % bits_per_word);
+        }
+#ifdef SYS_mbind
+        syscall(SYS_mbind, address, length, mode, mask.data(), mask.size() * bits_per_word + 1, 0);
+#endif
+    }
+
+    char * MapPages(size_t length) {
+        void * address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (address == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        return static_cast<char *>(address);
+    }
+}
+
+NumaPlacement ParseNumaPlacement(const std::string & name) {
+    if (name == "default") {
+        return NumaPlacement::kDefault;
+    } else if (name == "interleave") {
+        return NumaPlacement::kInterleave;
+    } else if (name == "replicate") {
+        return NumaPlacement::kReplicate;
+    }
+    throw std::runtime_error("Unknown NUMA placement " + name + ", expected default, interleave or replicate");
+}
+
+const char * GetNumaPlacementName(NumaPlacement placement) {
+    switch (placement) {
+        case NumaPlacement::kInterleave:
+            return "interleave";
+        case NumaPlacement::kReplicate:
+            return "replicate";
+        default:
+            return "default";
+    }
+}
+
+const NumaTopology & GetNumaTopology() {
+    static const NumaTopology topology = ReadNumaTopology();
+    return topology;
+}
+
+bool PinThreadToNode(size_t node) {
+    const NumaTopology & topology = GetNumaTopology();
+    if (node >= topology.GetNumNodes()) {
+        return false;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu : topology.cpus[node]) {
+        CPU_SET(cpu, &cpus);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        return false;
+    }
+
+    pinned_node = static_cast<int>(node);
+    return true;
+}
+
+size_t GetCurrentNumaNode() {
+    if (pinned_node >= 0) {
+        return static_cast<size_t>(pinned_node);
+    }
+
+    const NumaTopology & topology = GetNumaTopology();
+    const int cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < static_cast<int>(topology.cpu_nodes.size()) && topology.cpu_nodes[cpu] >= 0) {
+        return static_cast<size_t>(topology.cpu_nodes[cpu]);
+    }
+    return 0;
+}
+
+NumaReplicas::NumaReplicas(ThreadPool & pool, const std::string & sequence, NumaPlacement placement)
+    : placement_(placement), sequence_(sequence.data()), size_(sequence.size()), mapped_size_(0) {
+    if (placement_ == NumaPlacement::kDefault) {
+        return;
+    }
+
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    mapped_size_ = (std::max<size_t>(size_, 1) + page_size - 1) / page_size * page_size;
+    const NumaTopology & topology = GetNumaTopology();
+
+    if (placement_ == NumaPlacement::kInterleave) {
+        char * copy = MapPages(mapped_size_);
+        copies_.push_back(copy);
+        SetMemoryPolicy(copy, mapped_size_, kMpolInterleave, topology.node_ids);
+        pool.ParallelFor(0, size_, kInterleaveCopyGrain, [copy, this](size_t begin, size_t end) {
+            std::memcpy(copy + begin, sequence_ + begin, end - begin);
+        });
+        return;
+    }
+
+    // Every replica is written by threads of its own node, so first touch and the policy agree
+    try {
+        for (size_t node = 0; node < topology.GetNumNodes(); ++node) {
+            copies_.push_back(MapPages(mapped_size_));
+            SetMemoryPolicy(copies_.back(), mapped_size_, kMpolPreferred, { topology.node_ids[node] });
+        }
+    } catch (...) {
+        for (char * copy : copies_) {
+            munmap(copy, mapped_size_);
+        }
+        throw;
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t node = 0; node < topology.GetNumNodes(); ++node) {
+        const size_t num_threads = std::min(kMaxCopyThreadsPerNode, std::max<size_t>(topology.cpus[node].size(), 1));
+        const size_t slice = (size_ + num_threads - 1) / num_threads;
+        for (size_t k = 0; k < num_threads; ++k) {
+            const size_t begin = std::min(k * slice, size_);
+            const size_t end = std::min(begin + slice, size_);
+            char * copy = copies_[node];
+            threads.emplace_back([this, node, copy, begin, end]() {
+                PinThreadToNode(node);
+                std::memcpy(copy + begin, sequence_ + begin, end - begin);
+            });
+        }
+    }
+    for (auto & thread : threads) {
+        thread.join();
+    }
+}
+
+NumaReplicas::~NumaReplicas() {
+    for (char * copy : copies_) {
+        munmap(copy, mapped_size_);
+    }
+}
+
+const char * NumaReplicas::Get() const {
+    if (placement_ == NumaPlacement::kDefault) {
+        return sequence_;
+    } else if (placement_ == NumaPlacement::kInterleave) {
+        return copies_.front();
+    }
+    return copies_[std::min(GetCurrentNumaNode(), copies_.size() - 1)];
+}
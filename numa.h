@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+enum class NumaPlacement {
+    kDefault,    // wherever the thread that touches a page first happens to run
+    kInterleave, // pages spread round-robin over all nodes, the baseline to compare against
+    kReplicate,  // a copy per node, each touched first by threads on that node
+};
+
+NumaPlacement ParseNumaPlacement(const std::string & name);
+const char * GetNumaPlacementName(NumaPlacement placement);
+
+// Nodes with CPUs this process may run on, from /sys/devices/system/node. A machine without
+// NUMA (or without sysfs) is one node holding every allowed CPU.
+struct NumaTopology {
+    std::vector<int> node_ids;            // kernel node number of every node below
+    std::vector<std::vector<int>> cpus;   // allowed CPUs per node
+    std::vector<int> cpu_nodes;           // node index per CPU number, -1 if not allowed
+
+    size_t GetNumNodes() const { return node_ids.size(); }
+};
+
+const NumaTopology & GetNumaTopology();
+
+// Restricts the calling thread to the CPUs of node (an index into the topology). Returns false
+// if the affinity could not be set, which leaves the thread where it was.
+bool PinThreadToNode(size_t node);
+
+// Node the calling thread is pinned to, or else the node of the CPU it is running on.
+size_t GetCurrentNumaNode();
+
+// A read-only sequence placed for the threads that scan it. With kReplicate every node gets its
+// own copy, written by threads pinned to that node so its pages are local to them, and Get hands
+// each caller the copy of the node it runs on. With kInterleave there is one copy with its pages
+// spread over the nodes. kDefault does not copy at all. Replicas cost a copy of the sequence per
+// node, so they are for sequences that are read many times, such as a reference.
+class NumaReplicas {
+public:
+    NumaReplicas(ThreadPool & pool, const std::string & sequence, NumaPlacement placement);
+    ~NumaReplicas();
+
+    NumaReplicas(const NumaReplicas & other) = delete;
+    NumaReplicas& operator=(const NumaReplicas & other) = delete;
+
+    const char * Get() const;
+    size_t size() const { return size_; }
+    NumaPlacement GetPlacement() const { return placement_; }
+
+private:
+    NumaPlacement placement_;
+    const char * sequence_;
+    size_t size_;
+    size_t mapped_size_;
+    std::vector<char *> copies_; // one per node, or a single interleaved one
+};
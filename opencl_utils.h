@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#ifdef __APPLE__
+#include "OpenCL/opencl.h"
+#else
+#include "CL/cl.h"
+#endif
+
+#ifndef SW_KERNELS_FILENAME
+#define SW_KERNELS_FILENAME "/Users/hocheung20/SmithWatermanOpenCL/src/SW_kernels.cl"
+#endif
+
+namespace cl {
+    struct DeviceInfo {
+        cl_uint device_address_bits;
+        cl_bool device_available;
+        cl_bool device_compiler_available;
+        cl_device_fp_config device_double_fp_config;
+        cl_bool device_endian_little;
+        cl_bool device_error_correction_support;
+        cl_device_exec_capabilities device_execution_capabilities;
+        std::string device_extensions;
+        cl_ulong device_global_mem_cache_size;
+        cl_device_mem_cache_type device_global_mem_cache_type;
+        cl_uint device_global_mem_cacheline_size;
+        cl_ulong device_global_mem_size;
+        cl_device_fp_config device_half_fp_config;
+        cl_bool device_image_support;
+        size_t device_image2d_max_height;
+        size_t device_image2d_max_width;
+        size_t device_image3d_max_depth;
+        size_t device_image3d_max_height;
+        size_t device_image3d_max_width;
+        cl_ulong device_local_mem_size;
+        cl_device_local_mem_type device_local_mem_type;
+        cl_uint device_max_clock_frequency;
+        cl_uint device_max_compute_units;
+        cl_uint device_max_constant_args;
+        cl_ulong device_max_constant_buffer_size;
+        cl_ulong device_max_mem_alloc_size;
+        size_t device_max_parameter_size;
+        cl_uint device_max_read_image_args;
+        cl_uint device_max_samplers;
+        size_t device_max_work_group_size;
+        cl_uint device_max_work_item_dimensions;
+        std::vector<size_t> device_max_work_item_sizes;
+        cl_uint device_max_write_image_args;
+        cl_uint device_mem_base_addr_align;
+        cl_uint device_min_data_type_align_size;
+        std::string device_name;
+        cl_platform_id device_platform;
+        cl_uint device_preferred_vector_width_char;
+        cl_uint device_preferred_vector_width_short;
+        cl_uint device_preferred_vector_width_int;
+        cl_uint device_preferred_vector_width_long;
+        cl_uint device_preferred_vector_width_float;
+        cl_uint device_preferred_vector_width_double;
+        std::string device_profile;
+        size_t device_profiling_timer_resolution; // in nanoseconds
+        cl_command_queue_properties device_queue_properties;
+        cl_device_fp_config device_single_fp_config;
+        cl_device_type device_type;
+        std::string device_vendor;
+        cl_uint device_vendor_id;
+        std::string device_version;
+        std::string driver_version;
+    };
+}
+
+const char *getErrorString(cl_int error);
+void CheckError(cl_int error);
+
+std::vector<char> ReadKernelFromFilename(const std::string & filename);
+
+std::string GetPlatformName(cl_platform_id id);
+std::string GetDeviceName(cl_device_id id);
+
+cl::DeviceInfo GetDeviceInfo(cl_device_id device_id);
+void PrintDeviceInfo(cl_device_id device_id);
+
+// Rounds up to the next power of 2, the length the upsweep/downsweep scan works on.
+size_t GetPaddedRowSize(size_t input_row_size);
+
+// Reads, creates and builds the program, dumping the build log for device_id on failure.
+// options is passed straight through to clBuildProgram (e.g. -D overrides from GetBuildOptions).
+cl_program BuildProgramFromFile(cl_context context, cl_device_id device_id, const std::string & filename, const std::string & options);
@@ -0,0 +1,273 @@
+#include "result_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    const char kDiskMagic[8] = { 'S', 'W', 'R', 'C', 'A', 'C', '0', '1' };
+    const size_t kDiskFlushSize = 1 << 20;
+
+    // 5 x uint64 key, 4 x int32 scoring, int32 score, uint64 reference_end
+    const size_t kRecordSize = 5 * sizeof(uint64_t) + 4 * sizeof(int32_t) + sizeof(int32_t) + sizeof(uint64_t);
+
+    template <class T>
+    void Append(std::vector<char> & buffer, const T & value) {
+        const char * bytes = reinterpret_cast<const char *>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <class T>
+    T Take(const char * & in) {
+        T value;
+        std::memcpy(&value, in, sizeof(T));
+        in += sizeof(T);
+        return value;
+    }
+
+    void AppendRecord(std::vector<char> & buffer, const ResultCacheKey & key, const AlignmentResult & result) {
+        Append(buffer, key.query_hash);
+        Append(buffer, key.query_length);
+        Append(buffer, key.reference_id);
+        Append(buffer, key.reference_begin);
+        Append(buffer, key.reference_end);
+        Append(buffer, key.scoring.match);
+        Append(buffer, key.scoring.mismatch);
+        Append(buffer, key.scoring.gap_start_penalty);
+        Append(buffer, key.scoring.gap_extend_penalty);
+        Append(buffer, result.score);
+        Append(buffer, static_cast<uint64_t>(result.reference_end));
+    }
+
+    void ParseRecord(const char * in, ResultCacheKey & key, AlignmentResult & result) {
+        key.query_hash = Take<uint64_t>(in);
+        key.query_length = Take<uint64_t>(in);
+        key.reference_id = Take<uint64_t>(in);
+        key.reference_begin = Take<uint64_t>(in);
+        key.reference_end = Take<uint64_t>(in);
+        key.scoring.match = Take<int32_t>(in);
+        key.scoring.mismatch = Take<int32_t>(in);
+        key.scoring.gap_start_penalty = Take<int32_t>(in);
+        key.scoring.gap_extend_penalty = Take<int32_t>(in);
+        result.score = Take<int32_t>(in);
+        result.reference_end = static_cast<size_t>(Take<uint64_t>(in));
+    }
+
+    bool WriteAllAt(int fd, const char * data, size_t size, uint64_t offset) {
+        while (size > 0) {
+            ssize_t written = pwrite(fd, data, size, static_cast<off_t>(offset));
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            data += written;
+            size -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    bool ReadAllAt(int fd, char * data, size_t size, uint64_t offset) {
+        while (size > 0) {
+            ssize_t received = pread(fd, data, size, static_cast<off_t>(offset));
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                return false;
+            }
+            data += received;
+            size -= received;
+            offset += received;
+        }
+        return true;
+    }
+}
+
+bool ResultCacheKey::operator==(const ResultCacheKey & other) const {
+    return query_hash == other.query_hash && query_length == other.query_length && reference_id == other.reference_id
+           && reference_begin == other.reference_begin && reference_end == other.reference_end
+           && scoring.match == other.scoring.match && scoring.mismatch == other.scoring.mismatch
+           && scoring.gap_start_penalty == other.scoring.gap_start_penalty && scoring.gap_extend_penalty == other.scoring.gap_extend_penalty;
+}
+
+size_t ResultCacheKeyHash::operator()(const ResultCacheKey & key) const {
+    uint64_t hash = key.query_hash;
+    for (uint64_t value : { key.query_length, key.reference_id, key.reference_begin, key.reference_end,
+                            static_cast<uint64_t>(static_cast<uint32_t>(key.scoring.match)) << 32 | static_cast<uint32_t>(key.scoring.mismatch),
+                            static_cast<uint64_t>(static_cast<uint32_t>(key.scoring.gap_start_penalty)) << 32 | static_cast<uint32_t>(key.scoring.gap_extend_penalty) }) {
+        hash = (hash ^ value) * 1099511628211ull;
+        hash ^= hash >> 29;
+    }
+    return static_cast<size_t>(hash);
+}
+
+double ResultCacheStats::GetHitRate() const {
+    const uint64_t lookups = memory_hits + disk_hits + misses;
+    return lookups > 0 ? static_cast<double>(memory_hits + disk_hits) / lookups : 0.0;
+}
+
+ResultCache::ResultCache(size_t capacity, const std::string & disk_path) : capacity_(std::max<size_t>(capacity, 1)), disk_fd_(-1), disk_size_(0) {
+    if (disk_path.empty()) {
+        return;
+    }
+
+    disk_fd_ = open(disk_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (disk_fd_ < 0) {
+        throw std::runtime_error("Could not open result cache " + disk_path + ": " + std::strerror(errno));
+    }
+
+    struct stat file_stat;
+    fstat(disk_fd_, &file_stat);
+    const uint64_t file_size = static_cast<uint64_t>(file_stat.st_size);
+
+    if (file_size == 0) {
+        if (!WriteAllAt(disk_fd_, kDiskMagic, sizeof(kDiskMagic), 0)) {
+            throw std::runtime_error("Could not write result cache " + disk_path);
+        }
+        disk_size_ = sizeof(kDiskMagic);
+        return;
+    }
+
+    std::vector<char> contents(static_cast<size_t>(file_size));
+    if (!ReadAllAt(disk_fd_, contents.data(), contents.size(), 0) || file_size < sizeof(kDiskMagic)
+        || std::memcmp(contents.data(), kDiskMagic, sizeof(kDiskMagic)) != 0) {
+        close(disk_fd_);
+        throw std::runtime_error(disk_path + " is not a result cache");
+    }
+
+    // A record cut short by a crash is dropped, so appends stay aligned
+    const uint64_t num_records = (file_size - sizeof(kDiskMagic)) / kRecordSize;
+    disk_size_ = sizeof(kDiskMagic) + num_records * kRecordSize;
+    if (disk_size_ != file_size && ftruncate(disk_fd_, static_cast<off_t>(disk_size_)) != 0) {
+        std::cerr << "Could not truncate " << disk_path << ": " << std::strerror(errno) << std::endl;
+    }
+
+    for (uint64_t k = 0; k < num_records; ++k) {
+        const uint64_t offset = sizeof(kDiskMagic) + k * kRecordSize;
+        ResultCacheKey key;
+        AlignmentResult result;
+        ParseRecord(contents.data() + offset, key, result);
+        disk_index_[ResultCacheKeyHash()(key)] = offset;
+    }
+}
+
+ResultCache::~ResultCache() {
+    if (disk_fd_ >= 0) {
+        FlushDisk();
+        close(disk_fd_);
+    }
+}
+
+bool ResultCache::Lookup(const ResultCacheKey & key, AlignmentResult & result) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        entries_.splice(entries_.begin(), entries_, it->second);
+        result = it->second->second;
+        ++stats_.memory_hits;
+        return true;
+    }
+
+    auto disk_it = disk_index_.find(ResultCacheKeyHash()(key));
+    Entry entry;
+    if (disk_it != disk_index_.end() && ReadDiskRecord(disk_it->second, entry) && entry.first == key) {
+        InsertInMemory(key, entry.second);
+        result = entry.second;
+        ++stats_.disk_hits;
+        return true;
+    }
+
+    ++stats_.misses;
+    return false;
+}
+
+void ResultCache::Insert(const ResultCacheKey & key, const AlignmentResult & result) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    InsertInMemory(key, result);
+
+    if (disk_fd_ < 0) {
+        return;
+    }
+
+    const uint64_t digest = ResultCacheKeyHash()(key);
+    Entry entry;
+    auto disk_it = disk_index_.find(digest);
+    if (disk_it != disk_index_.end() && ReadDiskRecord(disk_it->second, entry) && entry.first == key) {
+        return;
+    }
+
+    disk_index_[digest] = disk_size_ + disk_pending_.size();
+    AppendRecord(disk_pending_, key, result);
+    if (disk_pending_.size() >= kDiskFlushSize) {
+        FlushDisk();
+    }
+}
+
+void ResultCache::CountDuplicate() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.duplicates;
+}
+
+ResultCacheStats ResultCache::GetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ResultCacheStats stats = stats_;
+    stats.memory_entries = entries_.size();
+    stats.disk_entries = disk_index_.size();
+    return stats;
+}
+
+void ResultCache::InsertInMemory(const ResultCacheKey & key, const AlignmentResult & result) {
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        it->second->second = result;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return;
+    }
+
+    entries_.emplace_front(key, result);
+    index_[key] = entries_.begin();
+    while (entries_.size() > capacity_) {
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+    }
+}
+
+bool ResultCache::ReadDiskRecord(uint64_t offset, Entry & entry) {
+    char record[kRecordSize];
+    if (offset >= disk_size_) {
+        // Still in the write buffer
+        std::memcpy(record, disk_pending_.data() + (offset - disk_size_), kRecordSize);
+    } else if (!ReadAllAt(disk_fd_, record, kRecordSize, offset)) {
+        return false;
+    }
+    ParseRecord(record, entry.first, entry.second);
+    return true;
+}
+
+void ResultCache::FlushDisk() {
+    if (disk_pending_.empty()) {
+        return;
+    }
+
+    if (WriteAllAt(disk_fd_, disk_pending_.data(), disk_pending_.size(), disk_size_)) {
+        disk_size_ += disk_pending_.size();
+    } else {
+        // The records are lost, not the cache: drop them from the index
+        std::cerr << "Could not write the result cache: " << std::strerror(errno) << std::endl;
+        for (auto it = disk_index_.begin(); it != disk_index_.end();) {
+            it = it->second >= disk_size_ ? disk_index_.erase(it) : std::next(it);
+        }
+    }
+    disk_pending_.clear();
+}
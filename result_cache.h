@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "alignment_result.h"
+#include "scoring.h"
+
+// One alignment: the query by content, the reference by ID and range, and the scoring.
+struct ResultCacheKey {
+    uint64_t query_hash = 0;
+    uint64_t query_length = 0;
+    uint64_t reference_id = 0;
+    uint64_t reference_begin = 0;
+    uint64_t reference_end = 0;
+    ScoringScheme scoring;
+
+    bool operator==(const ResultCacheKey & other) const;
+};
+
+struct ResultCacheKeyHash {
+    size_t operator()(const ResultCacheKey & key) const;
+};
+
+struct ResultCacheStats {
+    uint64_t memory_hits = 0;
+    uint64_t disk_hits = 0;
+    uint64_t misses = 0;
+    uint64_t duplicates = 0; // repeated within one batch, computed once
+    size_t memory_entries = 0;
+    size_t disk_entries = 0;
+
+    double GetHitRate() const;
+};
+
+// Alignment results by key: an LRU of capacity entries in memory, and optionally an append-only
+// file behind it that outlives the process. Only a key digest and file offset per disk entry
+// stay in memory; the record is read back and checked on a hit. Thread safe.
+class ResultCache {
+public:
+    explicit ResultCache(size_t capacity, const std::string & disk_path = "");
+    ~ResultCache();
+
+    ResultCache(const ResultCache & other) = delete;
+    ResultCache& operator=(const ResultCache & other) = delete;
+
+    bool Lookup(const ResultCacheKey & key, AlignmentResult & result);
+    void Insert(const ResultCacheKey & key, const AlignmentResult & result);
+    void CountDuplicate();
+
+    ResultCacheStats GetStats();
+
+private:
+    using Entry = std::pair<ResultCacheKey, AlignmentResult>;
+
+    void InsertInMemory(const ResultCacheKey & key, const AlignmentResult & result);
+    bool ReadDiskRecord(uint64_t offset, Entry & entry);
+    void FlushDisk();
+
+    size_t capacity_;
+
+    std::mutex mutex_;
+    std::list<Entry> entries_; // most recently used first
+    std::unordered_map<ResultCacheKey, std::list<Entry>::iterator, ResultCacheKeyHash> index_;
+
+    int disk_fd_;
+    uint64_t disk_size_;                              // bytes on disk, whole records only
+    std::vector<char> disk_pending_;                  // appended after disk_size_ on the next flush
+    std::unordered_map<uint64_t, uint64_t> disk_index_; // key digest to record offset
+
+    ResultCacheStats stats_;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Linear match/mismatch scores with affine gaps. A gap of length k costs
+// gap_start_penalty + k * gap_extend_penalty, the same recurrence the row kernels use.
+struct ScoringScheme {
+    int32_t match = 5;
+    int32_t mismatch = -3;
+    int32_t gap_start_penalty = -8;
+    int32_t gap_extend_penalty = -1;
+};
+
+// Only equal A, C, G or T match; anything else, N included, scores as a mismatch against every
+// residue. This is what the score profiles encode, and substitution_score in SW_kernels.cl.
+inline int32_t GetSubstitutionScore(char a, char b, const ScoringScheme & scoring) {
+    return a == b && (a == 'A' || a == 'C' || a == 'G' || a == 'T') ? scoring.match : scoring.mismatch;
+}
+
+// The gap penalties are compile time constants in SW_kernels.cl, so a scheme is applied by
+// building the program with these -D overrides.
+inline std::string GetBuildOptions(const ScoringScheme & scoring) {
+    return "-DGAP_START_PENALTY=" + std::to_string(scoring.gap_start_penalty) +
+           " -DGAP_EXTEND_PENALTY=" + std::to_string(scoring.gap_extend_penalty);
+}
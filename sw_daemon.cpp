@@ -0,0 +1,479 @@
+#include "sw_daemon.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace daemon_protocol;
+
+namespace {
+    const size_t kLatencyWindow = 100000;
+    const int kAcceptPollMilliseconds = 200;
+
+#ifdef MSG_NOSIGNAL
+    const int kSendFlags = MSG_NOSIGNAL;
+#else
+    const int kSendFlags = 0;
+#endif
+
+    bool ReadAll(int fd, void * data, size_t size) {
+        char * out = static_cast<char *>(data);
+        while (size > 0) {
+            ssize_t received = recv(fd, out, size, 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                return false;
+            }
+            out += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    bool WriteAll(int fd, const void * data, size_t size) {
+        const char * in = static_cast<const char *>(data);
+        while (size > 0) {
+            ssize_t sent = send(fd, in, size, kSendFlags);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                return false;
+            }
+            in += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    template <class T>
+    void Append(std::vector<char> & buffer, const T & value) {
+        const char * bytes = reinterpret_cast<const char *>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    sockaddr_un GetSocketAddress(const std::string & socket_path) {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path too long: " + socket_path);
+        }
+        std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+        return address;
+    }
+
+    int CreateSocket() {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("socket() failed: ") + std::strerror(errno));
+        }
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+        return fd;
+    }
+
+    int Connect(const std::string & socket_path) {
+        sockaddr_un address = GetSocketAddress(socket_path);
+        int fd = CreateSocket();
+        if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+            close(fd);
+            throw std::runtime_error("Unable to connect to " + socket_path + ": " + std::strerror(errno));
+        }
+        return fd;
+    }
+
+    uint32_t NextRequestId() {
+        static std::atomic<uint32_t> request_id{0};
+        return ++request_id;
+    }
+}
+
+SmithWatermanDaemon::Connection::~Connection() {
+    close(fd);
+}
+
+SmithWatermanDaemon::SmithWatermanDaemon(SmithWatermanEngine & engine, std::vector<FastaRecord> references, const std::string & socket_path,
+                                         std::chrono::microseconds batch_window, size_t max_batch_queries)
+    : engine_(engine), socket_path_(socket_path), batch_window_(batch_window), max_batch_queries_(max_batch_queries), listen_fd_(-1) {
+    // The profiles are built and uploaded up front, so the first real request finds them resident
+    std::vector<std::future<std::vector<AlignmentResult>>> warmup;
+    for (FastaRecord & record : references) {
+        references_.push_back(std::make_shared<const std::string>(std::move(record.sequence)));
+        warmup.push_back(engine_.WarmReference(references_.back()));
+    }
+    for (auto & job : warmup) {
+        job.get();
+    }
+}
+
+SmithWatermanDaemon::~SmithWatermanDaemon() {
+    if (listen_fd_ >= 0) {
+        close(listen_fd_);
+        unlink(socket_path_.c_str());
+    }
+}
+
+void SmithWatermanDaemon::Serve() {
+    sockaddr_un address = GetSocketAddress(socket_path_);
+    listen_fd_ = CreateSocket();
+    unlink(socket_path_.c_str());
+    if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listen_fd_, 64) != 0) {
+        throw std::runtime_error("Unable to listen on " + socket_path_ + ": " + std::strerror(errno));
+    }
+
+    std::cout << "Listening on " << socket_path_ << " with " << references_.size() << " resident reference(s)" << std::endl;
+
+    std::thread batch_thread(&SmithWatermanDaemon::BatchLoop, this);
+    std::thread response_thread(&SmithWatermanDaemon::ResponseLoop, this);
+
+    while (!stop_) {
+        pollfd listen_poll { listen_fd_, POLLIN, 0 };
+        if (poll(&listen_poll, 1, kAcceptPollMilliseconds) <= 0) {
+            continue;
+        }
+
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+
+        auto connection = std::make_shared<Connection>(fd);
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        connections_.erase(std::remove_if(connections_.begin(), connections_.end(), [](const std::weak_ptr<Connection> & weak_connection) {
+            return weak_connection.expired();
+        }), connections_.end());
+        connections_.push_back(connection);
+        ++active_connections_;
+
+        std::thread(&SmithWatermanDaemon::HandleConnection, this, connection).detach();
+    }
+
+    // Unblock readers, then let the batcher and responder drain whatever was already accepted
+    {
+        std::unique_lock<std::mutex> lock(connections_mutex_);
+        for (auto & weak_connection : connections_) {
+            if (auto connection = weak_connection.lock()) {
+                shutdown(connection->fd, SHUT_RD);
+            }
+        }
+        connections_cv_.wait(lock, [this]() { return active_connections_ == 0; });
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        pending_cv_.notify_all();
+    }
+    batch_thread.join();
+    response_thread.join();
+
+    std::cout << FormatStats() << std::endl;
+}
+
+void SmithWatermanDaemon::HandleConnection(std::shared_ptr<Connection> connection) {
+    Header header;
+    while (ReadAll(connection->fd, &header, sizeof(header))) {
+        if (header.magic != kRequestMagic) {
+            break;
+        }
+
+        if (header.type == kShutdown) {
+            stop_ = true;
+            break;
+        }
+
+        if (header.type == kStats) {
+            std::string stats = FormatStats();
+            Header response { kResponseMagic, kOk, header.request_id, 0, static_cast<uint32_t>(stats.size()) };
+            std::lock_guard<std::mutex> lock(connection->write_mutex);
+            WriteAll(connection->fd, &response, sizeof(response));
+            WriteAll(connection->fd, stats.data(), stats.size());
+            continue;
+        }
+
+        if (header.type != kAlign || header.count > kMaxQueriesPerRequest) {
+            SendError(*connection, header.request_id, kError);
+            break;
+        }
+
+        Request request;
+        request.connection = connection;
+        request.request_id = header.request_id;
+        request.reference_index = header.reference_index;
+        request.queries.resize(header.count);
+
+        bool ok = true;
+        for (auto & query : request.queries) {
+            uint32_t length = 0;
+            ok = ReadAll(connection->fd, &length, sizeof(length)) && length <= kMaxQueryLength;
+            if (!ok) {
+                break;
+            }
+            query.resize(length);
+            ok = ReadAll(connection->fd, &query[0], length);
+            if (!ok) {
+                break;
+            }
+        }
+        if (!ok) {
+            break;
+        }
+
+        request.received = std::chrono::steady_clock::now();
+
+        if (header.reference_index >= references_.size()) {
+            SendError(*connection, header.request_id, kBadReference);
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            pending_queries_ += request.queries.size();
+            pending_.push_back(std::move(request));
+        }
+        pending_cv_.notify_all();
+    }
+
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    --active_connections_;
+    connections_cv_.notify_all();
+}
+
+void SmithWatermanDaemon::BatchLoop() {
+    while (true) {
+        std::deque<Request> requests;
+        {
+            std::unique_lock<std::mutex> lock(pending_mutex_);
+            pending_cv_.wait(lock, [this]() { return stop_ || !pending_.empty(); });
+            if (pending_.empty()) {
+                break;
+            }
+
+            // Give concurrent clients a moment to join the batch
+            const auto deadline = pending_.front().received + batch_window_;
+            pending_cv_.wait_until(lock, deadline, [this]() { return stop_ || pending_queries_ >= max_batch_queries_; });
+
+            requests.swap(pending_);
+            pending_queries_ = 0;
+        }
+
+        std::map<uint32_t, Batch> batches;
+        for (auto & request : requests) {
+            batches[request.reference_index].requests.push_back(std::move(request));
+        }
+
+        for (auto & entry : batches) {
+            Batch & batch = entry.second;
+            std::vector<std::string> queries;
+            for (auto & request : batch.requests) {
+                queries.insert(queries.end(), request.queries.begin(), request.queries.end());
+            }
+            batch.results = engine_.Submit(std::move(queries), references_[entry.first]);
+
+            std::lock_guard<std::mutex> lock(batches_mutex_);
+            batches_.push_back(std::move(batch));
+            ++num_batches_;
+        }
+        batches_cv_.notify_all();
+    }
+
+    std::lock_guard<std::mutex> lock(batches_mutex_);
+    batching_done_ = true;
+    batches_cv_.notify_all();
+}
+
+void SmithWatermanDaemon::ResponseLoop() {
+    while (true) {
+        Batch batch;
+        {
+            std::unique_lock<std::mutex> lock(batches_mutex_);
+            batches_cv_.wait(lock, [this]() { return batching_done_ || !batches_.empty(); });
+            if (batches_.empty()) {
+                return;
+            }
+            batch = std::move(batches_.front());
+            batches_.pop_front();
+        }
+
+        try {
+            std::vector<AlignmentResult> results = batch.results.get();
+            size_t offset = 0;
+            for (auto & request : batch.requests) {
+                SendResults(request, results.data() + offset);
+                offset += request.queries.size();
+            }
+        } catch (const std::exception & e) {
+            std::cerr << "Batch failed: " << e.what() << std::endl;
+            for (auto & request : batch.requests) {
+                SendError(*request.connection, request.request_id, kError);
+            }
+        }
+    }
+}
+
+void SmithWatermanDaemon::SendResults(Request & request, const AlignmentResult * results) {
+    std::vector<char> buffer;
+    buffer.reserve(sizeof(Header) + request.queries.size() * (sizeof(int32_t) + sizeof(uint64_t)));
+    Append(buffer, Header { kResponseMagic, kOk, request.request_id, request.reference_index, static_cast<uint32_t>(request.queries.size()) });
+    for (size_t k = 0; k < request.queries.size(); ++k) {
+        Append(buffer, static_cast<int32_t>(results[k].score));
+        Append(buffer, static_cast<uint64_t>(results[k].reference_end));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(request.connection->write_mutex);
+        WriteAll(request.connection->fd, buffer.data(), buffer.size());
+    }
+
+    RecordLatency(request.received);
+}
+
+void SmithWatermanDaemon::SendError(Connection & connection, uint32_t request_id, uint32_t status) {
+    Header response { kResponseMagic, status, request_id, 0, 0 };
+    std::lock_guard<std::mutex> lock(connection.write_mutex);
+    WriteAll(connection.fd, &response, sizeof(response));
+}
+
+void SmithWatermanDaemon::RecordLatency(std::chrono::steady_clock::time_point received) {
+    const double latency_us = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - received).count() / 1000.0;
+
+    std::lock_guard<std::mutex> lock(latency_mutex_);
+    if (latencies_us_.size() < kLatencyWindow) {
+        latencies_us_.push_back(latency_us);
+    } else {
+        latencies_us_[latency_cursor_] = latency_us;
+        latency_cursor_ = (latency_cursor_ + 1) % kLatencyWindow;
+    }
+    ++num_requests_;
+}
+
+LatencyStats SmithWatermanDaemon::GetLatencyStats() {
+    std::vector<double> latencies;
+    {
+        std::lock_guard<std::mutex> lock(latency_mutex_);
+        latencies = latencies_us_;
+    }
+
+    LatencyStats stats;
+    stats.count = latencies.size();
+    if (latencies.empty()) {
+        return stats;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    stats.p50_us = percentile(0.50);
+    stats.p90_us = percentile(0.90);
+    stats.p99_us = percentile(0.99);
+    stats.max_us = latencies.back();
+
+    return stats;
+}
+
+std::string SmithWatermanDaemon::FormatStats() {
+    LatencyStats stats = GetLatencyStats();
+
+    size_t num_requests = 0;
+    size_t num_batches = 0;
+    {
+        std::lock_guard<std::mutex> lock(latency_mutex_);
+        num_requests = num_requests_;
+    }
+    {
+        std::lock_guard<std::mutex> lock(batches_mutex_);
+        num_batches = num_batches_;
+    }
+
+    std::ostringstream out;
+    out << "Requests: " << num_requests << " in " << num_batches << " batch(es), latency over last " << stats.count << " (us): "
+        << "p50 " << stats.p50_us << ", p90 " << stats.p90_us << ", p99 " << stats.p99_us << ", max " << stats.max_us;
+
+    const SmithWatermanEngineStats engine_stats = engine_.GetStats();
+    out << "; profiles built: " << engine_stats.profiles_built;
+
+    const ResultCacheStats & cache = engine_stats.cache;
+    if (cache.memory_hits + cache.disk_hits + cache.misses > 0) {
+        out << "; result cache: " << cache.memory_hits << " memory hit(s), " << cache.disk_hits << " disk hit(s), " << cache.misses << " miss(es), "
+            << cache.duplicates << " repeat(s) within a batch, hit rate " << 100.0 * cache.GetHitRate() << "%";
+    }
+    return out.str();
+}
+
+std::vector<AlignmentResult> DaemonAlign(const std::string & socket_path, uint32_t reference_index, const std::vector<std::string> & queries) {
+    int fd = Connect(socket_path);
+
+    std::vector<char> buffer;
+    Append(buffer, Header { kRequestMagic, kAlign, NextRequestId(), reference_index, static_cast<uint32_t>(queries.size()) });
+    for (const auto & query : queries) {
+        Append(buffer, static_cast<uint32_t>(query.size()));
+        buffer.insert(buffer.end(), query.begin(), query.end());
+    }
+
+    Header response;
+    if (!WriteAll(fd, buffer.data(), buffer.size()) || !ReadAll(fd, &response, sizeof(response)) || response.magic != kResponseMagic) {
+        close(fd);
+        throw std::runtime_error("Lost connection to " + socket_path);
+    }
+
+    if (response.type != kOk) {
+        close(fd);
+        throw std::runtime_error(response.type == kBadReference ? "Unknown reference index" : "Alignment request failed");
+    }
+
+    std::vector<AlignmentResult> results(response.count);
+    for (auto & result : results) {
+        int32_t score = 0;
+        uint64_t reference_end = 0;
+        if (!ReadAll(fd, &score, sizeof(score)) || !ReadAll(fd, &reference_end, sizeof(reference_end))) {
+            close(fd);
+            throw std::runtime_error("Lost connection to " + socket_path);
+        }
+        result.score = score;
+        result.reference_end = static_cast<size_t>(reference_end);
+    }
+
+    close(fd);
+    return results;
+}
+
+std::string DaemonStats(const std::string & socket_path) {
+    int fd = Connect(socket_path);
+
+    Header request { kRequestMagic, kStats, NextRequestId(), 0, 0 };
+    Header response;
+    std::string stats;
+    bool ok = WriteAll(fd, &request, sizeof(request)) && ReadAll(fd, &response, sizeof(response)) && response.magic == kResponseMagic;
+    if (ok) {
+        stats.resize(response.count);
+        ok = ReadAll(fd, &stats[0], stats.size());
+    }
+
+    close(fd);
+    if (!ok) {
+        throw std::runtime_error("Lost connection to " + socket_path);
+    }
+    return stats;
+}
+
+void DaemonShutdown(const std::string & socket_path) {
+    int fd = Connect(socket_path);
+
+    Header request { kRequestMagic, kShutdown, NextRequestId(), 0, 0 };
+    WriteAll(fd, &request, sizeof(request));
+    close(fd);
+}
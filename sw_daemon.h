@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "alignment_result.h"
+#include "fasta.h"
+#include "sw_engine.h"
+
+// Wire format, native byte order (the socket is local). Every message starts with a header:
+//   uint32 magic, uint32 type, uint32 request_id, uint32 reference_index, uint32 count
+// kAlign requests carry count queries, each as uint32 length + residues. The kAlign response
+// carries count results, each as int32 score + uint64 reference_end, in query order. kStats
+// responses carry count bytes of text. kShutdown has no payload and no response.
+namespace daemon_protocol {
+    const uint32_t kRequestMagic = 0x51525753;  // "SWRQ"
+    const uint32_t kResponseMagic = 0x53525753; // "SWRS"
+
+    enum MessageType : uint32_t {
+        kAlign = 1,
+        kStats = 2,
+        kShutdown = 3,
+    };
+
+    enum Status : uint32_t {
+        kOk = 0,
+        kBadReference = 1,
+        kError = 2,
+    };
+
+    struct Header {
+        uint32_t magic;
+        uint32_t type;      // MessageType on requests, Status on responses
+        uint32_t request_id;
+        uint32_t reference_index;
+        uint32_t count;
+    };
+
+    const uint32_t kMaxQueriesPerRequest = 1 << 20;
+    const uint32_t kMaxQueryLength = 1 << 24;
+}
+
+struct LatencyStats {
+    size_t count = 0;
+    double p50_us = 0.0;
+    double p90_us = 0.0;
+    double p99_us = 0.0;
+    double max_us = 0.0;
+};
+
+// Keeps an engine (context, compiled kernels) and a set of references resident and serves
+// alignment requests over a Unix domain socket. Requests that arrive within batch_window of
+// each other are merged into one engine job per reference.
+class SmithWatermanDaemon {
+public:
+    SmithWatermanDaemon(SmithWatermanEngine & engine, std::vector<FastaRecord> references, const std::string & socket_path,
+                        std::chrono::microseconds batch_window = std::chrono::microseconds(1000), size_t max_batch_queries = 4096);
+    ~SmithWatermanDaemon();
+
+    SmithWatermanDaemon(const SmithWatermanDaemon & other) = delete;
+    SmithWatermanDaemon& operator=(const SmithWatermanDaemon & other) = delete;
+
+    // Blocks until a kShutdown request arrives.
+    void Serve();
+
+    LatencyStats GetLatencyStats();
+
+private:
+    struct Connection {
+        explicit Connection(int fd) : fd(fd) {}
+        ~Connection();
+
+        int fd;
+        std::mutex write_mutex;
+    };
+
+    struct Request {
+        std::shared_ptr<Connection> connection;
+        uint32_t request_id;
+        uint32_t reference_index;
+        std::vector<std::string> queries;
+        std::chrono::steady_clock::time_point received;
+    };
+
+    struct Batch {
+        std::vector<Request> requests;
+        std::future<std::vector<AlignmentResult>> results;
+    };
+
+    void HandleConnection(std::shared_ptr<Connection> connection);
+    void BatchLoop();
+    void ResponseLoop();
+    void SendResults(Request & request, const AlignmentResult * results);
+    void SendError(Connection & connection, uint32_t request_id, uint32_t status);
+    void RecordLatency(std::chrono::steady_clock::time_point received);
+    std::string FormatStats();
+
+    SmithWatermanEngine & engine_;
+    std::vector<std::shared_ptr<const std::string>> references_;
+    std::string socket_path_;
+    std::chrono::microseconds batch_window_;
+    size_t max_batch_queries_;
+
+    int listen_fd_;
+    std::atomic<bool> stop_{false};
+
+    std::mutex connections_mutex_;
+    std::condition_variable connections_cv_;
+    std::vector<std::weak_ptr<Connection>> connections_;
+    size_t active_connections_ = 0;
+
+    std::mutex pending_mutex_;
+    std::condition_variable pending_cv_;
+    std::deque<Request> pending_;
+    size_t pending_queries_ = 0;
+
+    std::mutex batches_mutex_;
+    std::condition_variable batches_cv_;
+    std::deque<Batch> batches_;
+    bool batching_done_ = false;
+
+    std::mutex latency_mutex_;
+    std::vector<double> latencies_us_; // ring of the most recent requests
+    size_t latency_cursor_ = 0;
+    size_t num_requests_ = 0;
+    size_t num_batches_ = 0;
+};
+
+// Client side helpers for the protocol above.
+std::vector<AlignmentResult> DaemonAlign(const std::string & socket_path, uint32_t reference_index, const std::vector<std::string> & queries);
+std::string DaemonStats(const std::string & socket_path);
+void DaemonShutdown(const std::string & socket_path);
@@ -0,0 +1,1171 @@
+#include "sw_engine.h"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "fasta.h"
+#include "thread_pool.h"
+
+namespace {
+    const cl_int kZero = 0;
+    const size_t kMaxReduceLocalSize = 256;
+    const size_t kReduceNumGroups = 64;
+    const size_t kWavefrontTileRows = 64;
+    const size_t kWavefrontTileCols = 256;
+    const size_t kNumProfileRows = 5; // A, C, G, T and one for anything else
+
+    // Packed references are joined by this character. Its substitution score keeps h_hat at zero
+    // in boundary columns whatever the previous row held.
+    const char kSegmentSeparator = '\0';
+    const cl_int kSegmentSeparatorScore = -(1 << 20);
+
+    void ZeroBuffer(cl_mem buffer, size_t length, cl_kernel zero_kernel, cl_command_queue command_queue) {
+        cl_int error = clSetKernelArg(zero_kernel, 0, sizeof(cl_mem), &buffer);
+        CheckError(error);
+
+        size_t global = length;
+        error = clEnqueueNDRangeKernel(command_queue, zero_kernel, 1, NULL, &global, nullptr, 0, nullptr, nullptr);
+        CheckError(error);
+    }
+
+    // Index of every non-empty query in sorted order, so that queries sharing a prefix are
+    // neighbours, and the length of the prefix each one shares with the one before it. Walking
+    // them in this order is a depth-first walk of the query trie.
+    void SortByPrefix(const std::vector<std::string> & queries, std::vector<size_t> & order, std::vector<size_t> & shared) {
+        order.clear();
+        for (size_t q = 0; q < queries.size(); ++q) {
+            if (!queries[q].empty()) {
+                order.push_back(q);
+            }
+        }
+        std::sort(order.begin(), order.end(), [&queries](size_t lhs, size_t rhs) { return queries[lhs] < queries[rhs]; });
+
+        shared.assign(order.size(), 0);
+        for (size_t k = 1; k < order.size(); ++k) {
+            const std::string & prev = queries[order[k-1]];
+            const std::string & query = queries[order[k]];
+            const size_t length = std::min(prev.size(), query.size());
+            while (shared[k] < length && prev[shared[k]] == query[shared[k]]) {
+                ++shared[k];
+            }
+        }
+    }
+
+    size_t Log2(size_t num) {
+        size_t log = 0;
+        while (num > 1) {
+            num = num >> 1;
+            ++log;
+        }
+        return log;
+    }
+}
+
+SmithWatermanEngine::DeviceProfile::~DeviceProfile() {
+    for (cl_mem buffer : { a_subs_score_row_buffer, c_subs_score_row_buffer, g_subs_score_row_buffer, t_subs_score_row_buffer, n_subs_score_row_buffer,
+                           segment_flags_buffer, segment_offsets_buffer }) {
+        if (buffer) {
+            clReleaseMemObject(buffer);
+        }
+    }
+}
+
+SmithWatermanEngine::SmithWatermanEngine(const SmithWatermanEngineOptions & options) : options_(options), cells_(0), cells_saved_(0), profiles_built_(0) {
+    cl_uint platformIdCount = 0;
+    clGetPlatformIDs(0, nullptr, &platformIdCount);
+    if (options_.platform_index >= platformIdCount) {
+        throw std::runtime_error("No OpenCL platform " + std::to_string(options_.platform_index));
+    }
+
+    std::vector<cl_platform_id> platformIds(platformIdCount);
+    clGetPlatformIDs(platformIdCount, platformIds.data(), nullptr);
+    cl_platform_id platform_id = platformIds[options_.platform_index];
+
+    cl_uint deviceIdCount = 0;
+    clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, 0, nullptr, &deviceIdCount);
+    if (options_.device_index >= deviceIdCount) {
+        throw std::runtime_error("No OpenCL device " + std::to_string(options_.device_index) + " on platform " + GetPlatformName(platform_id));
+    }
+
+    std::vector<cl_device_id> deviceIds(deviceIdCount);
+    clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, deviceIdCount, deviceIds.data(), nullptr);
+    device_id_ = deviceIds[options_.device_index];
+
+    const cl_context_properties contextProperties [] = { CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platform_id), 0, 0 };
+
+    cl_int error = CL_SUCCESS;
+    context_ = clCreateContext(contextProperties, 1, &device_id_, nullptr, nullptr, &error);
+    CheckError(error);
+
+    program_ = BuildProgramFromFile(context_, device_id_, options_.kernel_filename, GetBuildOptions(options_.scoring));
+
+    for (size_t k = 0; k < std::max<size_t>(options_.num_queues, 1); ++k) {
+        std::unique_ptr<Stream> stream(new Stream());
+
+        // In order: every stream is a plain pipeline, the overlap comes from running several of them
+        stream->command_queue = clCreateCommandQueue(context_, device_id_, 0, &error);
+        CheckError(error);
+
+        stream->f_mat_and_h_hat_mat_row_kernel = clCreateKernel(program_, "f_mat_and_h_hat_mat_row_kernel", &error);
+        CheckError(error);
+        stream->upsweep_kernel = clCreateKernel(program_, "upsweep", &error);
+        CheckError(error);
+        stream->downsweep_kernel = clCreateKernel(program_, "downsweep", &error);
+        CheckError(error);
+        stream->h_mat_row_kernel = clCreateKernel(program_, "h_mat_row_kernel", &error);
+        CheckError(error);
+        stream->column_max_kernel = clCreateKernel(program_, "column_max_kernel", &error);
+        CheckError(error);
+        stream->reduce_max_kernel = clCreateKernel(program_, "reduce_max_kernel", &error);
+        CheckError(error);
+        stream->zero_kernel = clCreateKernel(program_, "zero", &error);
+        CheckError(error);
+        stream->wavefront_tile_kernel = clCreateKernel(program_, "wavefront_tile_kernel", &error);
+        CheckError(error);
+        stream->segmented_upsweep_kernel = clCreateKernel(program_, "segmented_upsweep", &error);
+        CheckError(error);
+        stream->segmented_downsweep_kernel = clCreateKernel(program_, "segmented_downsweep", &error);
+        CheckError(error);
+        stream->segment_max_kernel = clCreateKernel(program_, "segment_max_kernel", &error);
+        CheckError(error);
+
+        streams_.push_back(std::move(stream));
+    }
+
+    size_t kernel_work_group_size = 0;
+    error = clGetKernelWorkGroupInfo(streams_[0]->reduce_max_kernel, device_id_, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_work_group_size), &kernel_work_group_size, nullptr);
+    CheckError(error);
+    reduce_local_size_ = size_t(1) << Log2(std::max<size_t>(std::min(kernel_work_group_size, kMaxReduceLocalSize), 1));
+    reduce_num_groups_ = kReduceNumGroups;
+
+    error = clGetKernelWorkGroupInfo(streams_[0]->wavefront_tile_kernel, device_id_, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_work_group_size), &kernel_work_group_size, nullptr);
+    CheckError(error);
+    wavefront_tile_rows_ = std::max<size_t>(std::min(kernel_work_group_size, kWavefrontTileRows), 1);
+
+    error = clGetDeviceInfo(device_id_, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units_), &compute_units_, nullptr);
+    CheckError(error);
+
+    budget_ = GetMemoryBudget(device_id_);
+    if (options_.max_device_memory > 0) {
+        budget_.device_global_mem_size = std::min<cl_ulong>(budget_.device_global_mem_size, options_.max_device_memory);
+    }
+
+    if (options_.result_cache_entries > 0) {
+        result_cache_.reset(new ResultCache(options_.result_cache_entries, options_.result_cache_path));
+    }
+
+    for (auto & stream : streams_) {
+        Stream * stream_ptr = stream.get();
+        stream->thread = std::thread([this, stream_ptr]() { StreamLoop(*stream_ptr); });
+    }
+}
+
+SmithWatermanEngine::~SmithWatermanEngine() {
+    for (auto & stream : streams_) {
+        {
+            std::lock_guard<std::mutex> lock(stream->mutex);
+            stream->stop = true;
+        }
+        stream->cv.notify_all();
+    }
+
+    for (auto & stream : streams_) {
+        stream->thread.join();
+
+        ReleaseRowBuffers(*stream);
+        ReleaseWavefrontBuffers(*stream);
+        ReleaseSegmentBuffers(*stream);
+        clReleaseKernel(stream->f_mat_and_h_hat_mat_row_kernel);
+        clReleaseKernel(stream->upsweep_kernel);
+        clReleaseKernel(stream->downsweep_kernel);
+        clReleaseKernel(stream->h_mat_row_kernel);
+        clReleaseKernel(stream->column_max_kernel);
+        clReleaseKernel(stream->reduce_max_kernel);
+        clReleaseKernel(stream->zero_kernel);
+        clReleaseKernel(stream->wavefront_tile_kernel);
+        clReleaseKernel(stream->segmented_upsweep_kernel);
+        clReleaseKernel(stream->segmented_downsweep_kernel);
+        clReleaseKernel(stream->segment_max_kernel);
+        clReleaseCommandQueue(stream->command_queue);
+    }
+
+    profiles_.clear();
+
+    clReleaseProgram(program_);
+    clReleaseContext(context_);
+}
+
+std::future<std::vector<AlignmentResult>> SmithWatermanEngine::Submit(std::vector<std::string> query_batch, std::shared_ptr<const std::string> reference) {
+    std::unique_ptr<Job> job(new Job());
+    job->reference = std::move(reference);
+    std::future<std::vector<AlignmentResult>> result = job->promise.get_future();
+
+    if (!result_cache_) {
+        job->query_batch = std::move(query_batch);
+        Enqueue(std::move(job));
+        return result;
+    }
+
+    ResultCacheKey key;
+    key.reference_id = GetReferenceId(job->reference);
+    key.reference_end = job->reference->size();
+    key.scoring = options_.scoring;
+
+    job->cached = true;
+    job->results.resize(query_batch.size());
+    std::unordered_map<std::string, size_t> computed; // query to its index in job->query_batch
+    for (size_t q = 0; q < query_batch.size(); ++q) {
+        auto it = computed.find(query_batch[q]);
+        if (it != computed.end()) {
+            result_cache_->CountDuplicate();
+            job->scatter.emplace_back(q, it->second);
+            continue;
+        }
+
+        key.query_hash = HashSequence(query_batch[q]);
+        key.query_length = query_batch[q].size();
+        if (result_cache_->Lookup(key, job->results[q])) {
+            continue;
+        }
+
+        computed.emplace(query_batch[q], job->query_batch.size());
+        job->scatter.emplace_back(q, job->query_batch.size());
+        job->keys.push_back(key);
+        job->query_batch.push_back(std::move(query_batch[q]));
+    }
+
+    if (job->query_batch.empty()) {
+        job->promise.set_value(std::move(job->results));
+    } else {
+        Enqueue(std::move(job));
+    }
+    return result;
+}
+
+std::future<std::vector<AlignmentResult>> SmithWatermanEngine::WarmReference(std::shared_ptr<const std::string> reference) {
+    // An empty job still plans the reference and fetches the profile of every chunk
+    std::unique_ptr<Job> job(new Job());
+    job->reference = std::move(reference);
+    std::future<std::vector<AlignmentResult>> result = job->promise.get_future();
+    Enqueue(std::move(job));
+    return result;
+}
+
+uint64_t SmithWatermanEngine::GetReferenceId(const std::shared_ptr<const std::string> & reference) {
+    std::lock_guard<std::mutex> lock(reference_ids_mutex_);
+    auto it = reference_ids_.find(reference.get());
+    if (it != reference_ids_.end() && it->second.first.lock() == reference) {
+        return it->second.second;
+    }
+
+    // A new reference is the moment to forget the ones that are gone
+    for (auto entry = reference_ids_.begin(); entry != reference_ids_.end();) {
+        if (entry->second.first.expired()) {
+            entry = reference_ids_.erase(entry);
+        } else {
+            ++entry;
+        }
+    }
+
+    const uint64_t reference_id = HashSequence(*reference);
+    reference_ids_[reference.get()] = std::make_pair(std::weak_ptr<const std::string>(reference), reference_id);
+    return reference_id;
+}
+
+void SmithWatermanEngine::FinishJob(Job & job, std::vector<AlignmentResult> results) {
+    if (!job.cached) {
+        job.promise.set_value(std::move(results));
+        return;
+    }
+
+    for (size_t k = 0; k < job.keys.size(); ++k) {
+        result_cache_->Insert(job.keys[k], results[k]);
+    }
+    for (const auto & slot : job.scatter) {
+        job.results[slot.first] = results[slot.second];
+    }
+    job.promise.set_value(std::move(job.results));
+}
+
+std::future<std::vector<AlignmentResult>> SmithWatermanEngine::SubmitSegmented(std::vector<std::string> query_batch, std::shared_ptr<const std::vector<std::string>> references) {
+    std::unique_ptr<Job> job(new Job());
+    job->query_batch = std::move(query_batch);
+    job->references = std::move(references);
+    std::future<std::vector<AlignmentResult>> result = job->promise.get_future();
+    Enqueue(std::move(job));
+    return result;
+}
+
+void SmithWatermanEngine::Enqueue(std::unique_ptr<Job> job) {
+    // Least loaded stream; a stream that is idle can start on its upload right away
+    Stream * target = nullptr;
+    size_t target_load = 0;
+    for (auto & stream : streams_) {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        const size_t load = stream->jobs.size() + stream->in_flight;
+        if (!target || load < target_load) {
+            target = stream.get();
+            target_load = load;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(target->mutex);
+        target->jobs.push_back(std::move(job));
+    }
+    target->cv.notify_one();
+}
+
+void SmithWatermanEngine::StreamLoop(Stream & stream) {
+    while (true) {
+        std::unique_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(stream.mutex);
+            stream.cv.wait(lock, [&stream]() { return stream.stop || !stream.jobs.empty(); });
+            if (stream.jobs.empty()) {
+                return;
+            }
+            job = std::move(stream.jobs.front());
+            stream.jobs.pop_front();
+            stream.in_flight = 1;
+        }
+
+        try {
+            if (job->references) {
+                RunSegmentedJob(stream, *job);
+            } else {
+                RunJob(stream, *job);
+            }
+        } catch (...) {
+            job->promise.set_exception(std::current_exception());
+        }
+
+        std::lock_guard<std::mutex> lock(stream.mutex);
+        stream.in_flight = 0;
+    }
+}
+
+SmithWatermanEngineStats SmithWatermanEngine::GetStats() {
+    SmithWatermanEngineStats stats;
+    stats.cells = cells_;
+    stats.cells_saved = cells_saved_;
+    stats.profiles_built = profiles_built_;
+    if (result_cache_) {
+        stats.cache = result_cache_->GetStats();
+    }
+    return stats;
+}
+
+EngineKind SmithWatermanEngine::ChooseEngine(size_t max_query_length, size_t reference_length) {
+    if (options_.method == AlignmentMethod::kRowScan) {
+        return EngineKind::kRowScan;
+    } else if (options_.method == AlignmentMethod::kWavefront) {
+        return EngineKind::kWavefront;
+    }
+
+    // The row scan keeps a whole reference row busy but pays about 2 log2(n) dependent launches
+    // per query row. The wavefront needs one launch per diagonal of tiles, but only has as many
+    // tiles in flight as a diagonal is long, which a short query (few tile rows) cannot make
+    // worthwhile: pick it once the average diagonal fills every compute unit.
+    const size_t num_tile_rows = (max_query_length + wavefront_tile_rows_ - 1) / wavefront_tile_rows_;
+    const size_t num_tile_cols = (reference_length + kWavefrontTileCols - 1) / kWavefrontTileCols;
+    if (num_tile_rows == 0 || num_tile_cols == 0) {
+        return EngineKind::kRowScan;
+    }
+
+    const double tiles_in_flight = static_cast<double>(num_tile_rows) * num_tile_cols / (num_tile_rows + num_tile_cols - 1);
+    return tiles_in_flight >= compute_units_ ? EngineKind::kWavefront : EngineKind::kRowScan;
+}
+
+MemoryPlan SmithWatermanEngine::PlanJob(EngineKind engine, size_t query_batch, size_t max_query_length, size_t reference_length) {
+    return PlanMemory(GetPlanRequest(engine, query_batch, max_query_length, reference_length), budget_);
+}
+
+MemoryPlan SmithWatermanEngine::PlanSegmentedJob(size_t query_batch, size_t max_query_length, size_t packed_length, size_t longest_reference) {
+    PlanRequest request = GetPlanRequest(EngineKind::kRowScan, query_batch, max_query_length, packed_length);
+    request.segmented = true;
+    request.cache_profiles = false; // built per job
+    request.longest_segment = longest_reference + 1; // with its boundary column
+    return PlanMemory(request, budget_);
+}
+
+PlanRequest SmithWatermanEngine::GetPlanRequest(EngineKind engine, size_t query_batch, size_t max_query_length, size_t reference_length) {
+    PlanRequest request;
+    request.engine = engine;
+    request.query_batch = query_batch;
+    request.max_query_length = max_query_length;
+    request.reference_length = reference_length;
+    request.num_streams = streams_.size();
+    // Every chunk of the reference, plus the profile each stream may still hold after it was evicted
+    request.num_resident_profiles = streams_.size();
+    request.cache_profiles = true;
+    request.reduce_num_groups = reduce_num_groups_;
+    request.num_row_buffers += 3 * options_.prefix_snapshots; // H, F and column max each
+    request.scoring = options_.scoring;
+    request.tile_rows = wavefront_tile_rows_;
+    return request;
+}
+
+std::shared_ptr<SmithWatermanEngine::DeviceProfile> SmithWatermanEngine::GetProfile(std::shared_ptr<const std::string> reference, const MemoryPlan & plan, size_t chunk_begin,
+                                                                                     size_t chunk_length) {
+    std::shared_future<std::shared_ptr<DeviceProfile>> cached;
+    std::promise<std::shared_ptr<DeviceProfile>> building;
+    {
+        std::lock_guard<std::mutex> lock(profiles_mutex_);
+
+        for (auto it = profiles_.begin(); it != profiles_.end(); ++it) {
+            if (it->reference == reference && it->chunk_begin == chunk_begin && it->chunk_length == chunk_length) {
+                profiles_.splice(profiles_.begin(), profiles_, it);
+                if (plan.profiles_cached) {
+                    profiles_.front().plan_chunk_length = plan.chunk_length;
+                    profiles_.front().plan_chunk_overlap = plan.chunk_overlap;
+                }
+                cached = profiles_.front().profile;
+                break;
+            }
+        }
+
+        if (!cached.valid() && plan.profiles_cached) {
+            CachedProfile entry;
+            entry.reference = reference;
+            entry.chunk_begin = chunk_begin;
+            entry.chunk_length = chunk_length;
+            entry.plan_chunk_length = plan.chunk_length;
+            entry.plan_chunk_overlap = plan.chunk_overlap;
+            entry.bytes = kNumProfileRows * sizeof(cl_int) * (chunk_length + 1);
+            entry.profile = building.get_future().share();
+            profiles_.push_front(std::move(entry));
+            TrimProfiles(reference, plan);
+        }
+    }
+
+    if (cached.valid()) {
+        return cached.get();
+    }
+
+    std::shared_ptr<DeviceProfile> profile;
+    try {
+        profile = CreateProfile(reference->data() + chunk_begin, chunk_length, false);
+    } catch (...) {
+        if (plan.profiles_cached) {
+            // Whoever waits on it fails too; the next job builds it afresh
+            building.set_exception(std::current_exception());
+            std::lock_guard<std::mutex> lock(profiles_mutex_);
+            profiles_.remove_if([&](const CachedProfile & entry) {
+                return entry.reference == reference && entry.chunk_begin == chunk_begin && entry.chunk_length == chunk_length;
+            });
+        }
+        throw;
+    }
+    ++profiles_built_;
+
+    if (plan.profiles_cached) {
+        building.set_value(profile);
+    }
+    return profile;
+}
+
+void SmithWatermanEngine::TrimProfiles(const std::shared_ptr<const std::string> & reference, const MemoryPlan & plan) {
+    // Whole references are evicted, least recently used first, so a reference never pushes out its
+    // own chunks; so are its chunks cut for another plan. Streams still using an evicted profile
+    // keep it alive through their shared_ptr.
+    std::vector<const std::string *> kept;
+    for (auto it = profiles_.begin(); it != profiles_.end();) {
+        bool keep = it->reference != reference || !plan.profiles_cached
+                    || (it->plan_chunk_length == plan.chunk_length && it->plan_chunk_overlap == plan.chunk_overlap);
+        if (keep && std::find(kept.begin(), kept.end(), it->reference.get()) == kept.end()) {
+            keep = kept.size() < std::max<size_t>(options_.max_cached_references, 1);
+            if (keep) {
+                kept.push_back(it->reference.get());
+            }
+        }
+        it = keep ? std::next(it) : profiles_.erase(it);
+    }
+
+    // The plan only counts the chunks of its own reference, and only when it caches them
+    auto uncounted = [&](const CachedProfile & entry) { return entry.reference != reference || !plan.profiles_cached; };
+    uint64_t uncounted_bytes = 0;
+    for (const CachedProfile & entry : profiles_) {
+        if (uncounted(entry)) {
+            uncounted_bytes += entry.bytes;
+        }
+    }
+
+    while (plan.device_bytes + uncounted_bytes > plan.device_budget) {
+        auto victim = std::find_if(profiles_.rbegin(), profiles_.rend(), uncounted);
+        if (victim == profiles_.rend()) {
+            break;
+        }
+
+        const std::shared_ptr<const std::string> evicted = victim->reference;
+        for (auto it = profiles_.begin(); it != profiles_.end();) {
+            if (it->reference == evicted) {
+                uncounted_bytes -= it->bytes;
+                it = profiles_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+std::shared_ptr<SmithWatermanEngine::DeviceProfile> SmithWatermanEngine::CreateProfile(const char * seq1, size_t length, bool segmented) {
+    const size_t row_size = length + 1;
+    const ScoringScheme & scoring = options_.scoring;
+
+    std::vector<cl_int> a_vec(row_size, 0);
+    std::vector<cl_int> c_vec(row_size, 0);
+    std::vector<cl_int> g_vec(row_size, 0);
+    std::vector<cl_int> t_vec(row_size, 0);
+    std::vector<cl_int> n_vec(row_size, scoring.mismatch);
+    n_vec[0] = 0;
+    GetThreadPool().ParallelFor(1, row_size, 1 << 20, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; ++c) {
+            a_vec[c] = seq1[c-1] == 'A' ? scoring.match : scoring.mismatch;
+            c_vec[c] = seq1[c-1] == 'C' ? scoring.match : scoring.mismatch;
+            g_vec[c] = seq1[c-1] == 'G' ? scoring.match : scoring.mismatch;
+            t_vec[c] = seq1[c-1] == 'T' ? scoring.match : scoring.mismatch;
+            if (segmented && seq1[c-1] == kSegmentSeparator) {
+                a_vec[c] = c_vec[c] = g_vec[c] = t_vec[c] = n_vec[c] = kSegmentSeparatorScore;
+            }
+        }
+    });
+
+    std::shared_ptr<DeviceProfile> profile = std::make_shared<DeviceProfile>();
+    profile->chunk_length = length;
+
+    // Copied at creation, so the profile is usable from every stream's queue straight away
+    cl_int error = CL_SUCCESS;
+    profile->a_subs_score_row_buffer = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_int) * row_size, a_vec.data(), &error);
+    CheckError(error);
+    profile->c_subs_score_row_buffer = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_int) * row_size, c_vec.data(), &error);
+    CheckError(error);
+    profile->g_subs_score_row_buffer = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_int) * row_size, g_vec.data(), &error);
+    CheckError(error);
+    profile->t_subs_score_row_buffer = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_int) * row_size, t_vec.data(), &error);
+    CheckError(error);
+    profile->n_subs_score_row_buffer = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_int) * row_size, n_vec.data(), &error);
+    CheckError(error);
+
+    if (segmented) {
+        // Column 0 is the boundary of the first reference, every separator one of the next
+        std::vector<cl_int> segment_flags(GetPaddedRowSize(row_size), 0);
+        std::vector<cl_uint> segment_offsets(1, 0);
+        segment_flags[0] = 1;
+        for (size_t c = 1; c < row_size; ++c) {
+            if (seq1[c-1] == kSegmentSeparator) {
+                segment_flags[c] = 1;
+                segment_offsets.push_back(static_cast<cl_uint>(c));
+            }
+        }
+        profile->num_segments = segment_offsets.size();
+        segment_offsets.push_back(static_cast<cl_uint>(row_size));
+
+        profile->segment_flags_buffer = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_int) * segment_flags.size(), segment_flags.data(), &error);
+        CheckError(error);
+        profile->segment_offsets_buffer = clCreateBuffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint) * segment_offsets.size(), segment_offsets.data(), &error);
+        CheckError(error);
+    }
+
+    return profile;
+}
+
+void SmithWatermanEngine::ReleaseRowBuffers(Stream & stream) {
+    for (cl_mem * buffer : { &stream.f_mat_row_buffer, &stream.f_mat_prev_row_buffer, &stream.h_mat_row_buffer, &stream.h_mat_prev_row_buffer,
+                             &stream.h_hat_mat_row_buffer, &stream.padded_row_buffer, &stream.column_max_buffer, &stream.group_max_buffer, &stream.group_index_buffer }) {
+        if (*buffer) {
+            clReleaseMemObject(*buffer);
+            *buffer = nullptr;
+        }
+    }
+    for (RowSnapshot & snapshot : stream.snapshots) {
+        for (cl_mem buffer : { snapshot.h_row_buffer, snapshot.f_row_buffer, snapshot.column_max_buffer }) {
+            clReleaseMemObject(buffer);
+        }
+    }
+    stream.snapshots.clear();
+    stream.capacity = 0;
+}
+
+void SmithWatermanEngine::ReleaseWavefrontBuffers(Stream & stream) {
+    for (cl_mem * buffer : { &stream.reference_chunk_buffer, &stream.border_h_row_buffer, &stream.border_f_row_buffer, &stream.query_buffer,
+                             &stream.border_h_col_buffer, &stream.border_e_col_buffer, &stream.best_score_buffer, &stream.best_end_buffer, &stream.corner_buffer }) {
+        if (*buffer) {
+            clReleaseMemObject(*buffer);
+            *buffer = nullptr;
+        }
+    }
+    stream.wavefront_columns = 0;
+    stream.wavefront_rows = 0;
+}
+
+void SmithWatermanEngine::ReleaseSegmentBuffers(Stream & stream) {
+    for (cl_mem * buffer : { &stream.tree_flags_buffer, &stream.segment_max_buffer, &stream.segment_end_buffer }) {
+        if (*buffer) {
+            clReleaseMemObject(*buffer);
+            *buffer = nullptr;
+        }
+    }
+    stream.segment_capacity = 0;
+}
+
+void SmithWatermanEngine::EnsureSegmentCapacity(Stream & stream, size_t row_size) {
+    if (row_size == stream.segment_capacity) {
+        return;
+    }
+
+    ReleaseSegmentBuffers(stream);
+
+    // Every segment is at least one residue and its boundary column
+    const size_t max_segments = row_size / 2 + 1;
+
+    cl_int error = CL_SUCCESS;
+    stream.tree_flags_buffer = clCreateBuffer(context_, CL_MEM_READ_WRITE, sizeof(cl_int) * GetPaddedRowSize(row_size), NULL, &error);
+    CheckError(error);
+    stream.segment_max_buffer = clCreateBuffer(context_, CL_MEM_WRITE_ONLY, sizeof(cl_int) * max_segments, NULL, &error);
+    CheckError(error);
+    stream.segment_end_buffer = clCreateBuffer(context_, CL_MEM_WRITE_ONLY, sizeof(cl_uint) * max_segments, NULL, &error);
+    CheckError(error);
+
+    stream.segment_capacity = row_size;
+}
+
+void SmithWatermanEngine::EnsureWavefrontCapacity(Stream & stream, size_t columns, size_t rows, size_t planned_rows) {
+    cl_int error = CL_SUCCESS;
+
+    if (columns != stream.wavefront_columns) {
+        for (cl_mem * buffer : { &stream.reference_chunk_buffer, &stream.border_h_row_buffer, &stream.border_f_row_buffer }) {
+            if (*buffer) {
+                clReleaseMemObject(*buffer);
+            }
+        }
+
+        stream.reference_chunk_buffer = clCreateBuffer(context_, CL_MEM_READ_ONLY, columns, NULL, &error);
+        CheckError(error);
+        stream.border_h_row_buffer = clCreateBuffer(context_, CL_MEM_READ_WRITE, sizeof(cl_int) * columns, NULL, &error);
+        CheckError(error);
+        stream.border_f_row_buffer = clCreateBuffer(context_, CL_MEM_READ_WRITE, sizeof(cl_int) * columns, NULL, &error);
+        CheckError(error);
+
+        stream.wavefront_columns = columns;
+    }
+
+    // Any query up to the planned length fits the plan, so the rows are only reallocated past it
+    if (rows > stream.wavefront_rows || stream.wavefront_rows > planned_rows) {
+        for (cl_mem * buffer : { &stream.query_buffer, &stream.border_h_col_buffer, &stream.border_e_col_buffer, &stream.best_score_buffer, &stream.best_end_buffer, &stream.corner_buffer }) {
+            if (*buffer) {
+                clReleaseMemObject(*buffer);
+            }
+        }
+
+        stream.query_buffer = clCreateBuffer(context_, CL_MEM_READ_ONLY, rows, NULL, &error);
+        CheckError(error);
+        for (cl_mem * buffer : { &stream.border_h_col_buffer, &stream.border_e_col_buffer, &stream.best_score_buffer, &stream.best_end_buffer }) {
+            *buffer = clCreateBuffer(context_, CL_MEM_READ_WRITE, sizeof(cl_int) * rows, NULL, &error);
+            CheckError(error);
+        }
+        stream.corner_buffer = clCreateBuffer(context_, CL_MEM_READ_WRITE, sizeof(cl_int) * ((rows + wavefront_tile_rows_ - 1) / wavefront_tile_rows_), NULL, &error);
+        CheckError(error);
+
+        stream.wavefront_rows = rows;
+    }
+}
+
+void SmithWatermanEngine::EnsureCapacity(Stream & stream, size_t row_size) {
+    if (row_size == stream.capacity) {
+        return;
+    }
+
+    ReleaseRowBuffers(stream);
+
+    const size_t padded_row_size = GetPaddedRowSize(row_size);
+
+    cl_int error = CL_SUCCESS;
+    for (cl_mem * buffer : { &stream.f_mat_row_buffer, &stream.f_mat_prev_row_buffer, &stream.h_mat_row_buffer, &stream.h_mat_prev_row_buffer,
+                             &stream.h_hat_mat_row_buffer, &stream.column_max_buffer }) {
+        *buffer = clCreateBuffer(context_, CL_MEM_READ_WRITE, sizeof(cl_int) * row_size, NULL, &error);
+        CheckError(error);
+    }
+
+    stream.padded_row_buffer = clCreateBuffer(context_, CL_MEM_READ_WRITE, sizeof(cl_int) * padded_row_size, NULL, &error);
+    CheckError(error);
+
+    stream.group_max_buffer = clCreateBuffer(context_, CL_MEM_WRITE_ONLY, sizeof(cl_int) * reduce_num_groups_, NULL, &error);
+    CheckError(error);
+
+    stream.group_index_buffer = clCreateBuffer(context_, CL_MEM_WRITE_ONLY, sizeof(cl_uint) * reduce_num_groups_, NULL, &error);
+    CheckError(error);
+
+    stream.snapshots.resize(options_.prefix_snapshots);
+    for (RowSnapshot & snapshot : stream.snapshots) {
+        for (cl_mem * buffer : { &snapshot.h_row_buffer, &snapshot.f_row_buffer, &snapshot.column_max_buffer }) {
+            *buffer = clCreateBuffer(context_, CL_MEM_READ_WRITE, sizeof(cl_int) * row_size, NULL, &error);
+            CheckError(error);
+        }
+    }
+
+    stream.capacity = row_size;
+}
+
+void SmithWatermanEngine::RunJob(Stream & stream, Job & job) {
+    const std::string & reference = *job.reference;
+    std::vector<AlignmentResult> results(job.query_batch.size());
+
+    if (reference.empty()) {
+        FinishJob(job, std::move(results));
+        return;
+    }
+
+    size_t max_query_length = 0;
+    for (const auto & query : job.query_batch) {
+        max_query_length = std::max(max_query_length, query.size());
+    }
+
+    // An empty warmup job plans the row scan of planned_query_length queries, so it fetches the
+    // very profiles those jobs will ask for; the wavefront has none to fetch
+    const size_t planned_query_length = std::max(max_query_length, options_.planned_query_length);
+    const EngineKind engine = job.query_batch.empty() && options_.method != AlignmentMethod::kWavefront ? EngineKind::kRowScan
+                                                                                                        : ChooseEngine(max_query_length, reference.size());
+    const MemoryPlan plan = PlanJob(engine, std::max<size_t>(job.query_batch.size(), 1), planned_query_length, reference.size());
+    if (!plan.fits) {
+        throw std::runtime_error("Job does not fit in memory: " + std::to_string(plan.device_bytes) + " device bytes of " + std::to_string(plan.device_budget)
+                                 + ", " + std::to_string(plan.host_bytes) + " host bytes of " + std::to_string(plan.host_budget));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(profiles_mutex_);
+        TrimProfiles(job.reference, plan);
+    }
+
+    // Buffers of the other method are dropped so a stream only ever holds what one plan allows for
+    size_t results_per_query = 0;
+    if (engine == EngineKind::kRowScan) {
+        ReleaseWavefrontBuffers(stream);
+        EnsureCapacity(stream, static_cast<size_t>(plan.chunk_length) + 1);
+        results_per_query = reduce_num_groups_;
+    } else {
+        ReleaseRowBuffers(stream);
+        ReleaseSegmentBuffers(stream);
+        EnsureWavefrontCapacity(stream, static_cast<size_t>(plan.chunk_length), max_query_length, planned_query_length);
+        results_per_query = max_query_length;
+    }
+
+    // Row scan: one (max, index) pair per reduce group. Wavefront: the best (score, end) per query row.
+    std::vector<cl_int> group_max(results_per_query * job.query_batch.size(), 0);
+    std::vector<cl_uint> group_index(results_per_query * job.query_batch.size(), 0);
+
+    std::vector<size_t> order;
+    std::vector<size_t> shared;
+    SortByPrefix(job.query_batch, order, shared);
+    const bool share_prefixes = engine == EngineKind::kRowScan && !stream.snapshots.empty();
+
+    for (size_t chunk = 0; chunk < plan.num_chunks; ++chunk) {
+        const size_t chunk_begin = static_cast<size_t>(plan.GetChunkBegin(chunk));
+        const size_t chunk_length = std::min(static_cast<size_t>(plan.chunk_length), reference.size() - chunk_begin);
+        const size_t row_size = chunk_length + 1;
+        const size_t padded_row_size = GetPaddedRowSize(row_size);
+
+        std::fill(group_max.begin(), group_max.end(), 0);
+        std::fill(group_index.begin(), group_index.end(), 0);
+
+        // Everything is queued back to back, the host only waits once per chunk
+        std::shared_ptr<DeviceProfile> profile;
+        if (engine == EngineKind::kRowScan) {
+            profile = GetProfile(job.reference, plan, chunk_begin, chunk_length);
+        } else {
+            cl_int error = clEnqueueWriteBuffer(stream.command_queue, stream.reference_chunk_buffer, CL_FALSE, 0, chunk_length, reference.data() + chunk_begin, 0, nullptr, nullptr);
+            CheckError(error);
+        }
+
+        // Snapshots along the path of the query just scanned, shallowest first
+        std::vector<RowSnapshot *> path;
+        std::vector<RowSnapshot *> free_snapshots;
+        for (RowSnapshot & snapshot : stream.snapshots) {
+            free_snapshots.push_back(&snapshot);
+        }
+
+        uint64_t rows_saved = 0;
+        for (size_t k = 0; k < order.size(); ++k) {
+            const size_t q = order[k];
+            const std::string & query = job.query_batch[q];
+
+            if (engine == EngineKind::kWavefront) {
+                RunWavefrontQuery(stream, query, chunk_length, &group_max[q * results_per_query], &group_index[q * results_per_query]);
+                continue;
+            } else if (!share_prefixes) {
+                RunQuery(stream, *profile, query, row_size, padded_row_size, &group_max[q * results_per_query], &group_index[q * results_per_query]);
+                continue;
+            }
+
+            // Snapshots past the shared prefix belong to a finished branch of the trie
+            while (!path.empty() && path.back()->depth > shared[k]) {
+                free_snapshots.push_back(path.back());
+                path.pop_back();
+            }
+            const RowSnapshot * restore = path.empty() ? nullptr : path.back();
+            const size_t start = restore ? restore->depth : 0;
+
+            // Later queries branch off this one at the running minima of their shared prefixes
+            std::vector<RowSnapshot *> save;
+            size_t branch = query.size() + 1;
+            for (size_t j = k + 1; j < order.size() && !free_snapshots.empty(); ++j) {
+                if (shared[j] <= start) {
+                    break;
+                }
+                if (shared[j] < branch) {
+                    branch = shared[j];
+                    save.push_back(free_snapshots.back());
+                    save.back()->depth = branch;
+                    free_snapshots.pop_back();
+                }
+            }
+            std::reverse(save.begin(), save.end());
+
+            RunQuery(stream, *profile, query, row_size, padded_row_size, &group_max[q * results_per_query], &group_index[q * results_per_query], restore, save);
+            path.insert(path.end(), save.begin(), save.end());
+            rows_saved += start;
+        }
+
+        uint64_t rows = 0;
+        for (size_t q : order) {
+            rows += job.query_batch[q].size();
+        }
+        cells_ += (rows - rows_saved) * chunk_length;
+        cells_saved_ += rows_saved * chunk_length;
+
+        cl_int error = clFinish(stream.command_queue);
+        CheckError(error);
+
+        for (size_t q = 0; q < job.query_batch.size(); ++q) {
+            for (size_t k = q * results_per_query; k < (q + 1) * results_per_query; ++k) {
+                const size_t reference_end = chunk_begin + group_index[k];
+                if (group_max[k] > results[q].score || (group_max[k] == results[q].score && reference_end < results[q].reference_end)) {
+                    results[q].score = group_max[k];
+                    results[q].reference_end = reference_end;
+                }
+            }
+        }
+    }
+
+    FinishJob(job, std::move(results));
+}
+
+void SmithWatermanEngine::RunSegmentedJob(Stream & stream, Job & job) {
+    const std::vector<std::string> & references = *job.references;
+    std::vector<AlignmentResult> results(job.query_batch.size() * references.size());
+
+    // Empty references score 0 and are not packed, so every segment holds at least one residue
+    std::vector<size_t> packed_references;
+    for (size_t r = 0; r < references.size(); ++r) {
+        if (!references[r].empty()) {
+            packed_references.push_back(r);
+        }
+    }
+
+    if (packed_references.empty()) {
+        job.promise.set_value(std::move(results));
+        return;
+    }
+
+    size_t max_query_length = 0;
+    for (const auto & query : job.query_batch) {
+        max_query_length = std::max(max_query_length, query.size());
+    }
+
+    // The first reference uses column 0 as its boundary, every other one a separator
+    size_t packed_length = packed_references.size() - 1;
+    size_t longest_reference = 0;
+    for (size_t r : packed_references) {
+        packed_length += references[r].size();
+        longest_reference = std::max(longest_reference, references[r].size());
+    }
+
+    const MemoryPlan plan = PlanSegmentedJob(job.query_batch.size(), max_query_length, packed_length, longest_reference);
+    if (!plan.fits) {
+        throw std::runtime_error("Job does not fit in memory: " + std::to_string(plan.device_bytes) + " device bytes of " + std::to_string(plan.device_budget)
+                                 + ", " + std::to_string(plan.host_bytes) + " host bytes of " + std::to_string(plan.host_budget));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(profiles_mutex_);
+        TrimProfiles(nullptr, plan);
+    }
+
+    ReleaseWavefrontBuffers(stream);
+    EnsureCapacity(stream, static_cast<size_t>(plan.chunk_length) + 1);
+    EnsureSegmentCapacity(stream, static_cast<size_t>(plan.chunk_length) + 1);
+
+    std::vector<cl_int> segment_max;
+    std::vector<cl_uint> segment_end;
+    for (size_t first = 0; first < packed_references.size();) {
+        // As many whole references as one planned row holds
+        std::string packed = references[packed_references[first]];
+        size_t last = first + 1;
+        while (last < packed_references.size() && packed.size() + 1 + references[packed_references[last]].size() <= plan.chunk_length) {
+            packed += kSegmentSeparator;
+            packed += references[packed_references[last]];
+            ++last;
+        }
+
+        const size_t num_segments = last - first;
+        const size_t row_size = packed.size() + 1;
+        const size_t padded_row_size = GetPaddedRowSize(row_size);
+        std::shared_ptr<DeviceProfile> profile = CreateProfile(packed.data(), packed.size(), true);
+
+        segment_max.assign(num_segments * job.query_batch.size(), 0);
+        segment_end.assign(num_segments * job.query_batch.size(), 0);
+        for (size_t q = 0; q < job.query_batch.size(); ++q) {
+            if (!job.query_batch[q].empty()) {
+                RunSegmentedQuery(stream, *profile, job.query_batch[q], row_size, padded_row_size, &segment_max[q * num_segments], &segment_end[q * num_segments]);
+                cells_ += job.query_batch[q].size() * packed.size();
+            }
+        }
+
+        cl_int error = clFinish(stream.command_queue);
+        CheckError(error);
+
+        for (size_t q = 0; q < job.query_batch.size(); ++q) {
+            for (size_t k = 0; k < num_segments; ++k) {
+                AlignmentResult & result = results[q * references.size() + packed_references[first + k]];
+                result.score = segment_max[q * num_segments + k];
+                result.reference_end = segment_end[q * num_segments + k];
+            }
+        }
+
+        first = last;
+    }
+
+    job.promise.set_value(std::move(results));
+}
+
+void SmithWatermanEngine::RunQuery(Stream & stream, DeviceProfile & profile, const std::string & query, size_t row_size, size_t padded_row_size, cl_int * group_max, cl_uint * group_index,
+                                   const RowSnapshot * restore, const std::vector<RowSnapshot *> & save) {
+    ScanQuery(stream, profile, query, row_size, padded_row_size, restore, save);
+
+    const cl_uint length = static_cast<cl_uint>(row_size);
+    cl_int error = clSetKernelArg(stream.reduce_max_kernel, 0, sizeof(cl_mem), &stream.column_max_buffer);
+    error |= clSetKernelArg(stream.reduce_max_kernel, 1, sizeof(cl_uint), &length);
+    error |= clSetKernelArg(stream.reduce_max_kernel, 2, sizeof(cl_int) * reduce_local_size_, nullptr);
+    error |= clSetKernelArg(stream.reduce_max_kernel, 3, sizeof(cl_uint) * reduce_local_size_, nullptr);
+    error |= clSetKernelArg(stream.reduce_max_kernel, 4, sizeof(cl_mem), &stream.group_max_buffer);
+    error |= clSetKernelArg(stream.reduce_max_kernel, 5, sizeof(cl_mem), &stream.group_index_buffer);
+    CheckError(error);
+
+    size_t global = reduce_num_groups_ * reduce_local_size_;
+    error = clEnqueueNDRangeKernel(stream.command_queue, stream.reduce_max_kernel, 1, NULL, &global, &reduce_local_size_, 0, nullptr, nullptr);
+    CheckError(error);
+
+    error = clEnqueueReadBuffer(stream.command_queue, stream.group_max_buffer, CL_FALSE, 0, sizeof(cl_int) * reduce_num_groups_, group_max, 0, nullptr, nullptr);
+    CheckError(error);
+    error = clEnqueueReadBuffer(stream.command_queue, stream.group_index_buffer, CL_FALSE, 0, sizeof(cl_uint) * reduce_num_groups_, group_index, 0, nullptr, nullptr);
+    CheckError(error);
+}
+
+void SmithWatermanEngine::RunSegmentedQuery(Stream & stream, DeviceProfile & profile, const std::string & query, size_t row_size, size_t padded_row_size, cl_int * segment_max, cl_uint * segment_end) {
+    ScanQuery(stream, profile, query, row_size, padded_row_size);
+
+    const cl_uint num_segments = static_cast<cl_uint>(profile.num_segments);
+    cl_int error = clSetKernelArg(stream.segment_max_kernel, 0, sizeof(cl_mem), &stream.column_max_buffer);
+    error |= clSetKernelArg(stream.segment_max_kernel, 1, sizeof(cl_mem), &profile.segment_offsets_buffer);
+    error |= clSetKernelArg(stream.segment_max_kernel, 2, sizeof(cl_uint), &num_segments);
+    error |= clSetKernelArg(stream.segment_max_kernel, 3, sizeof(cl_mem), &stream.segment_max_buffer);
+    error |= clSetKernelArg(stream.segment_max_kernel, 4, sizeof(cl_mem), &stream.segment_end_buffer);
+    CheckError(error);
+
+    size_t global = profile.num_segments;
+    error = clEnqueueNDRangeKernel(stream.command_queue, stream.segment_max_kernel, 1, NULL, &global, nullptr, 0, nullptr, nullptr);
+    CheckError(error);
+
+    error = clEnqueueReadBuffer(stream.command_queue, stream.segment_max_buffer, CL_FALSE, 0, sizeof(cl_int) * profile.num_segments, segment_max, 0, nullptr, nullptr);
+    CheckError(error);
+    error = clEnqueueReadBuffer(stream.command_queue, stream.segment_end_buffer, CL_FALSE, 0, sizeof(cl_uint) * profile.num_segments, segment_end, 0, nullptr, nullptr);
+    CheckError(error);
+}
+
+// Queues every row of one query; the column maxima are left in stream.column_max_buffer.
+void SmithWatermanEngine::ScanQuery(Stream & stream, DeviceProfile & profile, const std::string & query, size_t row_size, size_t padded_row_size,
+                                    const RowSnapshot * restore, const std::vector<RowSnapshot *> & save) {
+    cl_command_queue command_queue = stream.command_queue;
+
+    cl_mem f_mat_row_buffer = stream.f_mat_row_buffer;
+    cl_mem f_mat_prev_row_buffer = stream.f_mat_prev_row_buffer;
+    cl_mem h_mat_row_buffer = stream.h_mat_row_buffer;
+    cl_mem h_mat_prev_row_buffer = stream.h_mat_prev_row_buffer;
+
+    cl_int error = CL_SUCCESS;
+    if (restore) {
+        error = clEnqueueCopyBuffer(command_queue, restore->f_row_buffer, f_mat_prev_row_buffer, 0, 0, row_size * sizeof(cl_int), 0, nullptr, nullptr);
+        error |= clEnqueueCopyBuffer(command_queue, restore->h_row_buffer, h_mat_prev_row_buffer, 0, 0, row_size * sizeof(cl_int), 0, nullptr, nullptr);
+        error |= clEnqueueCopyBuffer(command_queue, restore->column_max_buffer, stream.column_max_buffer, 0, 0, row_size * sizeof(cl_int), 0, nullptr, nullptr);
+        CheckError(error);
+    } else {
+        ZeroBuffer(f_mat_prev_row_buffer, row_size, stream.zero_kernel, command_queue);
+        ZeroBuffer(h_mat_prev_row_buffer, row_size, stream.zero_kernel, command_queue);
+        ZeroBuffer(stream.column_max_buffer, row_size, stream.zero_kernel, command_queue);
+    }
+    ZeroBuffer(stream.h_hat_mat_row_buffer, row_size, stream.zero_kernel, command_queue);
+    ZeroBuffer(stream.padded_row_buffer, padded_row_size, stream.zero_kernel, command_queue);
+
+    cl_mem query_character_row_score_map[256];
+    std::fill_n(query_character_row_score_map, 256, profile.n_subs_score_row_buffer);
+    query_character_row_score_map['A'] = profile.a_subs_score_row_buffer;
+    query_character_row_score_map['C'] = profile.c_subs_score_row_buffer;
+    query_character_row_score_map['G'] = profile.g_subs_score_row_buffer;
+    query_character_row_score_map['T'] = profile.t_subs_score_row_buffer;
+
+    const cl_int levels = static_cast<cl_int>(Log2(padded_row_size));
+
+    // Segmented profiles restart the gap scan at every boundary column
+    const bool segmented = profile.segment_flags_buffer != nullptr;
+    cl_kernel upsweep_kernel = segmented ? stream.segmented_upsweep_kernel : stream.upsweep_kernel;
+    cl_kernel downsweep_kernel = segmented ? stream.segmented_downsweep_kernel : stream.downsweep_kernel;
+
+    auto take_snapshots = [&](size_t depth) {
+        for (RowSnapshot * snapshot : save) {
+            if (snapshot->depth == depth) {
+                error = clEnqueueCopyBuffer(command_queue, f_mat_prev_row_buffer, snapshot->f_row_buffer, 0, 0, row_size * sizeof(cl_int), 0, nullptr, nullptr);
+                error |= clEnqueueCopyBuffer(command_queue, h_mat_prev_row_buffer, snapshot->h_row_buffer, 0, 0, row_size * sizeof(cl_int), 0, nullptr, nullptr);
+                error |= clEnqueueCopyBuffer(command_queue, stream.column_max_buffer, snapshot->column_max_buffer, 0, 0, row_size * sizeof(cl_int), 0, nullptr, nullptr);
+                CheckError(error);
+            }
+        }
+    };
+
+    for (size_t r = (restore ? restore->depth : 0) + 1; r <= query.size(); ++r) {
+        cl_mem subs_score_row_buffer = query_character_row_score_map[static_cast<unsigned char>(query[r-1])];
+        error = clSetKernelArg(stream.f_mat_and_h_hat_mat_row_kernel, 0, sizeof(cl_mem), &f_mat_prev_row_buffer);
+        error |= clSetKernelArg(stream.f_mat_and_h_hat_mat_row_kernel, 1, sizeof(cl_mem), &h_mat_prev_row_buffer);
+        error |= clSetKernelArg(stream.f_mat_and_h_hat_mat_row_kernel, 2, sizeof(cl_mem), &f_mat_row_buffer);
+        error |= clSetKernelArg(stream.f_mat_and_h_hat_mat_row_kernel, 3, sizeof(cl_mem), &subs_score_row_buffer);
+        error |= clSetKernelArg(stream.f_mat_and_h_hat_mat_row_kernel, 4, sizeof(cl_mem), &stream.h_hat_mat_row_buffer);
+        CheckError(error);
+
+        size_t global = row_size;
+        error = clEnqueueNDRangeKernel(command_queue, stream.f_mat_and_h_hat_mat_row_kernel, 1, NULL, &global, nullptr, 0, nullptr, nullptr);
+        CheckError(error);
+
+        error = clEnqueueCopyBuffer(command_queue, stream.h_hat_mat_row_buffer, stream.padded_row_buffer, 0, 0, row_size * sizeof(cl_int), 0, nullptr, nullptr);
+        CheckError(error);
+
+        if (segmented) {
+            // The upsweep folds the flags in place, so every row starts again from the boundaries
+            error = clEnqueueCopyBuffer(command_queue, profile.segment_flags_buffer, stream.tree_flags_buffer, 0, 0, padded_row_size * sizeof(cl_int), 0, nullptr, nullptr);
+            CheckError(error);
+        }
+
+        for (cl_int depth = 0; depth < levels; ++depth) {
+            error = clSetKernelArg(upsweep_kernel, 0, sizeof(cl_mem), &stream.padded_row_buffer);
+            if (segmented) {
+                error |= clSetKernelArg(upsweep_kernel, 1, sizeof(cl_mem), &stream.tree_flags_buffer);
+            }
+            error |= clSetKernelArg(upsweep_kernel, segmented ? 2 : 1, sizeof(cl_int), &depth);
+            CheckError(error);
+
+            global = padded_row_size >> (depth + 1);
+            error = clEnqueueNDRangeKernel(command_queue, upsweep_kernel, 1, NULL, &global, nullptr, 0, nullptr, nullptr);
+            CheckError(error);
+        }
+
+        error = clEnqueueWriteBuffer(command_queue, stream.padded_row_buffer, CL_FALSE, (padded_row_size-1) * sizeof(cl_int), sizeof(cl_int), &kZero, 0, nullptr, nullptr);
+        CheckError(error);
+
+        for (cl_int depth = levels - 1; depth >= 0; --depth) {
+            error = clSetKernelArg(downsweep_kernel, 0, sizeof(cl_mem), &stream.padded_row_buffer);
+            if (segmented) {
+                error |= clSetKernelArg(downsweep_kernel, 1, sizeof(cl_mem), &profile.segment_flags_buffer);
+                error |= clSetKernelArg(downsweep_kernel, 2, sizeof(cl_mem), &stream.tree_flags_buffer);
+            }
+            error |= clSetKernelArg(downsweep_kernel, segmented ? 3 : 1, sizeof(cl_int), &depth);
+            CheckError(error);
+
+            global = padded_row_size >> (depth + 1);
+            error = clEnqueueNDRangeKernel(command_queue, downsweep_kernel, 1, NULL, &global, nullptr, 0, nullptr, nullptr);
+            CheckError(error);
+        }
+
+        error = clSetKernelArg(stream.h_mat_row_kernel, 0, sizeof(cl_mem), &stream.h_hat_mat_row_buffer);
+        error |= clSetKernelArg(stream.h_mat_row_kernel, 1, sizeof(cl_mem), &stream.padded_row_buffer);
+        error |= clSetKernelArg(stream.h_mat_row_kernel, 2, sizeof(cl_mem), &h_mat_row_buffer);
+        CheckError(error);
+
+        global = row_size;
+        error = clEnqueueNDRangeKernel(command_queue, stream.h_mat_row_kernel, 1, NULL, &global, nullptr, 0, nullptr, nullptr);
+        CheckError(error);
+
+        error = clSetKernelArg(stream.column_max_kernel, 0, sizeof(cl_mem), &h_mat_row_buffer);
+        error |= clSetKernelArg(stream.column_max_kernel, 1, sizeof(cl_mem), &stream.column_max_buffer);
+        CheckError(error);
+
+        error = clEnqueueNDRangeKernel(command_queue, stream.column_max_kernel, 1, NULL, &global, nullptr, 0, nullptr, nullptr);
+        CheckError(error);
+
+        std::swap(f_mat_row_buffer, f_mat_prev_row_buffer);
+        std::swap(h_mat_row_buffer, h_mat_prev_row_buffer);
+        take_snapshots(r);
+    }
+}
+
+void SmithWatermanEngine::RunWavefrontQuery(Stream & stream, const std::string & query, size_t chunk_length, cl_int * best_score, cl_uint * best_end) {
+    cl_command_queue command_queue = stream.command_queue;
+    cl_kernel kernel = stream.wavefront_tile_kernel;
+
+    const size_t rows = query.size();
+    const size_t num_tile_rows = (rows + wavefront_tile_rows_ - 1) / wavefront_tile_rows_;
+    const size_t num_tile_cols = (chunk_length + kWavefrontTileCols - 1) / kWavefrontTileCols;
+
+    cl_int error = clEnqueueWriteBuffer(command_queue, stream.query_buffer, CL_FALSE, 0, rows, query.data(), 0, nullptr, nullptr);
+    CheckError(error);
+
+    ZeroBuffer(stream.border_h_row_buffer, chunk_length, stream.zero_kernel, command_queue);
+    ZeroBuffer(stream.border_f_row_buffer, chunk_length, stream.zero_kernel, command_queue);
+    ZeroBuffer(stream.border_h_col_buffer, rows, stream.zero_kernel, command_queue);
+    ZeroBuffer(stream.border_e_col_buffer, rows, stream.zero_kernel, command_queue);
+    ZeroBuffer(stream.best_score_buffer, rows, stream.zero_kernel, command_queue);
+    ZeroBuffer(stream.best_end_buffer, rows, stream.zero_kernel, command_queue);
+    ZeroBuffer(stream.corner_buffer, num_tile_rows, stream.zero_kernel, command_queue);
+
+    const cl_int query_length = static_cast<cl_int>(rows);
+    const cl_int reference_length = static_cast<cl_int>(chunk_length);
+    const cl_int tile_cols = static_cast<cl_int>(kWavefrontTileCols);
+    const ScoringScheme & scoring = options_.scoring;
+    error = clSetKernelArg(kernel, 0, sizeof(cl_mem), &stream.query_buffer);
+    error |= clSetKernelArg(kernel, 1, sizeof(cl_int), &query_length);
+    error |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &stream.reference_chunk_buffer);
+    error |= clSetKernelArg(kernel, 3, sizeof(cl_int), &reference_length);
+    error |= clSetKernelArg(kernel, 4, sizeof(cl_int), &tile_cols);
+    error |= clSetKernelArg(kernel, 7, sizeof(cl_int), &scoring.match);
+    error |= clSetKernelArg(kernel, 8, sizeof(cl_int), &scoring.mismatch);
+    error |= clSetKernelArg(kernel, 9, sizeof(cl_mem), &stream.border_h_row_buffer);
+    error |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &stream.border_f_row_buffer);
+    error |= clSetKernelArg(kernel, 11, sizeof(cl_mem), &stream.border_h_col_buffer);
+    error |= clSetKernelArg(kernel, 12, sizeof(cl_mem), &stream.border_e_col_buffer);
+    error |= clSetKernelArg(kernel, 13, sizeof(cl_mem), &stream.corner_buffer);
+    error |= clSetKernelArg(kernel, 14, sizeof(cl_mem), &stream.best_score_buffer);
+    error |= clSetKernelArg(kernel, 15, sizeof(cl_mem), &stream.best_end_buffer);
+    error |= clSetKernelArg(kernel, 16, sizeof(cl_int) * 2 * wavefront_tile_rows_, nullptr);
+    error |= clSetKernelArg(kernel, 17, sizeof(cl_int) * 2 * wavefront_tile_rows_, nullptr);
+    CheckError(error);
+
+    // One launch per anti-diagonal of tiles; the in-order queue keeps them in sequence
+    for (size_t diagonal = 0; diagonal + 1 < num_tile_rows + num_tile_cols; ++diagonal) {
+        const size_t first_tile_row = diagonal >= num_tile_cols ? diagonal - (num_tile_cols - 1) : 0;
+        const size_t last_tile_row = std::min(diagonal, num_tile_rows - 1);
+
+        const cl_int diagonal_arg = static_cast<cl_int>(diagonal);
+        const cl_int first_tile_row_arg = static_cast<cl_int>(first_tile_row);
+        error = clSetKernelArg(kernel, 5, sizeof(cl_int), &diagonal_arg);
+        error |= clSetKernelArg(kernel, 6, sizeof(cl_int), &first_tile_row_arg);
+        CheckError(error);
+
+        size_t global = (last_tile_row - first_tile_row + 1) * wavefront_tile_rows_;
+        error = clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL, &global, &wavefront_tile_rows_, 0, nullptr, nullptr);
+        CheckError(error);
+    }
+
+    error = clEnqueueReadBuffer(command_queue, stream.best_score_buffer, CL_FALSE, 0, sizeof(cl_int) * rows, best_score, 0, nullptr, nullptr);
+    CheckError(error);
+    error = clEnqueueReadBuffer(command_queue, stream.best_end_buffer, CL_FALSE, 0, sizeof(cl_int) * rows, best_end, 0, nullptr, nullptr);
+    CheckError(error);
+}
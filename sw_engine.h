@@ -0,0 +1,277 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "alignment_result.h"
+#include "memory_planner.h"
+#include "opencl_utils.h"
+#include "result_cache.h"
+#include "scoring.h"
+
+enum class AlignmentMethod {
+    kAuto,      // per job, see SmithWatermanEngine::ChooseEngine
+    kRowScan,
+    kWavefront,
+};
+
+struct SmithWatermanEngineOptions {
+    size_t platform_index = 0;
+    size_t device_index = 0;
+    ScoringScheme scoring;
+    size_t num_queues = 2;            // jobs on different queues overlap
+    size_t max_cached_references = 2; // references whose device score profiles (every chunk) stay resident
+    AlignmentMethod method = AlignmentMethod::kAuto;
+    size_t prefix_snapshots = 0;      // row scan: rows kept per stream to share query prefixes, 0 for off
+    size_t result_cache_entries = 0;  // results kept in memory, 0 for no result cache
+    std::string result_cache_path;    // file backing the result cache, empty for memory only
+    size_t planned_query_length = 0;  // chunk overlap covers at least queries this long, 0 for each job's own
+    uint64_t max_device_memory = 0;   // device memory the plans may use, 0 for all of it
+    std::string kernel_filename = SW_KERNELS_FILENAME;
+};
+
+struct SmithWatermanEngineStats {
+    uint64_t cells = 0;       // DP cells computed
+    uint64_t cells_saved = 0; // skipped because a query shared rows with an earlier one
+    uint64_t profiles_built = 0; // chunk profiles built and uploaded; a resident reference adds none
+    ResultCacheStats cache;   // all zero without a result cache
+};
+
+// Reusable row-scan aligner. The context, program and kernels are created once; every Submit
+// is an independent job that returns its results through a future.
+//
+// Each of the num_queues streams owns an in-order command queue, its own kernel objects and row
+// buffers, and a host thread that feeds it. Jobs go to the least loaded stream, so while one
+// stream computes job N another is already building and uploading the score profile for job N+1.
+//
+// A job runs either as the row scan (every query row is one pass over the reference with a
+// prefix scan for the horizontal gaps) or as a blocked anti-diagonal wavefront.
+//
+// With prefix_snapshots set, the row scan walks each batch as a trie: queries are taken in
+// sorted order and the H, F and column max rows are copied aside at the rows where later
+// queries branch off, so a prefix shared by several queries is scanned once per chunk.
+//
+// With result_cache_entries set, Submit answers queries it has seen against the same reference
+// and scoring from the result cache, and computes repeats within a batch once; only the rest
+// reach a stream. Segmented jobs always run in full.
+//
+// Every job is planned against the device limits first; references too long for one row are
+// scanned in overlapping chunks, and a job that cannot fit at all fails instead of allocating.
+// The overlap grows with the longest query of the job, so chunks (and the profiles cached for
+// them) only line up across jobs whose queries fit planned_query_length.
+class SmithWatermanEngine {
+public:
+    explicit SmithWatermanEngine(const SmithWatermanEngineOptions & options = SmithWatermanEngineOptions());
+    ~SmithWatermanEngine();
+
+    SmithWatermanEngine(const SmithWatermanEngine & other) = delete;
+    SmithWatermanEngine& operator=(const SmithWatermanEngine & other) = delete;
+
+    // One result per query, in order. The reference is shared, not copied; keep passing the
+    // same pointer to reuse its resident profile.
+    std::future<std::vector<AlignmentResult>> Submit(std::vector<std::string> query_batch, std::shared_ptr<const std::string> reference);
+
+    // Builds and uploads the profiles of reference without aligning anything, so the first job
+    // against it with queries no longer than planned_query_length finds them resident. Never
+    // answered from the result cache; the results are empty.
+    std::future<std::vector<AlignmentResult>> WarmReference(std::shared_ptr<const std::string> reference);
+
+    // Many short references at once: they are packed back to back into as few rows as the plan
+    // allows, each behind a boundary column where the gap scan and H restart, so one row pass
+    // scores a query against all of them. One result per (query, reference), query-major, with
+    // reference_end relative to its own reference. Empty references score 0 without taking a
+    // segment. Always runs as the row scan.
+    std::future<std::vector<AlignmentResult>> SubmitSegmented(std::vector<std::string> query_batch, std::shared_ptr<const std::vector<std::string>> references);
+
+    // Row scan or wavefront for a job of this shape, following options.method.
+    EngineKind ChooseEngine(size_t max_query_length, size_t reference_length);
+
+    // The plan a job of this shape runs with.
+    MemoryPlan PlanJob(EngineKind engine, size_t query_batch, size_t max_query_length, size_t reference_length);
+
+    // The plan a SubmitSegmented job runs with; chunk_length is the most packed columns per row.
+    MemoryPlan PlanSegmentedJob(size_t query_batch, size_t max_query_length, size_t packed_length, size_t longest_reference);
+
+    SmithWatermanEngineStats GetStats();
+
+    cl_context GetContext() { return context_; }
+    cl_device_id GetDeviceId() { return device_id_; }
+    cl_program GetProgram() { return program_; }
+    const ScoringScheme & GetScoring() { return options_.scoring; }
+
+private:
+    // Substitution score rows for one chunk of a reference: row_size ints per query character.
+    // Segmented profiles also carry the boundary column of every packed reference.
+    struct DeviceProfile {
+        ~DeviceProfile();
+
+        size_t chunk_length = 0;
+        cl_mem a_subs_score_row_buffer = nullptr;
+        cl_mem c_subs_score_row_buffer = nullptr;
+        cl_mem g_subs_score_row_buffer = nullptr;
+        cl_mem t_subs_score_row_buffer = nullptr;
+        cl_mem n_subs_score_row_buffer = nullptr; // any other character
+        cl_mem segment_flags_buffer = nullptr;    // padded_row_size ints, 1 at boundary columns
+        cl_mem segment_offsets_buffer = nullptr;  // boundary column of every segment, then row_size
+        size_t num_segments = 0;
+    };
+
+    // A chunk profile in the cache. It goes in before it is built, so streams that want the same
+    // chunk meanwhile wait for it instead of building it again.
+    struct CachedProfile {
+        std::shared_ptr<const std::string> reference;
+        size_t chunk_begin = 0;
+        size_t chunk_length = 0;
+        uint64_t plan_chunk_length = 0;  // the chunking it is cached for; the reference
+        uint64_t plan_chunk_overlap = 0; // planned differently drops it
+        uint64_t bytes = 0;
+        std::shared_future<std::shared_ptr<DeviceProfile>> profile;
+    };
+
+    struct Job {
+        std::vector<std::string> query_batch;
+        std::shared_ptr<const std::string> reference;
+        std::shared_ptr<const std::vector<std::string>> references; // segmented jobs
+        std::promise<std::vector<AlignmentResult>> promise;
+
+        // With the result cache, query_batch holds only the queries to compute. results is the
+        // submitted batch with the hits filled in; scatter maps its other slots to query_batch.
+        bool cached = false;
+        std::vector<ResultCacheKey> keys; // per query_batch entry
+        std::vector<AlignmentResult> results;
+        std::vector<std::pair<size_t, size_t>> scatter;
+    };
+
+    // The H, F and column max rows after query row depth, on the device
+    struct RowSnapshot {
+        size_t depth = 0;
+        cl_mem h_row_buffer = nullptr;
+        cl_mem f_row_buffer = nullptr;
+        cl_mem column_max_buffer = nullptr;
+    };
+
+    struct Stream {
+        cl_command_queue command_queue = nullptr;
+
+        cl_kernel f_mat_and_h_hat_mat_row_kernel = nullptr;
+        cl_kernel upsweep_kernel = nullptr;
+        cl_kernel downsweep_kernel = nullptr;
+        cl_kernel h_mat_row_kernel = nullptr;
+        cl_kernel column_max_kernel = nullptr;
+        cl_kernel reduce_max_kernel = nullptr;
+        cl_kernel zero_kernel = nullptr;
+        cl_kernel wavefront_tile_kernel = nullptr;
+        cl_kernel segmented_upsweep_kernel = nullptr;
+        cl_kernel segmented_downsweep_kernel = nullptr;
+        cl_kernel segment_max_kernel = nullptr;
+
+        // Row scan, sized for the chunk of the current plan
+        size_t capacity = 0;
+        cl_mem f_mat_row_buffer = nullptr;
+        cl_mem f_mat_prev_row_buffer = nullptr;
+        cl_mem h_mat_row_buffer = nullptr;
+        cl_mem h_mat_prev_row_buffer = nullptr;
+        cl_mem h_hat_mat_row_buffer = nullptr;
+        cl_mem padded_row_buffer = nullptr;
+        cl_mem column_max_buffer = nullptr;
+        cl_mem group_max_buffer = nullptr;
+        cl_mem group_index_buffer = nullptr;
+        std::vector<RowSnapshot> snapshots; // options.prefix_snapshots of them
+
+        // Segmented row scan, sized for the packed row of the current plan
+        size_t segment_capacity = 0;
+        cl_mem tree_flags_buffer = nullptr;
+        cl_mem segment_max_buffer = nullptr;
+        cl_mem segment_end_buffer = nullptr;
+
+        // Wavefront, sized for the chunk of the current plan and a query no longer than planned
+        size_t wavefront_columns = 0;
+        size_t wavefront_rows = 0;
+        cl_mem reference_chunk_buffer = nullptr;
+        cl_mem border_h_row_buffer = nullptr;
+        cl_mem border_f_row_buffer = nullptr;
+        cl_mem query_buffer = nullptr;
+        cl_mem border_h_col_buffer = nullptr;
+        cl_mem border_e_col_buffer = nullptr;
+        cl_mem best_score_buffer = nullptr;
+        cl_mem best_end_buffer = nullptr;
+        cl_mem corner_buffer = nullptr;
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::unique_ptr<Job>> jobs;
+        size_t in_flight = 0;
+        bool stop = false;
+        std::thread thread;
+    };
+
+    void StreamLoop(Stream & stream);
+    void RunJob(Stream & stream, Job & job);
+    void RunSegmentedJob(Stream & stream, Job & job);
+    // Fulfils the job with results for its query_batch, through the result cache when it has one.
+    void FinishJob(Job & job, std::vector<AlignmentResult> results);
+    uint64_t GetReferenceId(const std::shared_ptr<const std::string> & reference);
+    // Starts after restore->depth rows when restore is set, and fills every snapshot in save
+    // once its row is done.
+    void ScanQuery(Stream & stream, DeviceProfile & profile, const std::string & query, size_t row_size, size_t padded_row_size,
+                   const RowSnapshot * restore = nullptr, const std::vector<RowSnapshot *> & save = {});
+    void RunQuery(Stream & stream, DeviceProfile & profile, const std::string & query, size_t row_size, size_t padded_row_size, cl_int * group_max, cl_uint * group_index,
+                  const RowSnapshot * restore = nullptr, const std::vector<RowSnapshot *> & save = {});
+    void RunSegmentedQuery(Stream & stream, DeviceProfile & profile, const std::string & query, size_t row_size, size_t padded_row_size, cl_int * segment_max, cl_uint * segment_end);
+    void RunWavefrontQuery(Stream & stream, const std::string & query, size_t chunk_length, cl_int * best_score, cl_uint * best_end);
+    // Reallocate whatever does not match the plan, smaller as well as larger, so a stream never
+    // holds more than the plan of its current job counts.
+    void EnsureCapacity(Stream & stream, size_t row_size);
+    void EnsureWavefrontCapacity(Stream & stream, size_t columns, size_t rows, size_t planned_rows);
+    void EnsureSegmentCapacity(Stream & stream, size_t row_size);
+    void ReleaseRowBuffers(Stream & stream);
+    void ReleaseWavefrontBuffers(Stream & stream);
+    void ReleaseSegmentBuffers(Stream & stream);
+    void Enqueue(std::unique_ptr<Job> job);
+    PlanRequest GetPlanRequest(EngineKind engine, size_t query_batch, size_t max_query_length, size_t reference_length);
+    // Cached only when the plan has room for every chunk of the reference. Builds and uploads
+    // outside profiles_mutex_.
+    std::shared_ptr<DeviceProfile> GetProfile(std::shared_ptr<const std::string> reference, const MemoryPlan & plan, size_t chunk_begin, size_t chunk_length);
+    // Evicts down to max_cached_references references, and on until the cached profiles the plan
+    // does not count fit beside it. Called with profiles_mutex_ held.
+    void TrimProfiles(const std::shared_ptr<const std::string> & reference, const MemoryPlan & plan);
+    // Not cached. Segmented: seq is the references, each one after a separator but the first.
+    std::shared_ptr<DeviceProfile> CreateProfile(const char * seq, size_t length, bool segmented);
+
+    SmithWatermanEngineOptions options_;
+
+    cl_context context_;
+    cl_device_id device_id_;
+    cl_program program_;
+    size_t reduce_local_size_;
+    size_t reduce_num_groups_;
+    size_t wavefront_tile_rows_;
+    cl_uint compute_units_;
+    MemoryBudget budget_;
+
+    std::atomic<uint64_t> cells_;
+    std::atomic<uint64_t> cells_saved_;
+    std::atomic<uint64_t> profiles_built_;
+
+    std::vector<std::unique_ptr<Stream>> streams_;
+
+    std::mutex profiles_mutex_;
+    std::list<CachedProfile> profiles_; // chunks, most recently used first
+
+    std::unique_ptr<ResultCache> result_cache_;
+
+    // Hash of every live reference submitted, so alternating between references never rehashes
+    // them. Keyed by address; the weak_ptr tells a new string at a reused address apart.
+    std::mutex reference_ids_mutex_;
+    std::unordered_map<const std::string *, std::pair<std::weak_ptr<const std::string>, uint64_t>> reference_ids_;
+};
@@ -0,0 +1,297 @@
+#include "synthetic.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+    const uint64_t kDefaultSeed = 0x5eed5eed5eed5eedull;
+    const uint64_t kReadStream = 0x9e3779b97f4a7c15ull; // keeps read generators apart from reference blocks
+    const char kPackedMagic[8] = { 'S', 'W', 'P', 'A', 'C', 'K', '0', '1' };
+    const size_t kBasesPerWord = 32;
+    const size_t kGenerateBlockWords = 1 << 15;  // 1 Mi bases per generator
+    const size_t kUnpackGrainWords = 1 << 15;
+    const size_t kFastaLineWidth = 80;
+    const size_t kFastaPieceLines = 1 << 19;     // written per write call, a multiple of 32 bases
+    const size_t kReadsWriteSize = 16 * 1024 * 1024;
+    const size_t kReadsGrain = 1024;
+    const char kNucleotides[4] = { 'A', 'C', 'G', 'T' };
+
+    uint64_t SplitMix64(uint64_t & state) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    // xoshiro256**, seeded through SplitMix64 from a seed and a stream index
+    class Random {
+    public:
+        Random(uint64_t seed, uint64_t stream) {
+            uint64_t state = seed ^ SplitMix64(stream);
+            for (uint64_t & word : state_) {
+                word = SplitMix64(state);
+            }
+        }
+
+        uint64_t Next() {
+            const uint64_t result = Rotate(state_[1] * 5, 7) * 9;
+            const uint64_t t = state_[1] << 17;
+            state_[2] ^= state_[0];
+            state_[3] ^= state_[1];
+            state_[1] ^= state_[2];
+            state_[0] ^= state_[3];
+            state_[2] ^= t;
+            state_[3] = Rotate(state_[3], 45);
+            return result;
+        }
+
+        // [0, 1) with 53 random bits
+        double Uniform() { return static_cast<double>(Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+        // [0, n), n > 0; the modulo bias is below 2^-40 for any n we sample
+        uint64_t Below(uint64_t n) { return Next() % n; }
+
+    private:
+        static uint64_t Rotate(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+        uint64_t state_[4];
+    };
+
+    int NucleotideCode(char c) {
+        switch (c) {
+            case 'A': return 0;
+            case 'C': return 1;
+            case 'G': return 2;
+            case 'T': return 3;
+            default: return -1;
+        }
+    }
+
+    char GetBase(const PackedSequence & packed, uint64_t k) {
+        return kNucleotides[(packed.words[k / kBasesPerWord] >> (2 * (k % kBasesPerWord))) & 3];
+    }
+
+    void AppendOperation(std::vector<std::pair<char, uint32_t>> & operations, char op) {
+        if (!operations.empty() && operations.back().first == op) {
+            ++operations.back().second;
+        } else {
+            operations.emplace_back(op, 1);
+        }
+    }
+
+    SimulatedRead SimulateRead(const std::string & reference, const ReadSimulationOptions & options, uint64_t index) {
+        Random random(options.seed ^ kReadStream, index);
+        SimulatedRead read;
+
+        const uint64_t last_begin = reference.size() > options.read_length ? reference.size() - options.read_length : 0;
+        read.reference_begin = random.Below(last_begin + 1);
+        read.sequence.reserve(options.read_length);
+
+        std::vector<std::pair<char, uint32_t>> operations;
+        uint64_t position = read.reference_begin;
+        while (read.sequence.size() < options.read_length && position < reference.size()) {
+            // Gaps never open a read, so it always starts on reference_begin
+            const double event = random.Uniform();
+            if (!read.sequence.empty() && event < options.deletion_rate) {
+                ++position;
+                ++read.num_deletions;
+                AppendOperation(operations, 'D');
+                continue;
+            }
+            if (!read.sequence.empty() && event < options.deletion_rate + options.insertion_rate) {
+                read.sequence.push_back(kNucleotides[random.Below(4)]);
+                ++read.num_insertions;
+                AppendOperation(operations, 'I');
+                continue;
+            }
+
+            char base = reference[position++];
+            if (random.Uniform() < options.snp_rate) {
+                const int code = NucleotideCode(base);
+                base = code < 0 ? kNucleotides[random.Below(4)] : kNucleotides[(code + 1 + random.Below(3)) & 3];
+                ++read.num_snps;
+            }
+            read.sequence.push_back(base);
+            AppendOperation(operations, 'M');
+        }
+
+        // A deletion right before the end of the reference aligns nothing
+        if (!operations.empty() && operations.back().first == 'D') {
+            position -= operations.back().second;
+            read.num_deletions -= operations.back().second;
+            operations.pop_back();
+        }
+        read.reference_end = position;
+
+        for (const auto & operation : operations) {
+            read.cigar += std::to_string(operation.second);
+            read.cigar.push_back(operation.first);
+        }
+        return read;
+    }
+
+    void WriteOrThrow(std::ofstream & out, const std::string & filename, const char * data, size_t size) {
+        out.write(data, size);
+        if (!out) {
+            throw std::runtime_error("Could not write " + filename);
+        }
+    }
+}
+
+uint64_t GetSyntheticSeed() {
+    const char * seed = std::getenv("SW_SEED");
+    return seed ? std::stoull(seed, nullptr, 0) : kDefaultSeed;
+}
+
+PackedSequence GenerateReference(ThreadPool & pool, uint64_t seed, uint64_t length) {
+    PackedSequence packed;
+    packed.length = length;
+    packed.words.resize(static_cast<size_t>((length + kBasesPerWord - 1) / kBasesPerWord));
+
+    // Every random word is 32 bases as it stands
+    const size_t num_blocks = (packed.words.size() + kGenerateBlockWords - 1) / kGenerateBlockWords;
+    pool.ParallelFor(0, num_blocks, 1, [&packed, seed](size_t block_begin, size_t block_end) {
+        for (size_t block = block_begin; block < block_end; ++block) {
+            Random random(seed, block);
+            const size_t word_end = std::min((block + 1) * kGenerateBlockWords, packed.words.size());
+            for (size_t w = block * kGenerateBlockWords; w < word_end; ++w) {
+                packed.words[w] = random.Next();
+            }
+        }
+    });
+
+    const size_t tail = static_cast<size_t>(length % kBasesPerWord);
+    if (tail != 0) {
+        packed.words.back() &= (uint64_t(1) << (2 * tail)) - 1;
+    }
+    return packed;
+}
+
+std::string Unpack(ThreadPool & pool, const PackedSequence & packed) {
+    std::string sequence(static_cast<size_t>(packed.length), 'A');
+    pool.ParallelFor(0, packed.words.size(), kUnpackGrainWords, [&packed, &sequence](size_t word_begin, size_t word_end) {
+        for (size_t w = word_begin; w < word_end; ++w) {
+            uint64_t word = packed.words[w];
+            const size_t end = std::min<size_t>((w + 1) * kBasesPerWord, sequence.size());
+            for (size_t k = w * kBasesPerWord; k < end; ++k) {
+                sequence[k] = kNucleotides[word & 3];
+                word >>= 2;
+            }
+        }
+    });
+    return sequence;
+}
+
+void WritePacked(const std::string & filename, const PackedSequence & packed) {
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Could not open " + filename);
+    }
+    WriteOrThrow(out, filename, kPackedMagic, sizeof(kPackedMagic));
+    WriteOrThrow(out, filename, reinterpret_cast<const char *>(&packed.length), sizeof(packed.length));
+    WriteOrThrow(out, filename, reinterpret_cast<const char *>(packed.words.data()), packed.words.size() * sizeof(uint64_t));
+}
+
+PackedSequence ReadPacked(const std::string & filename) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Could not open " + filename);
+    }
+
+    char magic[sizeof(kPackedMagic)];
+    PackedSequence packed;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char *>(&packed.length), sizeof(packed.length));
+    if (!in || std::memcmp(magic, kPackedMagic, sizeof(magic)) != 0) {
+        throw std::runtime_error(filename + " is not a packed sequence");
+    }
+
+    packed.words.resize(static_cast<size_t>((packed.length + kBasesPerWord - 1) / kBasesPerWord));
+    in.read(reinterpret_cast<char *>(packed.words.data()), packed.words.size() * sizeof(uint64_t));
+    if (!in) {
+        throw std::runtime_error(filename + " is truncated");
+    }
+    return packed;
+}
+
+bool IsPackedFile(const std::string & filename) {
+    std::ifstream in(filename, std::ios::binary);
+    char magic[sizeof(kPackedMagic)];
+    return in.read(magic, sizeof(magic)) && std::memcmp(magic, kPackedMagic, sizeof(magic)) == 0;
+}
+
+void WritePackedAsFasta(ThreadPool & pool, const std::string & filename, const std::string & name, const PackedSequence & packed) {
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Could not open " + filename);
+    }
+    const std::string header = ">" + name + "\n";
+    WriteOrThrow(out, filename, header.data(), header.size());
+
+    const uint64_t num_lines = (packed.length + kFastaLineWidth - 1) / kFastaLineWidth;
+    std::vector<char> piece;
+    for (uint64_t first_line = 0; first_line < num_lines; first_line += kFastaPieceLines) {
+        const size_t lines = static_cast<size_t>(std::min<uint64_t>(kFastaPieceLines, num_lines - first_line));
+        const uint64_t first_base = first_line * kFastaLineWidth;
+        const uint64_t piece_bases = std::min<uint64_t>(lines * kFastaLineWidth, packed.length - first_base);
+        piece.resize(static_cast<size_t>(piece_bases) + lines);
+
+        pool.ParallelFor(0, lines, 4096, [&](size_t line_begin, size_t line_end) {
+            for (size_t line = line_begin; line < line_end; ++line) {
+                const uint64_t begin = first_base + line * kFastaLineWidth;
+                const uint64_t end = std::min<uint64_t>(begin + kFastaLineWidth, packed.length);
+                char * text = piece.data() + line * (kFastaLineWidth + 1);
+                for (uint64_t k = begin; k < end; ++k) {
+                    *text++ = GetBase(packed, k);
+                }
+                *text = '\n';
+            }
+        });
+        WriteOrThrow(out, filename, piece.data(), piece.size());
+    }
+}
+
+std::vector<SimulatedRead> SimulateReads(ThreadPool & pool, const std::string & reference, const ReadSimulationOptions & options) {
+    if (reference.empty()) {
+        throw std::runtime_error("Cannot sample reads from an empty reference");
+    }
+
+    std::vector<SimulatedRead> reads(options.num_reads);
+    pool.ParallelFor(0, reads.size(), kReadsGrain, [&](size_t read_begin, size_t read_end) {
+        for (size_t k = read_begin; k < read_end; ++k) {
+            reads[k] = SimulateRead(reference, options, k);
+        }
+    });
+    return reads;
+}
+
+void WriteSimulatedReads(const std::string & fasta_filename, const std::string & truth_filename, const std::vector<SimulatedRead> & reads) {
+    std::ofstream fasta(fasta_filename, std::ios::binary | std::ios::trunc);
+    std::ofstream truth(truth_filename, std::ios::binary | std::ios::trunc);
+    if (!fasta || !truth) {
+        throw std::runtime_error("Could not open " + std::string(!fasta ? fasta_filename : truth_filename));
+    }
+
+    std::string fasta_buffer;
+    std::string truth_buffer = "#name\treference_begin\treference_end\tcigar\tsnps\tinsertions\tdeletions\n";
+    for (size_t k = 0; k < reads.size(); ++k) {
+        const SimulatedRead & read = reads[k];
+        const std::string name = "read" + std::to_string(k);
+        fasta_buffer += ">" + name + "\n" + read.sequence + "\n";
+        truth_buffer += name + "\t" + std::to_string(read.reference_begin) + "\t" + std::to_string(read.reference_end) + "\t" + read.cigar
+                        + "\t" + std::to_string(read.num_snps) + "\t" + std::to_string(read.num_insertions) + "\t" + std::to_string(read.num_deletions) + "\n";
+
+        if (fasta_buffer.size() >= kReadsWriteSize || k + 1 == reads.size()) {
+            WriteOrThrow(fasta, fasta_filename, fasta_buffer.data(), fasta_buffer.size());
+            WriteOrThrow(truth, truth_filename, truth_buffer.data(), truth_buffer.size());
+            fasta_buffer.clear();
+            truth_buffer.clear();
+        }
+    }
+    if (reads.empty()) {
+        WriteOrThrow(truth, truth_filename, truth_buffer.data(), truth_buffer.size());
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+// Seed for synthetic data: SW_SEED when set, otherwise a fixed default, so runs are repeatable.
+uint64_t GetSyntheticSeed();
+
+// Nucleotides at 2 bits each, A C G T = 0 1 2 3, 32 to a word with the first in the low bits.
+struct PackedSequence {
+    uint64_t length = 0;
+    std::vector<uint64_t> words;
+};
+
+// Uniform random A/C/G/T. The reference is cut into fixed blocks, each with its own generator
+// derived from seed and the block index, so the output depends only on seed and length and not
+// on the number of threads that produced it.
+PackedSequence GenerateReference(ThreadPool & pool, uint64_t seed, uint64_t length);
+
+std::string Unpack(ThreadPool & pool, const PackedSequence & packed);
+
+// "SWPACK01", uint64 length, then the words, native byte order. A quarter of the FASTA size.
+void WritePacked(const std::string & filename, const PackedSequence & packed);
+PackedSequence ReadPacked(const std::string & filename);
+bool IsPackedFile(const std::string & filename);
+
+// Line-wrapped FASTA, written in large pieces straight from the packed form.
+void WritePackedAsFasta(ThreadPool & pool, const std::string & filename, const std::string & name, const PackedSequence & packed);
+
+struct ReadSimulationOptions {
+    size_t num_reads = 1000;
+    size_t read_length = 150;
+    double snp_rate = 0.001;       // per read base, substituted by one of the other three
+    double insertion_rate = 0.0001; // per read base, a random base not in the reference
+    double deletion_rate = 0.0001;  // per read base, a reference base skipped
+    uint64_t seed = 0;
+};
+
+// A read and where it truly came from: reference[reference_begin, reference_end) aligned as
+// cigar (M, I and D operations). Reads only come short at the end of the reference.
+struct SimulatedRead {
+    std::string sequence;
+    uint64_t reference_begin = 0;
+    uint64_t reference_end = 0;
+    std::string cigar;
+    uint32_t num_snps = 0;
+    uint32_t num_insertions = 0;
+    uint32_t num_deletions = 0;
+};
+
+// Read k is drawn from its own generator, seeded from options.seed and k, so every read is
+// reproducible on its own and the reads are sampled in parallel.
+std::vector<SimulatedRead> SimulateReads(ThreadPool & pool, const std::string & reference, const ReadSimulationOptions & options);
+
+// FASTA of the reads named read<k>, and next to it a table of name, begin, end, CIGAR and
+// mutation counts to check alignments against.
+void WriteSimulatedReads(const std::string & fasta_filename, const std::string & truth_filename, const std::vector<SimulatedRead> & reads);
@@ -0,0 +1,726 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "cpu_sw.h"
+#include "database_search.h"
+#include "fasta.h"
+#include "hit_writer.h"
+#include "memory_planner.h"
+#include "result_cache.h"
+#include "sw_engine.h"
+#include "synthetic.h"
+#include "thread_pool.h"
+
+// Host-side checks: planning, file formats and the CPU reference. The engine tests also need an
+// OpenCL platform and pass without checking anything where there is none.
+// Each test reports its failed checks and the run exits non-zero if there were any.
+
+namespace {
+    int failed_checks = 0;
+
+#define CHECK(condition) Check((condition), #condition, __FILE__, __LINE__)
+
+    void Check(bool condition, const char * expression, const char * file, int line) {
+        if (!condition) {
+            std::cerr << file << ":" << line << ": check failed: " << expression << std::endl;
+            ++failed_checks;
+        }
+    }
+
+    // Files go in a directory of their own, made on first use and removed at the end of the run
+    std::string temp_directory;
+
+    std::string GetTempPath(const std::string & name) {
+        if (temp_directory.empty()) {
+            const char * tmpdir = std::getenv("TMPDIR");
+            std::string pattern = std::string(tmpdir ? tmpdir : "/tmp") + "/sw_tests_XXXXXX";
+            if (!mkdtemp(&pattern[0])) {
+                throw std::runtime_error("Could not create a directory for test files");
+            }
+            temp_directory = pattern;
+        }
+        return temp_directory + "/" + name;
+    }
+
+    long GetFileSize(const std::string & path) {
+        FILE * file = std::fopen(path.c_str(), "rb");
+        if (!file) {
+            return -1;
+        }
+        std::fseek(file, 0, SEEK_END);
+        const long size = std::ftell(file);
+        std::fclose(file);
+        return size;
+    }
+
+    MemoryBudget GetTestBudget(cl_ulong max_mem_alloc_size) {
+        MemoryBudget budget;
+        budget.device_global_mem_size = 1ull << 30;
+        budget.device_max_mem_alloc_size = max_mem_alloc_size;
+        budget.host_mem_size = 1ull << 30;
+        return budget;
+    }
+
+    void TestMemoryPlannerWholeReference() {
+        PlanRequest request;
+        request.max_query_length = 100;
+        request.reference_length = 10000;
+        request.reduce_num_groups = 64;
+
+        const MemoryPlan plan = PlanMemory(request, GetTestBudget(1 << 20));
+        CHECK(plan.fits);
+        CHECK(plan.num_chunks == 1);
+        CHECK(plan.chunk_length == request.reference_length);
+        CHECK(plan.chunk_overlap == 0);
+        CHECK(plan.padded_row_size == 16384);
+    }
+
+    void TestMemoryPlannerChunks() {
+        PlanRequest request;
+        request.max_query_length = 100;
+        request.reference_length = 100000;
+        request.reduce_num_groups = 64;
+
+        // No buffer may exceed 64 KiB, so a row holds at most 16384 ints
+        const MemoryBudget budget = GetTestBudget(1 << 16);
+        const MemoryPlan plan = PlanMemory(request, budget);
+        CHECK(plan.fits);
+        CHECK(plan.padded_row_size == 16384);
+        CHECK(plan.chunk_length == 16383);
+        CHECK(plan.chunk_overlap == GetChunkOverlap(request.max_query_length, request.scoring));
+        CHECK(plan.chunk_overlap == 600); // 100 residues plus 5 * 100 / 1 gap columns
+        CHECK(plan.largest_allocation <= budget.device_max_mem_alloc_size);
+        CHECK(plan.device_bytes <= plan.device_budget);
+
+        // The chunks cover the reference, each starting one overlap before the previous one ends,
+        // and the last one is needed
+        CHECK(plan.num_chunks == 7);
+        for (size_t chunk = 1; chunk < plan.num_chunks; ++chunk) {
+            CHECK(plan.GetChunkBegin(chunk) + plan.chunk_overlap == plan.GetChunkBegin(chunk - 1) + plan.chunk_length);
+        }
+        CHECK(plan.GetChunkBegin(plan.num_chunks - 1) + plan.chunk_length >= request.reference_length);
+        CHECK(plan.GetChunkBegin(plan.num_chunks - 2) + plan.chunk_length < request.reference_length);
+
+        uint64_t device_bytes = 0;
+        for (const auto & buffer : plan.device_buffers) {
+            device_bytes += buffer.bytes * buffer.count;
+        }
+        CHECK(device_bytes == plan.device_bytes);
+    }
+
+    void TestMemoryPlannerDoesNotFit() {
+        PlanRequest request;
+        request.max_query_length = 10000;
+        request.reference_length = 100000;
+        request.reduce_num_groups = 64;
+
+        // Chunks of at most 255 residues cannot advance past an overlap of 60000
+        const MemoryPlan plan = PlanMemory(request, GetTestBudget(1 << 10));
+        CHECK(!plan.fits);
+    }
+
+    bool HasOpenClPlatform() {
+        cl_uint num_platforms = 0;
+        return clGetPlatformIDs(0, nullptr, &num_platforms) == CL_SUCCESS && num_platforms > 0;
+    }
+
+    void TestEngineWarmedReference() {
+        if (!HasOpenClPlatform()) {
+            return;
+        }
+
+        // 8 MiB of device memory holds a row scan of this reference only in chunks, and all of
+        // their profiles besides
+        SmithWatermanEngineOptions options;
+        options.max_cached_references = 1;
+        options.planned_query_length = 100;
+        options.max_device_memory = 8 << 20;
+        SmithWatermanEngine engine(options);
+
+        ThreadPool pool(1);
+        auto reference = std::make_shared<const std::string>(Unpack(pool, GenerateReference(pool, 7, 100000)));
+        auto other = std::make_shared<const std::string>(Unpack(pool, GenerateReference(pool, 8, 1000)));
+        const MemoryPlan plan = engine.PlanJob(EngineKind::kRowScan, 1, options.planned_query_length, reference->size());
+        CHECK(plan.fits);
+        CHECK(plan.profiles_cached);
+        CHECK(plan.num_chunks > 1);
+
+        engine.WarmReference(reference).get();
+        const uint64_t built = engine.GetStats().profiles_built;
+        CHECK(built == plan.num_chunks);
+
+        std::vector<std::string> queries;
+        for (size_t begin : { 10u, 50000u, 99900u }) {
+            queries.push_back(reference->substr(begin, 100));
+        }
+        queries.push_back("ACGTTGCAACGTTGCA");
+
+        const std::vector<AlignmentResult> results = engine.Submit(queries, reference).get();
+        CHECK(engine.GetStats().profiles_built == built);
+        CHECK(results.size() == queries.size());
+        for (size_t q = 0; q < results.size() && q < queries.size(); ++q) {
+            const AlignmentResult expected = CpuSmithWaterman(queries[q], reference->data(), 0, reference->size(), engine.GetScoring());
+            CHECK(results[q].score == expected.score);
+            CHECK(results[q].reference_end == expected.reference_end);
+        }
+
+        // Another reference evicts every chunk of the first one
+        engine.Submit(queries, other).get();
+        CHECK(engine.GetStats().profiles_built == built + 1);
+        engine.Submit(queries, reference).get();
+        CHECK(engine.GetStats().profiles_built == 2 * built + 1);
+    }
+
+    void TestDatabaseSearchTopHits() {
+        if (!HasOpenClPlatform()) {
+            return;
+        }
+
+        // The engine's program holds the database kernel too
+        SmithWatermanEngine engine;
+        cl_int error = CL_SUCCESS;
+        cl_command_queue command_queue = clCreateCommandQueue(engine.GetContext(), engine.GetDeviceId(), 0, &error);
+        CheckError(error);
+
+        // Lengths from 1 to 200 in batches of 4 lanes, so every batch pads its shorter lanes and
+        // the last one is short of sequences; the copy of seq5 ties with it
+        ThreadPool pool(1);
+        const std::string source = Unpack(pool, GenerateReference(pool, 11, 6000));
+        std::vector<FastaRecord> database;
+        for (size_t k = 0; k < 23; ++k) {
+            database.push_back(FastaRecord { "seq" + std::to_string(k), source.substr(k * 211, 1 + k * 37 % 200) });
+        }
+        database.push_back(FastaRecord { "copy5", database[5].sequence });
+        const std::string query = source.substr(5 * 211 + 20, 60);
+        const size_t top_n = 10;
+
+        std::vector<DatabaseHit> hits;
+        {
+            DatabaseSearch search(engine.GetContext(), engine.GetDeviceId(), command_queue, engine.GetProgram(), database, 4);
+            hits = search.Search(query, engine.GetScoring(), top_n);
+        }
+        clReleaseCommandQueue(command_queue);
+
+        // Best first, ties in database order
+        std::vector<std::pair<int32_t, size_t>> expected;
+        for (size_t k = 0; k < database.size(); ++k) {
+            const std::string & sequence = database[k].sequence;
+            expected.emplace_back(CpuSmithWaterman(query, sequence.data(), 0, sequence.size(), engine.GetScoring()).score, k);
+        }
+        std::stable_sort(expected.begin(), expected.end(), [](const std::pair<int32_t, size_t> & lhs, const std::pair<int32_t, size_t> & rhs) {
+            return lhs.first > rhs.first;
+        });
+
+        CHECK(hits.size() == top_n);
+        for (size_t k = 0; k < hits.size() && k < top_n; ++k) {
+            CHECK(hits[k].score == expected[k].first);
+            CHECK(hits[k].sequence_index == expected[k].second);
+            CHECK(hits[k].name == database[expected[k].second].name);
+            CHECK(hits[k].length == database[expected[k].second].sequence.size());
+        }
+        CHECK(hits.size() > 1 && hits[0].name == "seq5" && hits[1].name == "copy5");
+    }
+
+    void TestCpuSmithWatermanMatrix() {
+        // H by hand for the default scheme (match 5, mismatch -3, a gap of k costs 8 + k). The
+        // best path is ACGT, a one column gap over the extra T, then ACGT: 40 - 9 = 31.
+        const std::string query = "ACGTACGT";
+        const std::string reference = "ACGTTACGT";
+        const int h[8][9] = {
+            { 5,  0,  0,  0,  0,  5,  0,  0,  0 },
+            { 0, 10,  1,  0,  0,  0, 10,  1,  0 },
+            { 0,  1, 15,  6,  5,  4,  3, 15,  6 },
+            { 0,  0,  6, 20, 11, 10,  9,  8, 20 },
+            { 5,  0,  5, 11, 17, 16,  7,  6, 11 },
+            { 0, 10,  4, 10,  8, 14, 21, 12, 11 },
+            { 0,  1, 15,  9,  7,  6, 12, 26, 17 },
+            { 0,  0,  6, 20, 14, 10, 11, 17, 31 },
+        };
+        const ScoringScheme scoring;
+
+        // Aligning a query prefix against a reference prefix gives the best H in that corner
+        for (size_t rows = 1; rows <= query.size(); ++rows) {
+            for (size_t columns = 1; columns <= reference.size(); ++columns) {
+                int best = 0;
+                for (size_t i = 0; i < rows; ++i) {
+                    for (size_t j = 0; j < columns; ++j) {
+                        best = std::max(best, h[i][j]);
+                    }
+                }
+                CHECK(CpuSmithWaterman(query.substr(0, rows), reference.data(), 0, columns, scoring).score == best);
+            }
+        }
+
+        const AlignmentResult result = CpuSmithWaterman(query, reference.data(), 0, reference.size(), scoring);
+        CHECK(result.score == 31);
+        CHECK(result.reference_end == 9);
+
+        // A window of the reference, with the end still counted from its start
+        const AlignmentResult window = CpuSmithWaterman(query, reference.data(), 5, reference.size(), scoring);
+        CHECK(window.score == 20);
+        CHECK(window.reference_end == 9);
+
+        // N never matches, not even N
+        CHECK(CpuSmithWaterman("NNNN", "NNNN", 0, 4, scoring).score == 0);
+    }
+
+    void TestFastaFromPipe() {
+        const std::string text = ">chr1 first\nacgt\nACGN\n;comment\n>chr2\n\n>chr3\nTTTT";
+        const std::string path = GetTempPath("reads.fifo");
+        CHECK(mkfifo(path.c_str(), 0600) == 0);
+
+        // A FIFO cannot be sized up front, so this takes the read-through path
+        std::thread writer([&]() {
+            std::ofstream output(path, std::ios_base::binary);
+            output << text;
+        });
+        std::vector<FastaRecord> records;
+        try {
+            records = ReadFasta(path);
+        } catch (...) {
+            writer.join();
+            std::remove(path.c_str());
+            throw;
+        }
+        writer.join();
+        std::remove(path.c_str());
+
+        CHECK(records.size() == 3);
+        if (records.size() == 3) {
+            CHECK(records[0].name == "chr1");
+            CHECK(records[0].sequence == "ACGTACGN");
+            CHECK(records[1].name == "chr2");
+            CHECK(records[1].sequence.empty());
+            CHECK(records[2].name == "chr3");
+            CHECK(records[2].sequence == "TTTT");
+        }
+    }
+
+    void TestCheckpointRoundTrip() {
+        RowScanCheckpoint checkpoint;
+        checkpoint.reference_hash = 0x0123456789abcdefull;
+        checkpoint.reference_length = 1ull << 40;
+        checkpoint.query_hash = 42;
+        checkpoint.scoring.match = 2;
+        checkpoint.scoring.mismatch = -7;
+        checkpoint.scoring.gap_start_penalty = -11;
+        checkpoint.scoring.gap_extend_penalty = -2;
+        checkpoint.chunk_length = 16383;
+        checkpoint.chunk_overlap = 600;
+        checkpoint.chunk = 3;
+        checkpoint.row = 17;
+        checkpoint.best.score = 123;
+        checkpoint.best.reference_end = 987654321;
+        // Around every varint length boundary, both signs, and the extremes
+        checkpoint.h_prev_row = { 0, 1, -1, 63, -64, 64, -65, 8191, -8192, 8192, 1 << 20, -(1 << 27),
+                                  std::numeric_limits<int32_t>::max(), std::numeric_limits<int32_t>::min() };
+        checkpoint.f_prev_row = { -9, -9, -10, 0 };
+        checkpoint.column_max = {};
+
+        const std::string path = GetTempPath("checkpoint");
+        RowScanCheckpoint read;
+        CHECK(!ReadCheckpoint(path, read));
+
+        WriteCheckpoint(path, checkpoint);
+        CHECK(access((path + ".tmp").c_str(), F_OK) != 0);
+        CHECK(ReadCheckpoint(path, read));
+        CHECK(read.reference_hash == checkpoint.reference_hash);
+        CHECK(read.reference_length == checkpoint.reference_length);
+        CHECK(read.query_hash == checkpoint.query_hash);
+        CHECK(read.scoring.match == checkpoint.scoring.match);
+        CHECK(read.scoring.mismatch == checkpoint.scoring.mismatch);
+        CHECK(read.scoring.gap_start_penalty == checkpoint.scoring.gap_start_penalty);
+        CHECK(read.scoring.gap_extend_penalty == checkpoint.scoring.gap_extend_penalty);
+        CHECK(read.chunk_length == checkpoint.chunk_length);
+        CHECK(read.chunk_overlap == checkpoint.chunk_overlap);
+        CHECK(read.chunk == checkpoint.chunk);
+        CHECK(read.row == checkpoint.row);
+        CHECK(read.best.score == checkpoint.best.score);
+        CHECK(read.best.reference_end == checkpoint.best.reference_end);
+        CHECK(read.h_prev_row == checkpoint.h_prev_row);
+        CHECK(read.f_prev_row == checkpoint.f_prev_row);
+        CHECK(read.column_max == checkpoint.column_max);
+
+        // Small values take a byte each: magic, 84 fixed bytes, three row lengths and 4 values
+        const long expected_size = 8 + 84 + 3 * 8 + 4;
+        checkpoint.h_prev_row.clear();
+        WriteCheckpoint(path, checkpoint);
+        CHECK(GetFileSize(path) == expected_size);
+
+        CHECK(truncate(path.c_str(), expected_size - 1) == 0);
+        bool threw = false;
+        try {
+            ReadCheckpoint(path, read);
+        } catch (const std::runtime_error &) {
+            threw = true;
+        }
+        CHECK(threw);
+
+        std::remove(path.c_str());
+    }
+
+    ResultCacheKey GetTestKey(uint64_t query_hash) {
+        ResultCacheKey key;
+        key.query_hash = query_hash;
+        key.query_length = 150;
+        key.reference_id = 7;
+        key.reference_begin = 0;
+        key.reference_end = 5000;
+        return key;
+    }
+
+    AlignmentResult GetTestResult(int32_t score) {
+        AlignmentResult result;
+        result.score = score;
+        result.reference_end = 1000 + score;
+        return result;
+    }
+
+    void TestResultCacheKey() {
+        const ResultCacheKey key = GetTestKey(1);
+        CHECK(key == GetTestKey(1));
+        CHECK(ResultCacheKeyHash()(key) == ResultCacheKeyHash()(GetTestKey(1)));
+
+        // Every field takes part
+        std::vector<ResultCacheKey> others(9, key);
+        ++others[0].query_hash;
+        ++others[1].query_length;
+        ++others[2].reference_id;
+        ++others[3].reference_begin;
+        ++others[4].reference_end;
+        ++others[5].scoring.match;
+        ++others[6].scoring.mismatch;
+        ++others[7].scoring.gap_start_penalty;
+        ++others[8].scoring.gap_extend_penalty;
+
+        ResultCache cache(16);
+        cache.Insert(key, GetTestResult(10));
+        for (const ResultCacheKey & other : others) {
+            CHECK(!(other == key));
+            CHECK(ResultCacheKeyHash()(other) != ResultCacheKeyHash()(key));
+            AlignmentResult result;
+            CHECK(!cache.Lookup(other, result));
+        }
+
+        AlignmentResult result;
+        CHECK(cache.Lookup(key, result));
+        CHECK(result.score == 10 && result.reference_end == 1010);
+    }
+
+    void TestResultCacheEviction() {
+        ResultCache cache(2);
+        cache.Insert(GetTestKey(1), GetTestResult(1));
+        cache.Insert(GetTestKey(2), GetTestResult(2));
+        AlignmentResult result;
+        CHECK(cache.Lookup(GetTestKey(1), result)); // now the most recently used
+        cache.Insert(GetTestKey(3), GetTestResult(3));
+
+        CHECK(cache.Lookup(GetTestKey(1), result));
+        CHECK(!cache.Lookup(GetTestKey(2), result));
+        CHECK(cache.Lookup(GetTestKey(3), result));
+
+        const ResultCacheStats stats = cache.GetStats();
+        CHECK(stats.memory_hits == 3);
+        CHECK(stats.misses == 1);
+        CHECK(stats.memory_entries == 2);
+    }
+
+    void TestResultCacheDisk() {
+        const std::string path = GetTempPath("result_cache");
+        const long record_size = 68;
+        {
+            ResultCache cache(1, path);
+            for (uint64_t k = 1; k <= 3; ++k) {
+                cache.Insert(GetTestKey(k), GetTestResult(static_cast<int32_t>(k)));
+            }
+            cache.Insert(GetTestKey(2), GetTestResult(2)); // already on disk, not appended again
+        }
+        CHECK(GetFileSize(path) == 8 + 3 * record_size);
+
+        // A record cut short, as a crash in the middle of an append leaves it
+        FILE * file = std::fopen(path.c_str(), "ab");
+        CHECK(file != nullptr);
+        if (file) {
+            const char partial[record_size / 2] = {};
+            std::fwrite(partial, 1, sizeof(partial), file);
+            std::fclose(file);
+        }
+
+        {
+            ResultCache cache(1, path);
+            CHECK(GetFileSize(path) == 8 + 3 * record_size);
+            CHECK(cache.GetStats().disk_entries == 3);
+
+            // Memory only holds one entry, so all but the last lookup come from the file
+            for (uint64_t k = 1; k <= 3; ++k) {
+                AlignmentResult result;
+                CHECK(cache.Lookup(GetTestKey(k), result));
+                CHECK(result.score == static_cast<int32_t>(k));
+                CHECK(result.reference_end == 1000 + k);
+            }
+            AlignmentResult result;
+            CHECK(!cache.Lookup(GetTestKey(4), result));
+            CHECK(cache.GetStats().disk_hits == 3);
+
+            cache.Insert(GetTestKey(4), GetTestResult(4));
+        }
+        CHECK(GetFileSize(path) == 8 + 4 * record_size);
+
+        {
+            ResultCache cache(1, path);
+            AlignmentResult result;
+            CHECK(cache.Lookup(GetTestKey(4), result));
+            CHECK(result.score == 4);
+        }
+
+        // Anything else is refused rather than overwritten
+        file = std::fopen(path.c_str(), "wb");
+        if (file) {
+            std::fputs("not a cache", file);
+            std::fclose(file);
+        }
+        bool threw = false;
+        try {
+            ResultCache cache(1, path);
+        } catch (const std::runtime_error &) {
+            threw = true;
+        }
+        CHECK(threw);
+
+        std::remove(path.c_str());
+    }
+
+    std::string ReadFile(const std::string & path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    }
+
+    // One hit with a traceback, one without, and one that did not align
+    std::string WriteTestHits(const std::string & path, HitFormat format) {
+        std::vector<Hit> hits(3);
+        hits[0].query_index = 0;
+        hits[0].reference_index = 1;
+        hits[0].score = 42;
+        hits[0].reference_begin = 99;
+        hits[0].reference_end = 120;
+        hits[0].cigar = "10M1D10M";
+        hits[1].query_index = 1;
+        hits[1].reference_index = 0;
+        hits[1].score = 17;
+        hits[1].reference_end = 3000000000ull;
+        hits[2].query_index = 1;
+        hits[2].reference_index = 1;
+
+        HitWriter writer(path, format, { "read0", "read1" }, { "chr1", "chr2" }, { 5000, 4000000000ull });
+        writer.Write({ hits[0] });
+        writer.Write({ hits[1], hits[2] });
+        writer.Close();
+        const HitWriterStats stats = writer.GetStats();
+        CHECK(stats.hits == 3);
+        CHECK(stats.batches == 2);
+
+        const std::string contents = ReadFile(path);
+        CHECK(stats.bytes == contents.size());
+        std::remove(path.c_str());
+        return contents;
+    }
+
+    void TestHitWriterFormats() {
+        CHECK(GetHitFormat("out.sam") == HitFormat::kSam);
+        CHECK(GetHitFormat("out.hits") == HitFormat::kBinary);
+        CHECK(GetHitFormat("out.tsv") == HitFormat::kTabular);
+        CHECK(GetHitFormat("-") == HitFormat::kTabular);
+
+        CHECK(WriteTestHits(GetTempPath("hits.tsv"), HitFormat::kTabular) ==
+              "#query\treference\tscore\treference_begin\treference_end\tcigar\n"
+              "read0\tchr2\t42\t99\t120\t10M1D10M\n"
+              "read1\tchr1\t17\t*\t3000000000\t*\n"
+              "read1\tchr2\t0\t*\t0\t*\n");
+
+        // Only the hit with a CIGAR is mapped; the others keep their score and end in the tags
+        CHECK(WriteTestHits(GetTempPath("hits.sam"), HitFormat::kSam) ==
+              "@HD\tVN:1.6\tSO:unsorted\n"
+              "@SQ\tSN:chr1\tLN:5000\n"
+              "@SQ\tSN:chr2\tLN:4000000000\n"
+              "@PG\tID:SmithWatermanOpenCL\tPN:main\n"
+              "read0\t0\tchr2\t100\t255\t10M1D10M\t*\t0\t0\t*\t*\tAS:i:42\tXE:i:120\n"
+              "read1\t4\t*\t0\t0\t*\t*\t0\t0\t*\t*\tAS:i:17\tXE:i:3000000000\n"
+              "read1\t4\t*\t0\t0\t*\t*\t0\t0\t*\t*\tAS:i:0\tXE:i:0\n");
+
+        const std::string binary = WriteTestHits(GetTempPath("hits.hits"), HitFormat::kBinary);
+        const size_t record_size = 3 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+        CHECK(binary.size() == 8 + 3 * record_size);
+        CHECK(binary.compare(0, 8, "SWHITS01") == 0);
+        if (binary.size() == 8 + 3 * record_size) {
+            const char * record = binary.data() + 8 + record_size; // the second hit
+            uint32_t query_index, reference_index;
+            int32_t score;
+            uint64_t reference_begin, reference_end;
+            std::memcpy(&query_index, record, sizeof(query_index));
+            std::memcpy(&reference_index, record + 4, sizeof(reference_index));
+            std::memcpy(&score, record + 8, sizeof(score));
+            std::memcpy(&reference_begin, record + 12, sizeof(reference_begin));
+            std::memcpy(&reference_end, record + 20, sizeof(reference_end));
+            CHECK(query_index == 1);
+            CHECK(reference_index == 0);
+            CHECK(score == 17);
+            CHECK(reference_begin == 0);
+            CHECK(reference_end == 3000000000ull);
+        }
+    }
+
+    void TestThreadPoolNestedWork() {
+        ThreadPool pool(3);
+        const size_t n = 64;
+        std::unique_ptr<std::atomic<int>[]> runs(new std::atomic<int>[n * n]());
+
+        // Every outer piece waits on inner pieces from a worker; with more outer pieces than
+        // workers, a waiting worker that did not run queued tasks would deadlock the pool
+        pool.ParallelFor(0, n, 1, [&](size_t outer_begin, size_t outer_end) {
+            for (size_t i = outer_begin; i < outer_end; ++i) {
+                pool.ParallelFor(0, n, 4, [&runs, n, i](size_t begin, size_t end) {
+                    for (size_t j = begin; j < end; ++j) {
+                        ++runs[i * n + j];
+                    }
+                });
+            }
+        });
+
+        size_t ran_once = 0;
+        for (size_t k = 0; k < n * n; ++k) {
+            ran_once += runs[k] == 1 ? 1 : 0;
+        }
+        CHECK(ran_once == n * n);
+
+        // Tasks long enough that a thread outside the pool runs out of work and sleeps on them
+        std::vector<int> results(16, -1);
+        std::thread outside([&]() {
+            std::vector<std::future<int>> futures;
+            for (int k = 0; k < 16; ++k) {
+                futures.push_back(pool.Submit([k]() {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                    return k;
+                }));
+            }
+            for (int k = 0; k < 16; ++k) {
+                results[k] = pool.WaitFor(futures[k]);
+            }
+        });
+        outside.join();
+
+        for (int k = 0; k < 16; ++k) {
+            CHECK(results[k] == k);
+        }
+    }
+
+    void TestSyntheticDeterminism() {
+        // Three whole generator blocks and a partial one, so every thread count splits it differently
+        const uint64_t length = 3 * (1 << 20) + 12345;
+        const uint64_t seed = 12345;
+        ThreadPool one_thread(1);
+        ThreadPool three_threads(3);
+        ThreadPool eight_threads(8);
+
+        const PackedSequence packed = GenerateReference(one_thread, seed, length);
+        CHECK(packed.length == length);
+        CHECK(packed.words.size() == (length + 31) / 32);
+        CHECK(GenerateReference(three_threads, seed, length).words == packed.words);
+        CHECK(GenerateReference(eight_threads, seed, length).words == packed.words);
+        CHECK(GenerateReference(eight_threads, seed + 1, length).words != packed.words);
+
+        const std::string reference = Unpack(one_thread, packed);
+        CHECK(reference.size() == length);
+        CHECK(reference.find_first_not_of("ACGT") == std::string::npos);
+        CHECK(Unpack(eight_threads, packed) == reference);
+
+        const std::string path = GetTempPath("reference.pack");
+        WritePacked(path, packed);
+        CHECK(IsPackedFile(path));
+        const PackedSequence read = ReadPacked(path);
+        CHECK(read.length == packed.length);
+        CHECK(read.words == packed.words);
+        std::remove(path.c_str());
+
+        ReadSimulationOptions options;
+        options.num_reads = 5000;
+        options.snp_rate = 0.01;
+        options.seed = seed;
+        const std::vector<SimulatedRead> reads = SimulateReads(one_thread, reference, options);
+        const std::vector<SimulatedRead> parallel_reads = SimulateReads(eight_threads, reference, options);
+        CHECK(reads.size() == options.num_reads);
+        CHECK(parallel_reads.size() == reads.size());
+
+        size_t num_exact = 0;
+        for (size_t k = 0; k < reads.size() && k < parallel_reads.size(); ++k) {
+            CHECK(parallel_reads[k].sequence == reads[k].sequence);
+            CHECK(parallel_reads[k].reference_begin == reads[k].reference_begin);
+            CHECK(parallel_reads[k].cigar == reads[k].cigar);
+            CHECK(reads[k].reference_end <= length);
+
+            // A read without mutations is the reference at its true position
+            if (reads[k].num_snps == 0 && reads[k].num_insertions == 0 && reads[k].num_deletions == 0) {
+                CHECK(reads[k].sequence == reference.substr(reads[k].reference_begin, reads[k].reference_end - reads[k].reference_begin));
+                ++num_exact;
+            }
+        }
+        CHECK(num_exact > 0);
+    }
+}
+
+int main() {
+    const std::vector<std::pair<const char *, void (*)()>> tests = {
+        { "memory planner: whole reference", TestMemoryPlannerWholeReference },
+        { "memory planner: chunks", TestMemoryPlannerChunks },
+        { "memory planner: does not fit", TestMemoryPlannerDoesNotFit },
+        { "engine: a warmed reference builds no more profiles", TestEngineWarmedReference },
+        { "database search: top hits in CPU order", TestDatabaseSearchTopHits },
+        { "cpu smith-waterman: hand-computed matrix", TestCpuSmithWatermanMatrix },
+        { "fasta: records from a pipe", TestFastaFromPipe },
+        { "checkpoint: varint rows round trip", TestCheckpointRoundTrip },
+        { "result cache: key", TestResultCacheKey },
+        { "result cache: eviction", TestResultCacheEviction },
+        { "result cache: disk records and a truncated tail", TestResultCacheDisk },
+        { "hit writer: tabular, SAM and binary output", TestHitWriterFormats },
+        { "thread pool: nested parallel for and a waiter outside the pool", TestThreadPoolNestedWork },
+        { "synthetic data: same output for any thread count", TestSyntheticDeterminism },
+    };
+
+    for (const auto & test : tests) {
+        const int failed_before = failed_checks;
+        try {
+            test.second();
+        } catch (const std::exception & e) {
+            std::cerr << test.first << ": " << e.what() << std::endl;
+            ++failed_checks;
+        }
+        std::cout << (failed_checks == failed_before ? "ok     " : "FAILED ") << test.first << std::endl;
+    }
+
+    if (!temp_directory.empty()) {
+        rmdir(temp_directory.c_str());
+    }
+
+    if (failed_checks > 0) {
+        std::cout << failed_checks << " check(s) failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,247 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+
+#include "numa.h"
+
+namespace {
+    const size_t kNotAWorker = std::numeric_limits<size_t>::max();
+
+    // Fruitless yields before a waiting thread goes to sleep
+    const size_t kIdleSpins = 64;
+
+    thread_local ThreadPool * current_pool = nullptr;
+    thread_local size_t current_worker_index = kNotAWorker;
+}
+
+ThreadPool::ThreadPool(size_t num_threads, bool pin_to_numa_nodes) : pinned_(pin_to_numa_nodes) {
+    num_threads = std::max<size_t>(num_threads, 1);
+
+    for (size_t k = 0; k < num_threads; ++k) {
+        workers_.emplace_back(new Worker());
+    }
+
+    for (size_t k = 0; k < num_threads; ++k) {
+        threads_.emplace_back(&ThreadPool::WorkerLoop, this, k);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        stop_ = true;
+    }
+    sleep_cv_.notify_all();
+    wait_cv_.notify_all();
+
+    for (auto & thread : threads_) {
+        thread.join();
+    }
+}
+
+void ThreadPool::Push(Task task) {
+    size_t index = current_pool == this ? current_worker_index : submitted_ % workers_.size();
+    ++submitted_;
+
+    // Counted before it is visible, so a worker that takes it at once never drives pending_ below
+    // zero; a worker that sees the count first only retries until the push lands
+    ++pending_;
+    {
+        std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+        workers_[index]->deque.push_back(std::move(task));
+    }
+
+    // Taking the sleep mutex orders this against a worker that has just found nothing to do
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    sleep_cv_.notify_one();
+    WakeWaiters();
+}
+
+bool ThreadPool::PopOrSteal(size_t index, Task & task) {
+    const size_t num_workers = workers_.size();
+
+    if (index != kNotAWorker) {
+        Worker & own = *workers_[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.deque.empty()) {
+            task = std::move(own.deque.back());
+            own.deque.pop_back();
+            --pending_;
+            return true;
+        }
+    }
+
+    const size_t first_victim = index != kNotAWorker ? index + 1 : static_cast<size_t>(submitted_.load());
+    for (size_t k = 0; k < num_workers; ++k) {
+        const size_t victim = (first_victim + k) % num_workers;
+        if (victim == index) {
+            continue;
+        }
+
+        Worker & other = *workers_[victim];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (!other.deque.empty()) {
+            task = std::move(other.deque.front());
+            other.deque.pop_front();
+            --pending_;
+            if (index != kNotAWorker) {
+                ++workers_[index]->steals;
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool ThreadPool::RunPendingTask() {
+    const size_t index = current_pool == this ? current_worker_index : kNotAWorker;
+
+    Task task;
+    if (!PopOrSteal(index, task)) {
+        return false;
+    }
+
+    task();
+    if (index != kNotAWorker) {
+        ++workers_[index]->executed;
+    }
+    WakeWaiters(); // one may be waiting on this task
+    return true;
+}
+
+void ThreadPool::HelpOrSleep(size_t & idle_spins, const std::function<bool()> & ready) {
+    if (RunPendingTask()) {
+        idle_spins = 0;
+        return;
+    }
+    if (++idle_spins < kIdleSpins) {
+        std::this_thread::yield();
+        return;
+    }
+    idle_spins = 0;
+
+    ++waiters_;
+    // Pairs with the fence in WakeWaiters: either the thread that queues or finishes a task sees
+    // this waiter and wakes it, or this check sees that task
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    {
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wait_cv_.wait(lock, [this, &ready]() { return stop_ || pending_ > 0 || ready(); });
+    }
+    --waiters_;
+}
+
+void ThreadPool::WakeWaiters() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_ > 0) {
+        // Taking the sleep mutex orders this against a waiter between its check and its wait
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+        }
+        wait_cv_.notify_all();
+    }
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+    current_pool = this;
+    current_worker_index = index;
+    if (pinned_) {
+        PinThreadToNode(index * GetNumaTopology().GetNumNodes() / workers_.size());
+    }
+
+    while (true) {
+        if (RunPendingTask()) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        sleep_cv_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+        if (stop_) {
+            return;
+        }
+    }
+}
+
+void ThreadPool::ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)> & fn) {
+    if (begin >= end) {
+        return;
+    }
+
+    grain = std::max<size_t>(grain, 1);
+    if (end - begin <= grain) {
+        fn(begin, end);
+        return;
+    }
+
+    std::vector<std::future<void>> pieces;
+    pieces.reserve((end - begin + grain - 1) / grain);
+    for (size_t piece_begin = begin; piece_begin < end; piece_begin += grain) {
+        const size_t piece_end = std::min(piece_begin + grain, end);
+        pieces.push_back(Submit([&fn, piece_begin, piece_end]() { fn(piece_begin, piece_end); }));
+    }
+
+    // Let every piece finish before rethrowing, the tasks reference fn
+    std::exception_ptr first_exception;
+    for (auto & piece : pieces) {
+        try {
+            WaitFor(piece);
+        } catch (...) {
+            if (!first_exception) {
+                first_exception = std::current_exception();
+            }
+        }
+    }
+
+    if (first_exception) {
+        std::rethrow_exception(first_exception);
+    }
+}
+
+ThreadPoolStats ThreadPool::GetStats() {
+    ThreadPoolStats stats;
+    for (auto & worker : workers_) {
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            stats.queue_depths.push_back(worker->deque.size());
+        }
+        stats.executed.push_back(worker->executed);
+        stats.steals.push_back(worker->steals);
+    }
+    stats.submitted = submitted_;
+
+    return stats;
+}
+
+ThreadPool & GetThreadPool() {
+    static ThreadPool pool([]() {
+        const char * num_threads = std::getenv("SW_NUM_THREADS");
+        return num_threads ? std::stoul(num_threads) : std::thread::hardware_concurrency();
+    }(), []() {
+        const char * pin_threads = std::getenv("SW_PIN_THREADS");
+        return pin_threads ? std::string(pin_threads) != "0" : GetNumaTopology().GetNumNodes() > 1;
+    }());
+
+    return pool;
+}
+
+void PrintThreadPoolStats(ThreadPool & pool) {
+    ThreadPoolStats stats = pool.GetStats();
+
+    uint64_t total_steals = 0;
+    for (auto steals : stats.steals) {
+        total_steals += steals;
+    }
+
+    std::cout << "Thread pool: " << pool.GetNumThreads() << " thread(s)" << (pool.IsPinned() ? " pinned to " + std::to_string(GetNumaTopology().GetNumNodes()) + " NUMA node(s)" : "") << ", " << stats.submitted << " task(s) submitted, " << total_steals << " steal(s)" << std::endl;
+    for (size_t k = 0; k < stats.executed.size(); ++k) {
+        std::cout << "\t (" << (k+1) << ") : executed " << stats.executed[k] << ", stolen " << stats.steals[k] << ", queued " << stats.queue_depths[k] << "\n";
+    }
+    std::cout << std::flush;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+struct ThreadPoolStats {
+    std::vector<size_t> queue_depths; // per worker, at the time of the call
+    std::vector<uint64_t> executed;   // per worker
+    std::vector<uint64_t> steals;     // per worker, tasks taken from another worker's deque
+    uint64_t submitted = 0;
+};
+
+// Work-stealing pool for the host side. Every worker owns a deque: it pushes and pops its own
+// work at the back and steals from the front of the others when it runs dry. Tasks submitted from
+// outside the pool are dealt round-robin. A thread that waits on pool work (WaitFor, ParallelFor)
+// runs queued tasks in the meantime, so nested parallelism cannot deadlock the pool; once it has
+// found nothing to run for a while it sleeps until a task is queued or finishes.
+//
+// With pin_to_numa_nodes the workers are split into contiguous blocks, one per NUMA node, and each
+// is restricted to the CPUs of its node; neighbouring workers, which a thief tries first, then
+// share a node.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t num_threads = std::thread::hardware_concurrency(), bool pin_to_numa_nodes = false);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool & other) = delete;
+    ThreadPool& operator=(const ThreadPool & other) = delete;
+
+    template <class F>
+    std::future<typename std::result_of<F()>::type> Submit(F && f) {
+        using ResultType = typename std::result_of<F()>::type;
+        auto task = std::make_shared<std::packaged_task<ResultType()>>(std::forward<F>(f));
+        std::future<ResultType> result = task->get_future();
+        Push([task]() { (*task)(); });
+        return result;
+    }
+
+    template <class T>
+    T WaitFor(std::future<T> & future) {
+        auto ready = [&future]() { return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready; };
+        size_t idle_spins = 0;
+        while (!ready()) {
+            HelpOrSleep(idle_spins, ready);
+        }
+        return future.get();
+    }
+
+    // Splits [begin, end) into pieces of at most grain and calls fn(piece_begin, piece_end) on
+    // the pool, returning once every piece is done. Exceptions are rethrown in the caller.
+    void ParallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)> & fn);
+
+    size_t GetNumThreads() { return workers_.size(); }
+    bool IsPinned() { return pinned_; }
+    ThreadPoolStats GetStats();
+
+private:
+    using Task = std::function<void()>;
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> deque;
+        std::atomic<uint64_t> executed{0};
+        std::atomic<uint64_t> steals{0};
+    };
+
+    void Push(Task task);
+    bool PopOrSteal(size_t index, Task & task);
+    bool RunPendingTask();
+    // One step of waiting: runs a queued task, or yields, or after enough idle steps sleeps until
+    // ready() holds or there is work again.
+    void HelpOrSleep(size_t & idle_spins, const std::function<bool()> & ready);
+    void WakeWaiters();
+    void WorkerLoop(size_t index);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    bool pinned_;
+    std::vector<std::thread> threads_;
+
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_cv_;
+    std::condition_variable wait_cv_; // threads asleep in WaitFor
+    std::atomic<size_t> waiters_{0};
+    std::atomic<size_t> pending_{0};
+    std::atomic<uint64_t> submitted_{0};
+    bool stop_ = false;
+};
+
+// Process-wide pool shared by the CPU paths. Sized by SW_NUM_THREADS when set, otherwise by the
+// number of hardware threads. Workers are pinned to NUMA nodes when the machine has more than one,
+// or as SW_PIN_THREADS (0 or 1) says.
+ThreadPool & GetThreadPool();
+
+void PrintThreadPoolStats(ThreadPool & pool);